@@ -26,6 +26,9 @@ struct AABB
 	AABB(const AABB &boundA, const AABB &boundB);
 
 	void expand(const AABB& rhs);
+	AABB intersect(const AABB &rhs) const;
+	AABB clipPolygon(const Vec3f *verts, int count) const;
+	bool isEmpty() const;
 	BoxHit hit(const Ray &ray);
 	float volume() const;
 	Vec3f centroid() const;
@@ -4,57 +4,211 @@
 #include <optional>
 #include <stack>
 #include <list>
+#include <cstdint>
+#include <limits>
 
 #include "Hittable.h"
 #include "AABB.h"
 
-enum class BVHSplitMethod { SAH, Middle, EqualCounts, HLBVH };
+// SAH sweeps every primitive boundary for the best trees, BinnedSAH only evaluates bucket
+// boundaries and builds much faster, HLBVH splits ranges sorted by Morton code in near-linear time.
+// SBVH adds spatial splits that clip primitives into both children
+enum class BVHSplitMethod { SAH, BinnedSAH, Middle, EqualCounts, HLBVH, SBVH };
 
 const int BVHLeafMark = 0x80000000;
+const int BVHWidth = 4;
+const int BVHMaxLeafSize = 4;
+const int BVHNumBuckets = 16;
+// Set in BVHWideNode::leafSize for leaves made of triangles only, which are intersected all
+// at once from their BVHTriangleBlock
+const uint8_t BVHTriangleLeaf = 0x80;
+const uint8_t BVHLeafSizeMask = 0x7f;
+// Rays traversed together by the packet entry points
+const int BVHPacketSize = 8;
+// Extra references SBVH may create by spatial splits, as a fraction of the primitive count
+const float BVHSpatialSplitBudget = 0.3f;
 
+class ThreadPool;
+class TaskGroup;
+struct RayTriangleData;
+
+// Binary build node in depth-first order, the left child of an inner node directly follows it.
+// For inner nodes offset is the index of the right child and count is 0,
+// for leaves [offset, offset + count) is the range of primitives
 struct BVHNode
 {
 	AABB bound;
-	HittablePtr hittable;
-	int size;
+	int offset;
+	int count;
+};
+static_assert(sizeof(BVHNode) == 32);
+
+// Collapsed node of the wide BVH, child bounds are stored in SoA form so that
+// all children can be tested against a ray at once.
+// Slots {0, 1} and {2, 3} come from the two halves of a binary node, splitAxis[0]
+// separates the halves and splitAxis[1], splitAxis[2] separate the slots inside them.
+// A child with BVHLeafMark set is a leaf holding leafSize primitives from the offset in
+// the lower bits, empty slots have inverted bounds. Bit i of shadowMask is set if primitive i
+// of the leaf blocks shadow rays, it fits in the padding of the cache line
+struct alignas(64) BVHWideNode
+{
+	float boundMin[3][BVHWidth];
+	float boundMax[3][BVHWidth];
+	int child[BVHWidth];
+	uint8_t leafSize[BVHWidth];
+	uint8_t shadowMask[BVHWidth];
+	uint8_t splitAxis[3];
+};
+static_assert(sizeof(BVHWideNode) == 128);
+
+// Vertices of the triangles in a leaf in SoA form. Leaves start at multiples of BVHWidth in the
+// primitive array and triangle leaves come before all others, so the block of a triangle leaf
+// at offset is offset / BVHWidth and other leaves have none
+struct alignas(16) BVHTriangleBlock
+{
+	float v0[3][BVHWidth];
+	float v1[3][BVHWidth];
+	float v2[3][BVHWidth];
+};
+static_assert(BVHMaxLeafSize <= BVHWidth);
+
+struct Bucket
+{
+	Bucket() : count(0) {}
+	Bucket(const Bucket& a, const Bucket& b) :
+		count(a.count + b.count), box(a.box, b.box), centBox(a.centBox, b.centBox) {}
+	int count;
+	AABB box;
+	AABB centBox;
+};
+
+struct BuildRec
+{
+	int offset;
+	AABB nodeExtent;
+	int lRange;
+	int rRange;
+};
+
+// Result of splitting a primitive range, splitPoint is the last primitive of the left child
+// or -1 if the range should become a leaf
+struct BVHSplit
+{
+	AABB bound;
+	int splitPoint = -1;
+	AABB lchCentBox;
+	AABB rchCentBox;
+};
+
+struct ObjectSplit
+{
+	float cost = std::numeric_limits<float>::infinity();
+	int dim = -1;
+	float pos;
+	AABB lBound;
+	AABB rBound;
+};
+
+struct SpatialSplit
+{
+	float cost = std::numeric_limits<float>::infinity();
+	int dim = -1;
+	float pos;
 };
 
-struct BVHTableElement
+// Primitive prim of the hittable at index hittable in the list the BVH was built from
+struct BVHPrimitive
 {
-	int misNext;
-	int nodeIndex;
+	int hittable;
+	int prim;
 };
 
 struct HittableInfo
 {
 	AABB bound;
 	Vec3f centroid;
-	HittablePtr hittable;
+	int index;
 };
 
 class BVH
 {
 public:
 	BVH() = default;
-	BVH(const std::vector<HittablePtr> &hittables, BVHSplitMethod method = BVHSplitMethod::SAH);
+	// Large trees are built in parallel on pool if there is one, else on the calling thread
+	BVH(const std::vector<HittablePtr> &hittables, BVHSplitMethod method = BVHSplitMethod::BinnedSAH,
+		float spatialSplitBudget = BVHSpatialSplitBudget, ThreadPool *pool = nullptr);
 
+	// Any hit traversal that returns on the first occluder found. The leaf of the last occluder
+	// is kept per thread and tested before traversing, as consecutive shadow rays are mostly
+	// blocked by the same geometry. Hittables that don't cast shadows are skipped
 	bool testIntersec(const Ray &ray, float dist);
-	std::pair<float, HittablePtr> closestHit(const Ray &ray);
+	HitInfo closestHit(const Ray &ray);
+	// Closest hit without looking up the hittable, for bottom level BVHs over a single mesh
+	std::optional<PrimitiveHit> closestPrimitiveHit(const Ray &ray);
 
-	int size() const { return mTreeSize; }
+	// Packet traversal of up to BVHPacketSize coherent rays, which share every node fetch and test
+	// each child against four rays at once, only diverging at leaves. More rays than that is an
+	// error. occluded8 returns the bit mask of rays blocked before their dist
+	void closestHit8(const Ray *rays, int count, HitInfo *hits);
+	int occluded8(const Ray *rays, const float *dists, int count);
+
+	int size() const { return mNodes.size(); }
 	int depth() const { return mDepth; }
-	AABB box() const { return mTree[0].bound; }
+	float sahCost() const { return mSAHCost; }
+	int numReferences() const { return mNumReferences; }
+	AABB box() const { return mBound; }
 
 private:
-	void quickBuild(std::vector<HittableInfo> &primInfo, const AABB &rootExtent);
-	void standardBuild(std::vector<HittableInfo> &primInfo, const AABB &rootExtent);
-	void buildHitTable();
+	void build(std::vector<HittableInfo> &primInfo, const AABB &rootExtent, ThreadPool *pool);
+	void buildSubtree(std::vector<HittableInfo> &primInfo, const BuildRec &rec, TaskGroup *tasks);
+
+	BVHSplit binnedSplit(HittableInfo *primInfo, int l, int r, const AABB &nodeExtent, TaskGroup *tasks);
+	void binPrimitives(const HittableInfo *primInfo, int l, int r, int splitDim, float axisMin, float axisMax,
+		Bucket *buckets, TaskGroup *tasks);
+	BVHSplit sweepSplit(HittableInfo *primInfo, int l, int r, std::vector<float> &areas);
+	BVHSplit middleSplit(HittableInfo *primInfo, int l, int r, const AABB &nodeExtent);
+	BVHSplit equalCountsSplit(HittableInfo *primInfo, int l, int r, const AABB &nodeExtent);
+	BVHSplit mortonSplit(HittableInfo *primInfo, int l, int r);
+	void sortByMortonCode(std::vector<HittableInfo> &primInfo, const AABB &rootExtent);
+
+	int closestReference(const Ray &ray, float &dist, int &prim, Vec2f &bary);
+	int hitLeaf(int offset, uint8_t leafSize, const Ray &ray, const RayTriangleData &triData,
+		float &dist, int &prim, Vec2f &bary);
+	bool occludedLeaf(int offset, uint8_t leafSize, uint8_t shadowMask, const Ray &ray, const RayTriangleData &triData,
+		float dist);
+	bool occludedByCached(const Ray &ray, const RayTriangleData &triData, float dist);
+	void cacheOccluder(int offset, uint8_t leafSize, uint8_t shadowMask);
+
+	AABB clippedBound(int ref, const AABB &box) const;
+	int createNode(int parent);
+	void spatialSplitBuild(std::vector<HittableInfo> &primInfo);
+	ObjectSplit findObjectSplit(const std::vector<HittableInfo> &refs);
+	SpatialSplit findSpatialSplit(const std::vector<HittableInfo> &refs, const AABB &bound);
+	void performSpatialSplit(const std::vector<HittableInfo> &refs, const AABB &bound, const SpatialSplit &split,
+		std::vector<HittableInfo> &lRefs, std::vector<HittableInfo> &rRefs, int &numRefs, int maxRefs);
+	float computeSAHCost() const;
+	void collapse();
 	
 private:
+	// Identifies the BVH to the per thread occluder caches, BVHs may be rebuilt at the same address
+	uint64_t mId = 0;
 	int mTreeSize = 0;
 	int mDepth = 0;
+	int mStackSize = 0;
+	float mSAHCost = 0.0f;
+	int mNumReferences = 0;
 	BVHSplitMethod mSplitMethod;
+	float mSpatialSplitBudget;
+	AABB mBound;
 
 	std::vector<BVHNode> mTree;
-	std::vector<BVHTableElement> mHitTables[6];
+	std::vector<uint32_t> mMortonCodes;
+	std::vector<BVHWideNode> mNodes;
+	std::vector<BVHTriangleBlock> mTriangleBlocks;
+
+	// In leaf order with leaves padded to BVHWidth, triangle leaves first
+	std::vector<BVHPrimitive> mPrimitives;
+	// In the order the BVH was built from, the raw pointers are what traversal touches
+	std::vector<HittablePtr> mHittables;
+	std::vector<Hittable*> mRawHittables;
 };
\ No newline at end of file
@@ -3,9 +3,8 @@
 #include <iostream>
 #include <optional>
 #include <memory>
-#include <mutex>
 
-#include "Utils/Buffer2D.h"
+#include "Film.h"
 #include "Ray.h"
 #include "Sampler.h"
 #include "Transform.h"
@@ -17,9 +16,6 @@ const float CameraRollSensitivity = 0.05f;
 const float CameraFOVSensitivity = 150.0f;
 const float CameraPitchSensitivity = 88.0f;
 
-using Film = Buffer2D<Spectrum>;
-using FilmLocker = Buffer2D<std::mutex>;
-
 enum class CameraType {
 	Pinhole, ThinLens, Ortho, Panorama
 };
@@ -61,7 +57,6 @@ public:
 	Vec3f pos() const { return mPos; }
 	Vec3f angle() const { return mAngle; }
 	Film& film() { return mFilm; }
-	FilmLocker& filmLocker() { return mFilmLocker; }
 	CameraType type() const { return mType; }
 
 	Vec3f f() const { return mFront; }
@@ -89,7 +84,6 @@ protected:
 protected:
 	CameraType mType;
 	Film mFilm;
-	FilmLocker mFilmLocker;
 
 	Vec3f mPos = Vec3f(0.0f);
 	Vec3f mAngle = { 90.0f, 0.0f, 0.0f };
@@ -41,20 +41,24 @@ private:
 	Spectrum mRadiance;
 };
 
+// Equirectangular HDR map, importance sampled by luminance. Sampling uses a map of samplingWidth
+// columns, at most the width of the image and the full image if 0, which for large HDRIs saves
+// most of the build time and memory for a small loss in sampling quality
 class EnvSphereMapHDR : public Environment {
 public:
-	EnvSphereMapHDR(const char *filePath);
+	EnvSphereMapHDR(const char *filePath, int samplingWidth = 0);
 
 	Spectrum radiance(const Vec3f &dir) { return mSphereMap->getSpherical(dir); }
 	EnvLiSample sampleLi(const Vec2f &u1, const Vec2f &u2);
 	float pdfLi(const Vec3f &wi);
-	float power() { return mDistrib.sum(); }
+	float power() { return mPower; }
 
 private:
-	float getPortion(const Vec3f &wi);
+	void buildDistrib(int samplingWidth);
 
 private:
 	Texture3fPtr mSphereMap;
 	int mWidth, mHeight;
-	PiecewiseIndependent2D mDistrib;
+	float mPower;
+	Piecewise2D mDistrib;
 };
\ No newline at end of file
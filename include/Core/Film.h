@@ -0,0 +1,191 @@
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "Utils/ThreadPool.h"
+#include "Utils/TileScheduler.h"
+#include "Math.h"
+#include "Spectrum.h"
+
+// Side of the square pixel tiles a film is stored in, same as the tiles integrators render
+const int FilmTileSize = 16;
+const int FilmTilePixels = FilmTileSize * FilmTileSize;
+
+// Channels of one pixel: the sum of everything added, the number of samples taken in the pixel
+// and the sum of their squares, which gives the variance of the pixel estimate on the fly.
+// Splats from light paths only go to the sum. Two pixels share a cache line
+struct alignas(32) FilmPixel {
+	void addSample(const Spectrum &val) {
+		sum += val;
+		weight += 1.0f;
+		squaredSum += val * val;
+	}
+
+	void splat(const Spectrum &val) {
+		sum += val;
+	}
+
+	void add(const FilmPixel &pixel) {
+		sum += pixel.sum;
+		weight += pixel.weight;
+		squaredSum += pixel.squaredSum;
+	}
+
+	Spectrum mean() const {
+		return weight > 0.0f ? sum / weight : Spectrum(0.0f);
+	}
+
+	// Variance of the mean of the samples, 0 for less than two samples
+	Spectrum variance() const {
+		if (weight < 2.0f) {
+			return Spectrum(0.0f);
+		}
+		Spectrum mean = sum / weight;
+		return glm::max(squaredSum / weight - mean * mean, Spectrum(0.0f)) / (weight - 1.0f);
+	}
+
+	Spectrum sum = Spectrum(0.0f);
+	float weight = 0.0f;
+	Spectrum squaredSum = Spectrum(0.0f);
+};
+
+// Channels of a pixel as atomic floats, added to with compare and swap loops from any thread.
+// The sums depend on the order of the adds
+struct alignas(32) AtomicPixel {
+	void atomicAddSample(const Spectrum &val) {
+		atomicSplat(val);
+		atomicAdd(weight, 1.0f);
+		for (int i = 0; i < 3; i++) {
+			atomicAdd(squaredSum[i], val[i] * val[i]);
+		}
+	}
+
+	void atomicSplat(const Spectrum &val) {
+		for (int i = 0; i < 3; i++) {
+			atomicAdd(sum[i], val[i]);
+		}
+	}
+
+	// Adds the channels to pixel and clears them
+	void moveTo(FilmPixel &pixel) {
+		for (int i = 0; i < 3; i++) {
+			pixel.sum[i] += sum[i].exchange(0.0f, std::memory_order_relaxed);
+			pixel.squaredSum[i] += squaredSum[i].exchange(0.0f, std::memory_order_relaxed);
+		}
+		pixel.weight += weight.exchange(0.0f, std::memory_order_relaxed);
+	}
+
+	static void atomicAdd(std::atomic<float> &dst, float val) {
+		float old = dst.load(std::memory_order_relaxed);
+		while (!dst.compare_exchange_weak(old, old + val, std::memory_order_relaxed));
+	}
+
+	std::atomic<float> sum[3] = {};
+	std::atomic<float> weight = 0.0f;
+	std::atomic<float> squaredSum[3] = {};
+};
+
+// Channels of a pixel as 64 bit fixed point numbers with FixedPointPixel::Scale steps per unit.
+// Integer sums don't depend on the order of their terms, so pixels added to from many threads
+// come out the same however the adds interleave. Values beyond 2^42 saturate
+struct alignas(64) FixedPointPixel {
+	static constexpr double Scale = 0x1p20;
+
+	void atomicAddSample(const Spectrum &val) {
+		atomicSplat(val);
+		weight.fetch_add(1, std::memory_order_relaxed);
+		for (int i = 0; i < 3; i++) {
+			squaredSum[i].fetch_add(toFixed(val[i] * val[i]), std::memory_order_relaxed);
+		}
+	}
+
+	void atomicSplat(const Spectrum &val) {
+		for (int i = 0; i < 3; i++) {
+			sum[i].fetch_add(toFixed(val[i]), std::memory_order_relaxed);
+		}
+	}
+
+	// Adds the channels to pixel and clears them
+	void moveTo(FilmPixel &pixel) {
+		for (int i = 0; i < 3; i++) {
+			pixel.sum[i] += sum[i].exchange(0, std::memory_order_relaxed) / Scale;
+			pixel.squaredSum[i] += squaredSum[i].exchange(0, std::memory_order_relaxed) / Scale;
+		}
+		pixel.weight += weight.exchange(0, std::memory_order_relaxed);
+	}
+
+	static int64_t toFixed(float val) {
+		const double Limit = 0x1p62;
+		return static_cast<int64_t>(std::llround(std::clamp(val * Scale, -Limit, Limit)));
+	}
+
+	std::atomic<int64_t> sum[3] = {};
+	std::atomic<int64_t> weight = 0;
+	std::atomic<int64_t> squaredSum[3] = {};
+};
+
+// Image that estimates are accumulated in. Pixels are kept in 64 byte aligned tiles of
+// FilmTileSize squared, and tiles in Morton order, so a tile is contiguous in memory and so is
+// every run of tiles the TileScheduler hands to one worker.
+// Memory is not touched when allocated, the first clear places the pages. Clearing with a pool
+// spreads the first touch over the threads of the pool in runs of tiles, which keeps the pages
+// of a run together but doesn't tie them to the thread that will render it: tasks of the pool
+// go to whichever thread is free
+class Film {
+public:
+	Film() = default;
+	Film(const Film&) = delete;
+	Film& operator = (const Film&) = delete;
+
+	void init(int width, int height);
+	void clear();
+	// Clears in parallel, one run of tiles per task
+	void clear(ThreadPool &pool);
+	// Adds the pixels of other to this film and clears other
+	void merge(Film &other, ThreadPool &pool);
+
+	int width() const { return mWidth; }
+	int height() const { return mHeight; }
+	int numTiles() const { return mTileOfBlock.size(); }
+	// Pixels stored, including those of tiles that stick out of the image
+	int numStoredPixels() const { return numTiles() * FilmTilePixels; }
+	// Pixels of the image covered by a tile in storage, tiles are numbered as TileScheduler does
+	Tile tileBounds(int tile) const;
+	// Mean relative standard error of the pixels of a tile. Infinite while any pixel has less than
+	// two samples, as there is no variance to go by
+	float tileError(int tile) const;
+
+	// Storage index of the pixel
+	int index(int x, int y) const {
+		int tile = mTileOfBlock[(y / FilmTileSize) * mTilesX + x / FilmTileSize];
+		return tile * FilmTilePixels + (y % FilmTileSize) * FilmTileSize + x % FilmTileSize;
+	}
+	// Storage index of the pixel at uv in [0, 1)^2
+	int index(const Vec2f &uv) const {
+		int x = std::min(static_cast<int>(uv.x * mWidth), mWidth - 1);
+		int y = std::min(static_cast<int>(uv.y * mHeight), mHeight - 1);
+		return index(x, y);
+	}
+
+	FilmPixel& operator [] (int index) { return mPixels[index]; }
+	const FilmPixel& operator [] (int index) const { return mPixels[index]; }
+	FilmPixel& operator () (int x, int y) { return mPixels[index(x, y)]; }
+	const FilmPixel& operator () (int x, int y) const { return mPixels[index(x, y)]; }
+
+private:
+	struct AlignedDelete {
+		void operator () (FilmPixel *pixels) const;
+	};
+
+	int mWidth = 0;
+	int mHeight = 0;
+	int mTilesX = 0;
+	// Position of each tile of the image in storage, tiles of the image row by row, and back
+	std::vector<int> mTileOfBlock;
+	std::vector<int> mBlockOfTile;
+	std::unique_ptr<FilmPixel[], AlignedDelete> mPixels;
+};
@@ -8,6 +8,15 @@
 #include "AABB.h"
 #include "Transform.h"
 
+// Hit on a single primitive. For triangles bary holds the barycentric coordinates of the
+// second and third vertex as found by the intersection test, other shapes leave it zero.
+// prim is the primitive that was hit, which is one inside the mesh for instances
+struct PrimitiveHit {
+	float dist;
+	Vec2f bary;
+	int prim;
+};
+
 enum class HittableType {
 	Object, Light, Shape
 };
@@ -24,6 +33,29 @@ public:
 	virtual Vec2f surfaceUV(const Vec3f &p) = 0;
 	virtual AABB bound() = 0;
 
+	// A hittable may hold many primitives, like all triangles of a mesh behind one MeshObject.
+	// The BVH references (hittable, primitive) pairs and hands the primitive of a hit back,
+	// single shapes have one primitive and ignore the index
+	virtual int numPrimitives() { return 1; }
+	virtual AABB primitiveBound(int prim) { return bound(); }
+	virtual std::optional<PrimitiveHit> primitiveHit(const Ray &ray, int prim) {
+		auto dist = closestHit(ray);
+		return dist ? PrimitiveHit{ dist.value(), Vec2f(0.0f), prim } : std::optional<PrimitiveHit>();
+	}
+	// Whether the primitive blocks the ray before dist, any hit will do
+	virtual bool primitiveOccluded(const Ray &ray, int prim, float dist) {
+		auto hit = primitiveHit(ray, prim);
+		return hit.has_value() && hit->dist < dist;
+	}
+	// Bound of the part of the primitive inside box, used by spatial splits when building BVHs
+	virtual AABB clippedBound(int prim, const AABB &box) { return primitiveBound(prim).intersect(box); }
+	// Writes the vertices in the space of the BVH if the primitive is a triangle,
+	// which lets the BVH intersect it with others in its SIMD triangle blocks
+	virtual bool worldTriangle(int prim, Vec3f *verts) { return false; }
+	// Hittables that don't cast shadows are still found by closest hit queries but never block
+	// shadow rays. Read once when BVHs are built
+	virtual bool castsShadows() { return true; }
+
 	HittableType type() const { return mType; }
 
 	virtual void setTransform(const Transform& trans) { mTransform = trans; }
@@ -35,4 +67,13 @@ protected:
 	HittableType mType;
 };
 
-using HittablePtr = std::shared_ptr<Hittable>;
\ No newline at end of file
+using HittablePtr = std::shared_ptr<Hittable>;
+
+// Closest hit of a ray, prim and bary locate the hit on the primitive of hittable
+// so that surface evaluation doesn't have to find it again from the position
+struct HitInfo {
+	float dist;
+	HittablePtr hittable;
+	int prim;
+	Vec2f bary;
+};
\ No newline at end of file
@@ -2,11 +2,14 @@
 
 #include <thread>
 #include <mutex>
+#include <atomic>
 
 #include "Utils/ObjReader.h"
 #include "Utils/Error.h"
 #include "Utils/Buffer2D.h"
 #include "Utils/Timer.h"
+#include "Utils/ThreadPool.h"
+#include "Utils/TileScheduler.h"
 #include "Camera.h"
 #include "Texture.h"
 #include "Object.h"
@@ -17,6 +20,7 @@
 #include "BVH.h"
 #include "Scene.h"
 #include "Sampler.h"
+#include "PiecewiseDistrib.h"
 
 const int MaxThreads = std::thread::hardware_concurrency();
 const int TracingDepthLimit = 64;
@@ -34,6 +38,29 @@ enum class IntegratorType {
 	VCM
 };
 
+// How contributions that may land on any pixel are added to the film from several threads
+enum class FilmSplatMode {
+	// A mutex per pixel
+	Locked,
+	// Compare and swap on every channel of an atomic copy of the film, added to the film when
+	// the pass ends
+	Atomic,
+	// Every thread adds to its own full resolution buffer, buffers are summed into the film
+	// when the pass ends
+	PerThread,
+	// Atomic adds to a fixed point copy of the film, added to the film when the pass ends. The
+	// result doesn't depend on the order of the adds, which makes renders repeat bit for bit
+	// with any number of threads
+	FixedPoint
+};
+
+struct AdaptiveParam {
+	// Relative standard error every tile has to reach, 0 to sample the whole image every pass
+	float targetError = 0.0f;
+	// Samples per pixel taken everywhere before the errors are trusted
+	int minSpp = 8;
+};
+
 class Integrator {
 public:
 	Integrator(ScenePtr scene, IntegratorType type) : mScene(scene), mType(type) {}
@@ -41,20 +68,76 @@ public:
 
 	bool isFinished() const { return mFinished; }
 	Film &result() { return mScene->mCamera->film(); }
+	// Radiance estimate of a pixel so far
+	Spectrum estimate(int x, int y);
+	// Mean relative standard error of the tiles of the image, infinite while it can't be told
+	// and always for integrators that splat light paths
+	float imageError();
+	// Whether contributions of light paths are splatted. Splats add to the sum of a pixel but
+	// not to its sample count and squared sum, so its variance can't be estimated
+	virtual bool splatsLightPaths() const { return false; }
+
+	// Fraction of the sample limit rendered, negative without a limit
+	virtual float completion() const { return -1.0f; }
+	// Whether renderOnePass traces only the fraction of a pass given to setPassFraction
+	virtual bool partialPasses() const { return false; }
+	void setPassFraction(float fraction) { mPassFraction = fraction; }
 	IntegratorType getType() const { return mType; }
 
 	void setModified();
 	virtual void reset() = 0;
-	virtual void addToFilmLocked(const Vec2f &uv, const Spectrum &val);
+	// Add val to the pixel at uv in the way mSplatMode selects, may be called from any task
+	// of a pass enclosed by beginSplatting and endSplatting. A splat only adds to the sum of
+	// the pixel, a sample is one estimate of the pixel and counts towards its variance
+	void splatToFilm(const Vec2f &uv, const Spectrum &val);
+	void addSampleToFilm(const Vec2f &uv, const Spectrum &val);
 	void addToDebugBuffer(int index, const Vec2f &uv, const Spectrum &val);
 	void addToDebugBuffer(int index, const Vec2i &pixel, const Spectrum &val);
 
+protected:
+	// Pool to run the tasks of a pass on, one with mThreads - 1 workers is made if none was given
+	ThreadPool &pool();
+
+	void beginSplatting();
+	void endSplatting();
+	// Add a sample to the film pixel of a tile the caller owns. Locked splats of the same pass
+	// write the film directly, so the pixel's lock is taken in that mode
+	void addSampleToPixel(int x, int y, const Spectrum &val);
+
+	// tileError of every tile of the film
+	std::vector<float> tileErrors();
+	// Paths of a full pass cut down to the pass fraction
+	int passPaths(int paths) const { return std::max(1, static_cast<int>(paths * mPassFraction)); }
+	// Runs trace(first, count) on the pool for one contiguous share per thread of the paths of
+	// a pass, which are numbered from 0 whatever the number of threads
+	template<typename Func>
+	void tracePaths(int paths, Func &&trace) {
+		TaskGroup tasks(pool());
+		for (int i = 0; i < mThreads; i++) {
+			int first = static_cast<int64_t>(paths) * i / mThreads;
+			int last = static_cast<int64_t>(paths) * (i + 1) / mThreads;
+			if (first < last) {
+				tasks.run([&trace, first, last]() { trace(first, last - first); });
+			}
+		}
+		tasks.wait();
+	}
+
+private:
+	int splatSlot();
+	template<bool IsSample>
+	void addToFilm(const Vec2f &uv, const Spectrum &val);
+
 public:
 	SamplerPtr mSampler;
 	float mResultScale = 1.0f;
 	int mThreads = 1;
+	// Job system shared by every integrator of the application, the thread waiting for
+	// a task group takes part in running its tasks
+	std::shared_ptr<ThreadPool> mPool;
+	FilmSplatMode mSplatMode = FilmSplatMode::Atomic;
 
-	std::vector<Film> mDebugBuffers;
+	std::vector<Buffer2D<Spectrum>> mDebugBuffers;
 	std::vector<Buffer2D<std::mutex>> mDebugBufLockers;
 
 protected:
@@ -62,6 +145,22 @@ protected:
 	ScenePtr mScene;
 	bool mModified = true;
 	bool mFinished = false;
+	// Pixels are estimated by their own mean instead of the sum over mResultScale, set
+	// when pixels get different sample counts
+	bool mPerPixelMean = false;
+	float mPassFraction = 1.0f;
+
+private:
+	std::unique_ptr<std::mutex[]> mFilmLocks;
+	int mFilmLockCount = 0;
+	// One buffer for each thread that may run tasks of the pool, taken on a thread's first splat
+	std::vector<std::unique_ptr<Film>> mSplatBuffers;
+	std::atomic<int> mSplatSlots = 0;
+	uint64_t mSplatPass = 0;
+	std::unique_ptr<AtomicPixel[]> mAtomicPixels;
+	int mAtomicCount = 0;
+	std::unique_ptr<FixedPointPixel[]> mFixedPointPixels;
+	int mFixedPointCount = 0;
 };
 
 using IntegratorPtr = std::shared_ptr<Integrator>;
@@ -72,20 +171,26 @@ public:
 	void renderOnePass();
 	virtual Spectrum tracePixel(Ray ray, SamplerPtr sampler) = 0;
 	virtual void scaleResult();
+	float completion() const { return mLimitSpp ? static_cast<float>(mCurspp) / mMaxSpp : -1.0f; }
 
 	void reset() { setModified(); }
 
 private:
-	void doTracing(int start, int end, SamplerPtr sampler);
+	// Traces the tiles the scheduler hands to worker until none are left in this pass
+	void doTracing(int worker, SamplerPtr sampler);
+	void traceTile(const Tile &tile, SamplerPtr sampler);
 
 public:
 	bool mLimitSpp = false;
+	AdaptiveParam mAdaptive;
 
 protected:
 	const int mMaxSpp;
 	int mCurspp = 0;
 	int mWidth, mHeight;
-	Vec2i mPixelPos;
+
+private:
+	TileScheduler mTiles;
 };
 
 struct PathIntegParam {
@@ -113,10 +218,85 @@ public:
 	PathIntegrator2(ScenePtr scene, int maxSpp, int pathsOnePass) :
 		mMaxSpp(maxSpp), mPathsOnePass(pathsOnePass), Integrator(scene, IntegratorType::Path) {}
 	void renderOnePass();
+	float completion() const { return mMaxSpp ? mParam.spp / mMaxSpp : -1.0f; }
+	bool partialPasses() const { return true; }
 	void reset();
 
 private:
 	void trace(int paths, SamplerPtr sampler);
+	Vec2f sampleFilm(Sampler *sampler);
+
+public:
+	PathIntegParam mParam;
+	AdaptiveParam mAdaptive;
+
+private:
+	int mMaxSpp;
+	int mPathsOnePass;
+	// Tiles of the film weighted by their error once sampling turned adaptive
+	Piecewise1D mTileDistrib;
+	bool mAdapting = false;
+};
+
+enum class WavefrontStage {
+	Generate, Intersect, Shade, Shadow, Accumulate, Count
+};
+
+// Path states in SoA form, entry i of every array belongs to path i of the wavefront
+struct WavefrontPaths {
+	void resize(int size);
+
+	std::vector<Vec2f> uv;
+	std::vector<uint64_t> sampleIndex;
+	std::vector<int> sampleDim;
+	std::vector<Ray> ray;
+	std::vector<HitInfo> hit;
+	std::vector<Vec3f> pos;
+	std::vector<SurfaceInfo> surface;
+	std::vector<int> bounce;
+	std::vector<Spectrum> throughput;
+	std::vector<Spectrum> radiance;
+	std::vector<float> etaScale;
+	// Of the last BSDF sample, needed once the next hit is known
+	std::vector<float> bsdfPdf;
+	std::vector<float> etaFactor;
+	std::vector<float> rrWeight;
+	std::vector<uint8_t> deltaBounce;
+	// Direct lighting waiting for its shadow ray, added to radiance if the ray gets through
+	std::vector<ShadowRay> shadowRay;
+	std::vector<Spectrum> shadowRadiance;
+};
+
+// Path tracer that advances all paths of a pass together, one stage at a time, instead of
+// following each path to its end: generate camera rays, intersect, shade, trace shadow rays,
+// accumulate. Every stage is a parallel loop over a queue of paths, rays are intersected in
+// packets and surfaces are shaded sorted by material. Draws the same sample dimensions as
+// PathIntegrator2 and makes the same images, except with BSDFs that draw samples to evaluate,
+// which PathIntegrator2 only evaluates toward unblocked lights
+class WavefrontPathIntegrator : public Integrator {
+public:
+	WavefrontPathIntegrator(ScenePtr scene, int maxSpp, int pathsOnePass) :
+		mMaxSpp(maxSpp), mPathsOnePass(pathsOnePass), Integrator(scene, IntegratorType::Path) {}
+	void renderOnePass();
+	float completion() const { return mMaxSpp ? mParam.spp / mMaxSpp : -1.0f; }
+	bool partialPasses() const { return true; }
+	void reset();
+
+	// Seconds spent in each stage since the last reset
+	double stageTime(WavefrontStage stage) const { return mStageTime[static_cast<int>(stage)]; }
+
+private:
+	void traceWave(int paths, uint64_t firstSample);
+	void generate(int paths, uint64_t firstSample);
+	void intersect();
+	void shade();
+	void traceShadowRays();
+	void accumulate(int paths);
+	bool resolveHit(int path, Sampler *sampler);
+	bool scatter(int path, Sampler *sampler);
+
+	template<typename Func>
+	void parallelFor(int count, Func &&func);
 
 public:
 	PathIntegParam mParam;
@@ -124,12 +304,19 @@ public:
 private:
 	int mMaxSpp;
 	int mPathsOnePass;
+	WavefrontPaths mPaths;
+	// Paths still alive and paths with a pending shadow ray
+	std::vector<int> mActive;
+	std::vector<int> mShadowQueue;
+	std::vector<SamplerPtr> mChunkSamplers;
+	double mStageTime[static_cast<int>(WavefrontStage::Count)] = {};
 };
 
 struct LightPathIntegParam {
 	bool russianRoulette = true;
 	int rrStartDepth = 3;
 	int maxDepth = 5;
+	int maxSpp = 0;
 };
 
 class LightPathIntegrator : public Integrator {
@@ -137,10 +324,13 @@ public:
 	LightPathIntegrator(ScenePtr scene, int pathsOnePass) :
 		mPathsOnePass(pathsOnePass), Integrator(scene, IntegratorType::LightPath) {}
 	void renderOnePass();
+	float completion() const;
+	bool partialPasses() const { return true; }
+	bool splatsLightPaths() const { return true; }
 	void reset();
 
 private:
-	void trace(SamplerPtr sampler);
+	void trace(int paths, SamplerPtr sampler);
 	void traceOnePath(Sampler* sampler);
 
 public:
@@ -174,6 +364,7 @@ public:
 		PixelIndependentIntegrator(scene, maxSpp, IntegratorType::BDPT) {}
 	Spectrum tracePixel(Ray ray, SamplerPtr sampler);
 	void scaleResult() override;
+	bool splatsLightPaths() const { return true; }
 
 	void initDebugBuffers(int width, int height);
 
@@ -182,7 +373,6 @@ private:
 
 public:
 	BDPTIntegParam mParam;
-	SamplerPtr mLightSampler;
 };
 
 class BDPTIntegrator2 : public Integrator {
@@ -190,6 +380,9 @@ public:
 	BDPTIntegrator2(ScenePtr scene, int maxSpp, int pathsOnePass) :
 		mMaxSpp(maxSpp), mPathsOnePass(pathsOnePass), Integrator(scene, IntegratorType::BDPT) {}
 	void renderOnePass();
+	float completion() const { return mMaxSpp ? mParam.spp / mMaxSpp : -1.0f; }
+	bool partialPasses() const { return true; }
+	bool splatsLightPaths() const { return true; }
 	void reset();
 
 private:
@@ -220,6 +413,9 @@ public:
 	TriplePathIntegrator(ScenePtr scene, int maxSpp, int pathsOnePass) :
 		mMaxSpp(maxSpp), mPathsOnePass(pathsOnePass), Integrator(scene, IntegratorType::TPT) {}
 	void renderOnePass();
+	float completion() const { return mMaxSpp ? mParam.spp / mMaxSpp : -1.0f; }
+	bool partialPasses() const { return true; }
+	bool splatsLightPaths() const { return true; }
 	void reset();
 
 private:
@@ -255,6 +451,8 @@ public:
 	AOIntegrator2(ScenePtr scene, int maxSpp, int pathsOnePass) :
 		mMaxSpp(maxSpp), mPathsOnePass(pathsOnePass), Integrator(scene, IntegratorType::AO) {}
 	void renderOnePass();
+	float completion() const { return mMaxSpp ? mParam.spp / mMaxSpp : -1.0f; }
+	bool partialPasses() const { return true; }
 	void reset();
 
 private:
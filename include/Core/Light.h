@@ -38,12 +38,22 @@ public:
 	float surfaceArea() { return shape->surfaceArea(); }
 	Vec2f surfaceUV(const Vec3f &p) { return shape->surfaceUV(p); }
 	AABB bound() { return shape->bound(); }
+	AABB clippedBound(int prim, const AABB &box) override { return shape->clippedBound(prim, box); }
+	bool worldTriangle(int prim, Vec3f *verts) override { return shape->worldTriangle(prim, verts); }
+	bool castsShadows() override { return mCastsShadows; }
+	// Lights flagged invisible to shadow rays, like emitters behind a lamp shade or the
+	// triangles of a light mesh that would shade each other, don't block the light of others
+	void setCastsShadows(bool castsShadows) { mCastsShadows = castsShadows; }
 
 	void setTransform(const Transform& trans) override {
 		mTransform = trans;
 		shape->setTransform(trans);
 	}
 
+	// Cone containing the normals of the emitting surface, as its axis and the cosine of its
+	// half angle
+	std::pair<Vec3f, float> normalBounds();
+
 	Spectrum getPower(){ return mPower; }
 	float luminance() { return Math::luminance(mPower); }
 	
@@ -56,6 +66,7 @@ public:
 protected:
 	HittablePtr shape;
 	Vec3f mPower;
+	bool mCastsShadows = true;
 };
 
 using LightPtr = std::shared_ptr<Light>;
\ No newline at end of file
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+#include <optional>
+#include <unordered_map>
+#include <cstdint>
+
+#include "Light.h"
+#include "AABB.h"
+
+// Where the lights of a subtree are, how much they emit and in which directions: the normals of
+// the emitters lie within cosThetaO of w, and each emits up to cosThetaE away from its normal
+struct LightBounds
+{
+	LightBounds() = default;
+	LightBounds(const AABB &bound, const Vec3f &w, float phi, float cosThetaO, float cosThetaE) :
+		bound(bound), w(w), phi(phi), cosThetaO(cosThetaO), cosThetaE(cosThetaE) {}
+	LightBounds(const LightBounds &a, const LightBounds &b);
+
+	// Upper bound of the light the subtree casts on p, with the cosine at a receiver of normal n
+	// if n is not zero
+	float importance(const Vec3f &p, const Vec3f &n) const;
+	// Solid angle measure of the emitted directions, weighs the surface area in the build cost
+	float orientationMeasure() const;
+
+	AABB bound;
+	Vec3f w = Vec3f(0.0f);
+	float phi = 0.0f;
+	float cosThetaO = 1.0f;
+	float cosThetaE = 1.0f;
+};
+
+// Binary node in depth-first order, the left child of an inner node directly follows it and
+// offset is the index of the right child. For leaves offset is the index of the light
+struct LightBVHNode
+{
+	LightBounds bounds;
+	int offset;
+	bool leaf;
+};
+
+// Tree of bounding boxes and cones over the lights of a scene ("Importance Sampling of Many Lights
+// with Adaptive Tree Splitting", Conty Estevez and Kulla 2018, in the form of pbrt-v4).
+// A light is sampled by walking down from the root, picking each child in proportion to the
+// importance of its bounds at the shading point, so nearby lights facing the point are picked far
+// more often than by power alone. pdf walks down the same path, kept as the bits of the children
+// taken, to give the probability of any light
+class LightBVH
+{
+public:
+	LightBVH() = default;
+	LightBVH(const std::vector<LightPtr> &lights);
+
+	// Index into the lights it was built from and its probability, none if no light reaches p
+	std::optional<std::pair<int, float>> sample(const Vec3f &p, const Vec3f &n, float u) const;
+	float pdf(const Vec3f &p, const Vec3f &n, const Light *light) const;
+
+	bool empty() const { return mNodes.empty(); }
+	int size() const { return mNodes.size(); }
+
+private:
+	// Builds the subtree over lights [begin, end) and returns the index of its root, recording
+	// the bit trail of each light by its index in trails
+	int build(std::vector<std::pair<int, LightBounds>> &lights, int begin, int end,
+		uint64_t bitTrail, int depth, std::vector<uint64_t> &trails);
+
+private:
+	std::vector<LightBVHNode> mNodes;
+	// Bits of the children taken from the root down to each light, the lowest for the root.
+	// Lights that emit nothing are not in the tree
+	std::unordered_map<const Light*, uint64_t> mBitTrails;
+};
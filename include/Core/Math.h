@@ -7,6 +7,10 @@
 #include <tuple>
 #include <cmath>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #include "glmIncluder.h"
 #include "Utils/NamespaceDecl.h"
 #include "Utils/RandomGenerator.h"
@@ -65,9 +69,49 @@ bool isInf(float v);
 
 glm::mat3 localToWorldFrame(const Vec3f &N);
 
-uint32_t inverseBits(uint32_t bits);
+inline uint32_t inverseBits(uint32_t bits) {
+	bits = (bits << 16u) | (bits >> 16u);
+	bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+	bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+	bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+	bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+	return bits;
+}
+
 float radicalInverse(uint32_t bits);
 
+// Index of the lowest set bit, bits must not be zero
+inline int countTrailingZeros(uint64_t bits) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return static_cast<int>(index);
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanForward(&index, static_cast<uint32_t>(bits))) {
+		return static_cast<int>(index);
+	}
+	_BitScanForward(&index, static_cast<uint32_t>(bits >> 32));
+	return static_cast<int>(index) + 32;
+#else
+	return __builtin_ctzll(bits);
+#endif
+}
+
+// 64 bit finalizer, every bit of the input affects every bit of the result
+inline uint64_t mixBits(uint64_t v) {
+	v ^= v >> 31;
+	v *= 0x7fb5d329728ea185ull;
+	v ^= v >> 27;
+	v *= 0x81dadef4bc2dd44dull;
+	v ^= v >> 33;
+	return v;
+}
+
+inline uint64_t hash(uint32_t a, uint32_t b, uint32_t c = 0) {
+	return mixBits((static_cast<uint64_t>(a) << 32 | b) ^ mixBits(c));
+}
+
 float satDot(const Vec3f &a, const Vec3f &b);
 float absDot(const Vec3f &a, const Vec3f &b);
 
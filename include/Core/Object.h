@@ -6,13 +6,14 @@
 #include "SurfaceInfo.h"
 #include "Shape.h"
 #include "BSDF.h"
+#include "BVH.h"
 
 class Object: public Hittable {
 public:
 	Object(HittablePtr shape, BSDFPtr material):
 		shape(shape), material(material), Hittable(HittableType::Object) {}
 
-	SurfaceInfo surfaceInfo(const Vec3f &x) {
+	virtual SurfaceInfo surfaceInfo(const Vec3f &x, int prim, const Vec2f &bary) {
 		Vec2f uv = shape->surfaceUV(x);
 		return SurfaceInfo({ uv.x, 1.0f - uv.y }, shape->normalShading(x), shape->normalGeom(x), material);
 	}
@@ -50,9 +51,86 @@ public:
 		return shape->bound();
 	}
 
+	AABB clippedBound(int prim, const AABB &box) override {
+		return shape->clippedBound(prim, box);
+	}
+
+	bool worldTriangle(int prim, Vec3f *verts) override {
+		return shape->worldTriangle(prim, verts);
+	}
+
 protected:
 	HittablePtr shape;
 	BSDFPtr material;
 };
 
-using ObjectPtr = std::shared_ptr<Object>;
\ No newline at end of file
+using ObjectPtr = std::shared_ptr<Object>;
+
+// All triangles of a mesh sharing one material. The triangles are primitives of this single
+// hittable and only reached through the BVH, there is no object per triangle
+class MeshObject : public Object {
+public:
+	MeshObject(TriangleMeshPtr mesh, BSDFPtr material) :
+		mMesh(mesh), Object(nullptr, material) {}
+
+	SurfaceInfo surfaceInfo(const Vec3f &x, int prim, const Vec2f &bary) override;
+
+	std::optional<float> closestHit(const Ray &ray) override;
+	Vec3f uniformSample(const Vec2f &u) override;
+	Vec3f normalGeom(const Vec3f &p) override;
+	Vec3f normalShading(const Vec3f &p) override;
+	float surfaceArea() override;
+	Vec2f surfaceUV(const Vec3f &p) override;
+	AABB bound() override;
+
+	int numPrimitives() override { return mMesh->numTriangles(); }
+	AABB primitiveBound(int prim) override;
+	std::optional<PrimitiveHit> primitiveHit(const Ray &ray, int prim) override;
+	AABB clippedBound(int prim, const AABB &box) override;
+	bool worldTriangle(int prim, Vec3f *verts) override;
+
+	void setTransform(const Transform &trans) override {}
+
+private:
+	TriangleMeshPtr mMesh;
+};
+
+// Placement of a shared object space mesh in the scene. The mesh has one bottom level BVH for
+// all its instances and rays are moved into object space to traverse it, so the top level BVH
+// over instances is the only thing rebuilt when an instance moves
+class MeshInstance : public Object {
+public:
+	MeshInstance(TriangleMeshPtr mesh, BSDFPtr material, const Transform &transform);
+
+	SurfaceInfo surfaceInfo(const Vec3f &x, int prim, const Vec2f &bary) override;
+
+	std::optional<float> closestHit(const Ray &ray) override;
+	Vec3f uniformSample(const Vec2f &u) override;
+	Vec3f normalGeom(const Vec3f &p) override;
+	Vec3f normalShading(const Vec3f &p) override;
+	float surfaceArea() override;
+	Vec2f surfaceUV(const Vec3f &p) override;
+	AABB bound() override;
+
+	std::optional<PrimitiveHit> primitiveHit(const Ray &ray, int prim) override;
+	bool primitiveOccluded(const Ray &ray, int prim, float dist) override;
+	AABB clippedBound(int prim, const AABB &box) override { return bound().intersect(box); }
+	bool worldTriangle(int prim, Vec3f *verts) override { return false; }
+
+	void setTransform(const Transform &trans) override { mTransform = trans; }
+
+	TriangleMeshPtr mesh() const { return mMesh; }
+	std::shared_ptr<BVH> meshBvh() const { return mMeshBvh; }
+	void setMeshBvh(std::shared_ptr<BVH> bvh) { mMeshBvh = bvh; }
+
+private:
+	// The direction is not normalized so that distances along the ray stay the same
+	Ray toObjectSpace(const Ray &ray) const;
+
+private:
+	TriangleMeshPtr mMesh;
+	std::shared_ptr<BVH> mMeshBvh;
+	AABB mMeshBound;
+};
+
+using MeshInstancePtr = std::shared_ptr<MeshInstance>;
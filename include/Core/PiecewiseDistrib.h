@@ -22,15 +22,40 @@ private:
     float sumDistrib;
 };
 
-class PiecewiseIndependent2D {
+// Piecewise constant distribution over [0, 1]^2 divided into width x height cells. Rows are
+// picked by a marginal alias table and columns by the conditional alias table of the row, the
+// tables of all rows sharing one flat array. The density of every cell is tabulated so that
+// pdf is a single lookup
+class Piecewise2D {
 public:
-    PiecewiseIndependent2D() = default;
-    PiecewiseIndependent2D(float *pdf, int width, int height);
+    Piecewise2D() = default;
+    // The weights, in rows, become the table of densities
+    Piecewise2D(std::vector<float> &&weights, int width, int height);
+
+    // Point uniformly distributed inside the sampled cell. The cell is picked by u1.x for the
+    // row and u2.x for the column, the fractions left over place the point inside it
+    Vec2f sample(const Vec2f &u1, const Vec2f &u2) const;
+    // Density over [0, 1]^2
+    float pdf(const Vec2f &p) const;
+    float sum() const { return mSum; }
+    int width() const { return mWidth; }
+    int height() const { return mHeight; }
 
-    std::pair<int, int> sample(const Vec2f &u1, const Vec2f &u2) const;
-    float sum() const { return colTable.sum(); }
+private:
+    // Cell i is kept if the coin is below threshold, else the alias is taken
+    struct Entry {
+        float threshold;
+        int alias;
+    };
+    static float buildAlias(const float *weights, int n, Entry *table, std::vector<float> &scaled,
+        std::vector<int> &small, std::vector<int> &large);
+    static int sampleAlias(const Entry *table, int n, const Vec2f &u, float &offset);
 
 private:
-    std::vector<Piecewise1D> rowTables;
-    Piecewise1D colTable;
+    int mWidth = 0;
+    int mHeight = 0;
+    float mSum = 0.0f;
+    std::vector<Entry> mMarginal;
+    std::vector<Entry> mConditional;
+    std::vector<float> mPdf;
 };
\ No newline at end of file
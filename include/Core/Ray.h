@@ -6,6 +6,9 @@
 #include "glmIncluder.h"
 
 const float RayOffset = 1e-4f;
+// Shadow rays stop short of their target by this fraction of the distance,
+// so that the surface they connect to is not reported as an occluder
+const float ShadowRayEpsilon = 1e-4f;
 
 struct Ray {
 	Ray() = default;
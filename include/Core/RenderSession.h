@@ -0,0 +1,56 @@
+#pragma once
+
+#include <functional>
+
+#include "Integrator.h"
+#include "Utils/Timer.h"
+
+// Limits of a render besides the sample limit of the integrator
+struct RenderBudget {
+	// Wall clock seconds, 0 for unlimited
+	double seconds = 0.0;
+	// Integrator::imageError to stop at, 0 for none
+	float targetError = 0.0f;
+};
+
+struct RenderProgress {
+	int passes;
+	double elapsed;
+	// Estimated seconds until the first of the limits is met, negative if none can be estimated
+	double remaining;
+	// Over the last pass
+	double raysPerSecond;
+	float error;
+};
+
+using ProgressCallback = std::function<void(const RenderProgress&)>;
+
+// Renders passes of an integrator until it finishes or the budget is met. Pass times are
+// measured so that the pass that would run over the time budget is cut short if the integrator
+// can trace part of a pass, or skipped if ending without it is closer to the budget
+class RenderSession {
+public:
+	RenderSession(IntegratorPtr integrator, const RenderBudget &budget, ProgressCallback progress = nullptr) :
+		mIntegrator(integrator), mBudget(budget), mProgress(progress) {}
+
+	// Renders one pass, false if there was none left to render
+	bool renderPass();
+	void run() { while (renderPass()); }
+
+	int passes() const { return mPasses; }
+	double elapsed() const { return mTimer.get(); }
+
+private:
+	float nextPassFraction();
+	double estimateRemaining(double elapsed, float error) const;
+
+private:
+	IntegratorPtr mIntegrator;
+	RenderBudget mBudget;
+	ProgressCallback mProgress;
+	Timer mTimer;
+	int mPasses = 0;
+	// Seconds of a full pass, measured on the passes so far
+	double mPassTime = 0.0;
+	bool mErrorMet = false;
+};
@@ -9,7 +9,7 @@
 #include "Math.h"
 
 enum class SamplerType {
-	Independent, SimpleSobol
+	Independent, SimpleSobol, ZSobol
 };
 
 class Sampler;
@@ -35,6 +35,12 @@ public:
 	virtual void setPixel(int x, int y) = 0;
 	virtual void nextSample() = 0;
     virtual void nextSamples(size_t samples) {}
+	// Index of the current sample and its next dimension. Integrators advancing many paths in
+	// turns keep them per path and restore them with setSample, so that one sampler serves all
+	// the paths. Samplers without sample indices ignore them and just continue
+	virtual uint64_t sampleIndex() const { return 0; }
+	virtual int dimension() const { return 0; }
+	virtual void setSample(uint64_t index, int dim) {}
 	virtual bool isProgressive() const = 0;
 	virtual SamplerPtr copy() = 0;
 
@@ -44,42 +50,113 @@ private:
 	SamplerType type;
 };
 
+// Uniform random numbers from a PCG32 that is restarted at every sample, on a sequence chosen
+// by a hash of the pixel and an offset by a hash of the sample index. Every dimension of every
+// sample is a fixed number, so renders repeat exactly however the work is split among threads
 class IndependentSampler : public Sampler {
 public:
-    IndependentSampler();
+    IndependentSampler(uint32_t seed = 0);
 
     float get1();
 
-    void setPixel(int x, int y) { rng.seed(globalRandomEngine()); }
-    void nextSample() { rng.seed(globalRandomEngine()); }
-    void nextSamples(size_t samples) override { rng.seed(globalRandomEngine()); }
+    void setPixel(int x, int y);
+    void nextSample();
+    void nextSamples(size_t samples) override;
+    uint64_t sampleIndex() const override { return index; }
+    int dimension() const override { return dim; }
+    void setSample(uint64_t index, int dim) override;
     bool isProgressive() const { return true; }
     SamplerPtr copy();
 
 private:
-    std::mt19937 rng;
+    void restart();
+
+private:
+    uint64_t index = 0;
+    int dim = 0;
+    uint32_t seed;
+    uint64_t pixel;
+    PCG32 rng;
 };
 
 class SimpleHaltonSampler;
 
+// Dimensions of the Sobol sequence a SobolSampler remembers its last value of
+const int SobolCachedDims = 64;
+
+// Sobol sequence in Gray code order, which has the same points in every run of a power of two
+// samples. Consecutive points differ by one matrix column per dimension, so the value of each
+// of the first dimensions is kept and stepped to the next sample with a single xor.
+// With random scrambling each dimension of each pixel is Owen scrambled by a hash, else the
+// points of a pixel are shifted by a per pixel xor
 class SobolSampler : public Sampler {
 public:
     SobolSampler(uint32_t seed, bool randomScrambling) :
-		seed(seed), scramble(seed), randomScrambling(randomScrambling), Sampler(SamplerType::SimpleSobol) {}
+		seed(seed), scramble(seed), randomScrambling(randomScrambling), Sampler(SamplerType::SimpleSobol) {
+		cachedIndex.fill(InvalidIndex);
+	}
 
     float get1();
 
     void setPixel(int x, int y);
     void nextSample();
     void nextSamples(size_t samples) override;
+    uint64_t sampleIndex() const override { return index; }
+    int dimension() const override { return dim; }
+    void setSample(uint64_t index, int dim) override;
     bool isProgressive() const { return true; }
     SamplerPtr copy();
 
 private:
+    uint32_t unscrambled(int dim);
+
+private:
+    // Can't be the index before any other
+    static constexpr uint64_t InvalidIndex = ~0ull - 1;
+
     uint64_t index = 0;
     int dim = 0;
     bool randomScrambling;
     uint32_t seed = 0;
     uint32_t scramble = 0;
-    std::mt19937 rng;
-};
\ No newline at end of file
+    std::array<uint64_t, SobolCachedDims> cachedIndex;
+    std::array<uint32_t, SobolCachedDims> cachedValue;
+};
+
+// Sobol samples of all pixels drawn from one sequence, as pbrt-v4's ZSobolSampler after Ahmed
+// and Wonka, "Screen-Space Blue-Noise Diffusion of Monte Carlo Sampling Error via Hierarchical
+// Ordering of Pixels". Pixel (x, y) takes the run of spp indices at its Morton code, with the
+// base 4 digits of the index shuffled per dimension, so that samples stay stratified across
+// neighbouring pixels as well as within one. Every pair of dimensions is drawn from the first
+// two Sobol dimensions under its own Owen scrambling.
+// The run of a pixel holds spp rounded up to a power of two samples, drawing more goes through
+// the run again with different scrambling
+class ZSobolSampler : public Sampler {
+public:
+    ZSobolSampler(int spp, int width, int height, uint32_t seed = 0);
+
+    float get1();
+    Vec2f get2() override;
+
+    void setPixel(int x, int y);
+    void nextSample();
+    void nextSamples(size_t samples) override;
+    uint64_t sampleIndex() const override { return index; }
+    int dimension() const override { return dim; }
+    void setSample(uint64_t index, int dim) override;
+    bool isProgressive() const { return true; }
+    SamplerPtr copy();
+
+private:
+    uint64_t sequenceIndex() const;
+    uint64_t scrambleSeed() const;
+
+private:
+    uint64_t index = 0;
+    int dim = 0;
+    uint32_t seed;
+    int log2Spp;
+    int numBase4Digits;
+    // Morton code of the pixel followed by log2Spp bits of the sample index
+    uint64_t mortonIndex = 0;
+};
@@ -4,6 +4,8 @@
 #include <variant>
 #include <vector>
 #include <memory>
+#include <map>
+#include <string>
 
 #include "Utils/ObjReader.h"
 #include "Light.h"
@@ -12,9 +14,12 @@
 #include "Camera.h"
 #include "Shape.h"
 #include "BVH.h"
+#include "LightBVH.h"
 
+// BVH picks lights by their estimated contribution to the receiving point. Where there is no
+// receiving point, as when starting light paths, it falls back to ByPower
 enum class LightSampleStrategy {
-	ByPower, Uniform
+	ByPower, Uniform, BVH
 };
 
 struct LightSample {
@@ -45,6 +50,12 @@ struct IiSample {
 	float pdf;
 };
 
+// Ray that has to stay unblocked up to dist for a light sample to count
+struct ShadowRay {
+	Ray ray;
+	float dist;
+};
+
 const LiSample InvalidLiSample = { Vec3f(0.0f), Spectrum(0.0f), 0.0f };
 const IiSample InvalidIiSample = { Vec3f(0.0f), Spectrum(0.0f), 0.0f };
 
@@ -55,40 +66,81 @@ public:
 	void setupLightSampleTable();
 
 	std::optional<LightSample> sampleOneLight(Vec2f u);
+	// For a receiver at x with normal n, zero if it has none
+	std::optional<LightSample> sampleOneLight(const Vec3f &x, const Vec3f &n, Vec2f u);
 	LightEnvSample sampleLightAndEnv(Vec2f u1, float u2);
 
-	LiSample sampleLiOneLight(const Vec3f &x, const Vec2f &u1, const Vec2f &u2);
-	LiSample sampleLiEnv(const Vec3f &x, const Vec2f &u1, const Vec2f &u2);
-	LiSample sampleLiLightAndEnv(const Vec3f &x, const std::array<float, 5> &sample);
+	// With shadow given the visibility test is left to the caller, who traces shadow->ray
+	// later, e.g. in a batch with the shadow rays of other paths
+	LiSample sampleLiOneLight(const Vec3f &x, const Vec3f &n, const Vec2f &u1, const Vec2f &u2,
+		ShadowRay *shadow = nullptr);
+	LiSample sampleLiEnv(const Vec3f &x, const Vec2f &u1, const Vec2f &u2, ShadowRay *shadow = nullptr);
+	LiSample sampleLiLightAndEnv(const Vec3f &x, const Vec3f &n, const std::array<float, 5> &sample,
+		ShadowRay *shadow = nullptr);
 
 	LeSample sampleLeOneLight(const std::array<float, 6> &sample);
+	// Environment light enters the scene as parallel rays through a disk of the bounding sphere's
+	// radius, facing the sampled direction on the far side of the scene
 	LeSample sampleLeEnv(const std::array<float, 6> &sample);
 	LeSample sampleLeLightAndEnv(const std::array<float, 7> &sample);
+	// Density of the origin on the disk and of the direction of an emitted ray, without the
+	// probability of picking the environment
+	LightPdf pdfLeEnv(const Vec3f &dir);
 
 	float pdfSampleLight(Light *lt);
+	// Matches sampleLiLightAndEnv for a receiver at x with normal n
+	float pdfSampleLight(Light *lt, const Vec3f &x, const Vec3f &n);
+	// Probability of sampling a light rather than the environment
+	float pdfSelectLight();
 	float pdfSampleEnv();
 	float powerlightAndEnv() { return mLightDistrib.sum() + mEnv->power(); }
 
 	IiSample sampleIiCamera(Vec3f x, Vec2f u);
 
 	bool isLightOrEnv(HittablePtr obj);
-	float pdfL(HittablePtr obj, Vec3f refPos, Vec3f hitPos, Vec3f refToLight);
+	float pdfL(HittablePtr obj, Vec3f refPos, Vec3f refNormal, Vec3f hitPos, Vec3f refToLight);
 	Spectrum L(HittablePtr obj, Vec3f refPos, Vec3f hitPos, Vec3f refToLight);
 
-	void buildScene();
-
-	std::pair<float, HittablePtr> closestHit(const Ray &ray) { return mBvh->closestHit(ray); }
-	bool quickIntersect(const Ray &ray, float dist) { return mBvh->testIntersec(ray, dist); }
+	// Builds the BVHs of meshes that don't have one yet and the top level BVH over all hittables.
+	// After moving instances only the top level BVH is rebuilt by calling it again.
+	// Large BVHs are built on the application's pool
+	void buildScene(ThreadPool &pool);
+
+	HitInfo closestHit(const Ray &ray) {
+		countRays(1);
+		return mBvh->closestHit(ray);
+	}
+	bool quickIntersect(const Ray &ray, float dist) {
+		countRays(1);
+		return mBvh->testIntersec(ray, dist);
+	}
+	// Up to BVHPacketSize coherent rays at once, like shadow rays leaving the same point
+	void closestHit8(const Ray *rays, int count, HitInfo *hits) {
+		countRays(count);
+		mBvh->closestHit8(rays, count, hits);
+	}
+	int occluded8(const Ray *rays, const float *dists, int count) {
+		countRays(count);
+		return mBvh->occluded8(rays, dists, count);
+	}
+
+	// Rays traced through any scene by all threads so far. Threads add their rays to the total
+	// in batches, so it lags behind by less than a batch per thread
+	static uint64_t numRays();
 
 	void addHittable(HittablePtr hittable) { mHittables.push_back(hittable); }
 	void addLight(LightPtr light);
-	void addObjectMesh(const char *path, const Transform& transform, BSDFPtr material);
-	void addLightMesh(const char *path, const Transform& transform, const Spectrum &power);
+	// Meshes are loaded once per path, adding a path again only places another instance
+	MeshInstancePtr addObjectMesh(const char *path, const Transform& transform, BSDFPtr material);
+	void addLightMesh(const char *path, const Transform& transform, const Spectrum &power, bool castsShadows = true);
 
 	bool visible(Vec3f x, Vec3f y);
 	float v(Vec3f x, Vec3f y);
 	float g(Vec3f x, Vec3f y, Vec3f Nx, Vec3f Ny);
 
+private:
+	static void countRays(int count);
+
 public:
 	std::vector<HittablePtr> mHittables;
 	std::vector<LightPtr> mLights;
@@ -96,7 +148,12 @@ public:
 	CameraPtr mCamera;
 
 	std::shared_ptr<BVH> mBvh;
+	std::map<std::string, TriangleMeshPtr> mMeshes;
+	std::map<TriangleMesh*, std::shared_ptr<BVH>> mMeshBvhs;
+	BVHSplitMethod mBVHSplitMethod = BVHSplitMethod::BinnedSAH;
+	float mSpatialSplitBudget = BVHSpatialSplitBudget;
 	Piecewise1D mLightDistrib;
+	LightBVH mLightBvh;
 	LightSampleStrategy mLightSampleStrategy = LightSampleStrategy::ByPower;
 	LightSampleStrategy mLightAndEnvStrategy = LightSampleStrategy::Uniform;
 
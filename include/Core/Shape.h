@@ -3,8 +3,13 @@
 #include <utility>
 
 #include "Hittable.h"
+#include "TriangleMesh.h"
 #include "Math.h"
 
+// Watertight ray-triangle test (Woop et al. 2013), no ray passes between triangles sharing an edge.
+// Returns the distance in the parameter space of the ray and the barycentrics of vb and vc
+std::optional<PrimitiveHit> intersectTriangle(const Ray &ray, const Vec3f &va, const Vec3f &vb, const Vec3f &vc);
+
 class Sphere : public Hittable {
 public:
 	Sphere(const Vec3f &center, float radius, bool intersectFromInside) :
@@ -38,6 +43,8 @@ public:
 	float surfaceArea();
 	Vec2f surfaceUV(const Vec3f &p);
 	AABB bound();
+	AABB clippedBound(int prim, const AABB &box) override;
+	bool worldTriangle(int prim, Vec3f *verts) override;
 
 	std::tuple<Vec3f, Vec3f, Vec3f> vertices() { return { va, vb, vc }; }
 
@@ -45,28 +52,29 @@ protected:
 	Vec3f va, vb, vc;
 };
 
+// Triangle referring to a world space TriangleMesh shared by its other triangles, which can't be
+// moved one at a time. The transform goes to the mesh when it is created
 class MeshTriangle : public Hittable {
 public:
-	MeshTriangle(Vec3f *vertices, Vec2f *uvs, Vec3f *normals): 
-		triangle(vertices[0], vertices[1], vertices[2]),
-		ta(uvs[0]), tb(uvs[1]), tc(uvs[2]),
-		na(normals[0]), nb(normals[1]), nc(normals[2]), Hittable(HittableType::Shape) {}
+	MeshTriangle(TriangleMeshPtr mesh, int index) :
+		mMesh(mesh), mIndex(index), Hittable(HittableType::Shape) {}
 
-	std::optional<float> closestHit(const Ray &ray) { return triangle.closestHit(ray); }
-	Vec3f uniformSample(const Vec2f &u) { return triangle.uniformSample(u); }
+	std::optional<float> closestHit(const Ray &ray);
+	Vec3f uniformSample(const Vec2f &u);
 
-	Vec3f normalGeom(const Vec3f &p) { return triangle.normalGeom(p); }
+	Vec3f normalGeom(const Vec3f &p);
 	Vec3f normalShading(const Vec3f &p) override;
-	float surfaceArea() { return triangle.surfaceArea(); }
+	float surfaceArea();
 	Vec2f surfaceUV(const Vec3f &p);
-	AABB bound() { return triangle.bound(); }
+	AABB bound();
+	AABB clippedBound(int prim, const AABB &box) override;
+	bool worldTriangle(int prim, Vec3f *verts) override;
 
 	void setTransform(const Transform& trans) override;
 
 private:
-	Triangle triangle;
-	Vec2f ta, tb, tc;
-	Vec3f na, nb, nc;
+	TriangleMeshPtr mMesh;
+	int mIndex;
 };
 
 class Quad : public Hittable {
@@ -81,6 +89,7 @@ public:
 	float surfaceArea();
 	Vec2f surfaceUV(const Vec3f &p) { return Triangle(va, vb, vc).surfaceUV(p); }
 	AABB bound();
+	AABB clippedBound(int prim, const AABB &box) override;
 
 private:
 	Vec3f va, vb, vc;
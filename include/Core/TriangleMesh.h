@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <tuple>
+#include <cstdint>
+
+#include "Math.h"
+#include "Transform.h"
+
+// Indexed triangles of a loaded model with vertices moved by transform once at load time,
+// so that intersecting or evaluating a triangle needs no matrix work. Object meshes are kept in
+// object space and placed by MeshInstances, light meshes are moved to world space.
+// Triangles are identified by their index, nothing is stored per triangle besides the indices
+class TriangleMesh {
+public:
+	TriangleMesh(const std::vector<Vec3f> &vertices, const std::vector<Vec2f> &texcoords,
+		const std::vector<Vec3f> &normals, const std::vector<uint32_t> &indices, const Transform &transform);
+
+	int numTriangles() const { return mIndices.size() / 3; }
+	int numVertices() const { return mPositions.size(); }
+
+	std::tuple<Vec3f, Vec3f, Vec3f> positions(int index) const {
+		const uint32_t *idx = &mIndices[index * 3];
+		return { mPositions[idx[0]], mPositions[idx[1]], mPositions[idx[2]] };
+	}
+	// Meshes without texcoords map every triangle to the same corner of texture space
+	std::tuple<Vec2f, Vec2f, Vec2f> texcoords(int index) const {
+		if (mTexcoords.empty()) {
+			return { Vec2f(0.0f, 0.0f), Vec2f(1.0f, 0.0f), Vec2f(0.0f, 1.0f) };
+		}
+		const uint32_t *idx = &mIndices[index * 3];
+		return { mTexcoords[idx[0]], mTexcoords[idx[1]], mTexcoords[idx[2]] };
+	}
+	bool hasNormals() const { return !mNormals.empty(); }
+	std::tuple<Vec3f, Vec3f, Vec3f> normals(int index) const {
+		const uint32_t *idx = &mIndices[index * 3];
+		return { mNormals[idx[0]], mNormals[idx[1]], mNormals[idx[2]] };
+	}
+
+	Vec3f normalGeom(int index) const;
+	Vec3f normalShading(int index, const Vec3f &bary) const;
+	Vec2f surfaceUV(int index, const Vec3f &bary) const;
+	float surfaceArea(int index) const;
+	Vec3f barycentric(int index, const Vec3f &p) const;
+
+private:
+	std::vector<Vec3f> mPositions;
+	std::vector<Vec2f> mTexcoords;
+	// Transformed by the inverse transpose but not normalized, so that interpolating them
+	// gives the same direction as transforming the interpolated object space normal
+	std::vector<Vec3f> mNormals;
+	std::vector<uint32_t> mIndices;
+};
+
+using TriangleMeshPtr = std::shared_ptr<TriangleMesh>;
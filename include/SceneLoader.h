@@ -1,5 +1,8 @@
 #pragma once
 
+#include <string>
+
 #include "Core/Scene.h"
 
-ScenePtr setupScene(int windowWidth, int windowHeight);
\ No newline at end of file
+ScenePtr setupScene(int windowWidth, int windowHeight);
+ScenePtr setupScene(const std::string &name, int width, int height);
\ No newline at end of file
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+class ArgParser {
+public:
+    ArgParser(const std::string &program, const std::string &description = "") :
+        mProgram(program), mDescription(description) {}
+
+    template<typename T>
+    void addOption(const std::string &name, const std::string &shortName, T *value, const std::string &help) {
+        std::stringstream defaultVal;
+        defaultVal << *value;
+        mOptions.push_back({ name, shortName, help, defaultVal.str(), true,
+            [value](const std::string &arg) {
+                std::stringstream ss(arg);
+                ss >> *value;
+                return !ss.fail() && ss.eof();
+            } });
+    }
+
+    void addOption(const std::string &name, const std::string &shortName, std::string *value, const std::string &help) {
+        mOptions.push_back({ name, shortName, help, *value, true,
+            [value](const std::string &arg) {
+                *value = arg;
+                return true;
+            } });
+    }
+
+    void addFlag(const std::string &name, const std::string &shortName, bool *value, const std::string &help) {
+        mOptions.push_back({ name, shortName, help, "", false,
+            [value](const std::string &arg) {
+                *value = true;
+                return true;
+            } });
+    }
+
+    // Returns false if parsing failed or help was requested; the reason has already been printed
+    bool parse(int argc, char *argv[]) {
+        for (int i = 1; i < argc; i++) {
+            std::string arg(argv[i]);
+            if (arg == "--help" || arg == "-h") {
+                printUsage(std::cout);
+                return false;
+            }
+            std::string inlineValue;
+            bool hasInlineValue = false;
+            if (auto eq = arg.find('='); arg.rfind("--", 0) == 0 && eq != std::string::npos) {
+                inlineValue = arg.substr(eq + 1);
+                arg = arg.substr(0, eq);
+                hasInlineValue = true;
+            }
+            auto option = find(arg);
+            if (option == nullptr) {
+                std::cerr << mProgram << ": unknown option " << arg << "\n";
+                printUsage(std::cerr);
+                return false;
+            }
+            std::string value;
+            if (option->takesValue) {
+                if (hasInlineValue) {
+                    value = inlineValue;
+                }
+                else if (i + 1 < argc) {
+                    value = argv[++i];
+                }
+                else {
+                    std::cerr << mProgram << ": option " << arg << " requires a value\n";
+                    return false;
+                }
+            }
+            if (!option->setter(value)) {
+                std::cerr << mProgram << ": invalid value \"" << value << "\" for option " << arg << "\n";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void printUsage(std::ostream &out) const {
+        out << "Usage: " << mProgram << " [options]\n";
+        if (!mDescription.empty()) {
+            out << mDescription << "\n";
+        }
+        out << "Options:\n";
+        for (const auto &option : mOptions) {
+            std::string names = (option.shortName.empty() ? "    " : option.shortName + ", ") + option.name;
+            if (option.takesValue) {
+                names += " <value>";
+            }
+            out << "  " << std::left << std::setw(28) << names << option.help;
+            if (option.takesValue && !option.defaultValue.empty()) {
+                out << " (default: " << option.defaultValue << ")";
+            }
+            out << "\n";
+        }
+        out << "  " << std::left << std::setw(28) << "-h, --help" << "Print this message\n";
+    }
+
+private:
+    struct Option {
+        std::string name;
+        std::string shortName;
+        std::string help;
+        std::string defaultValue;
+        bool takesValue;
+        std::function<bool(const std::string&)> setter;
+    };
+
+    const Option* find(const std::string &arg) const {
+        for (const auto &option : mOptions) {
+            if (arg == option.name || (!option.shortName.empty() && arg == option.shortName)) {
+                return &option;
+            }
+        }
+        return nullptr;
+    }
+
+private:
+    std::string mProgram;
+    std::string mDescription;
+    std::vector<Option> mOptions;
+};
@@ -1,8 +1,8 @@
 #pragma once
 
-#include <Windows.h>
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 #include <algorithm>
 #include <memory>
 
@@ -6,15 +6,20 @@
 #include <cstring>
 #include <vector>
 #include <cstdio>
+#include <cstdint>
+#include <tuple>
+#include <unordered_map>
 
 #include "glmIncluder.h"
 #include "tiny_obj_loader.h"
 
 namespace ObjReader {
+	// Vertices are shared between faces, every three indices form a triangle
 	struct VertexInfo {
 		std::vector<Vec3f> vertices;
 		std::vector<Vec2f> texcoords;
 		std::vector<Vec3f> normals;
+		std::vector<uint32_t> indices;
 	};
 
 	static VertexInfo readFile(const char* filePath) {
@@ -28,15 +33,31 @@ namespace ObjReader {
 		tinyobj::LoadObj(&attrib, &shapes, &materials, &errStr, filePath);
 
 		bool hasTexcoord = attrib.texcoords.size() != 0;
+		bool hasNormal = attrib.normals.size() != 0;
+
+		// Obj indexes positions, normals and texcoords separately, a vertex is a unique combination
+		auto keyHash = [](const std::tuple<int, int, int> &key) {
+			auto [v, n, t] = key;
+			return std::hash<int64_t>()((int64_t(v) * 73856093) ^ (int64_t(n) * 19349663) ^ (int64_t(t) * 83492791));
+		};
+		std::unordered_map<std::tuple<int, int, int>, uint32_t, decltype(keyHash)> vertexMap(0, keyHash);
 
 		for (const auto &shape : shapes) {
 			for (auto idx : shape.mesh.indices) {
-				data.vertices.push_back(*reinterpret_cast<Vec3f*>(attrib.vertices.data() + idx.vertex_index * 3));
-				data.normals.push_back(*reinterpret_cast<Vec3f*>(attrib.normals.data() + idx.normal_index * 3));
-				if (!hasTexcoord) {
+				auto key = std::make_tuple(idx.vertex_index, hasNormal ? idx.normal_index : -1,
+					hasTexcoord ? idx.texcoord_index : -1);
+				auto [iter, inserted] = vertexMap.insert({ key, static_cast<uint32_t>(data.vertices.size()) });
+				data.indices.push_back(iter->second);
+				if (!inserted) {
 					continue;
 				}
-				data.texcoords.push_back(*reinterpret_cast<Vec2f*>(attrib.texcoords.data() + idx.texcoord_index * 2));
+				data.vertices.push_back(*reinterpret_cast<Vec3f*>(attrib.vertices.data() + idx.vertex_index * 3));
+				if (hasNormal) {
+					data.normals.push_back(*reinterpret_cast<Vec3f*>(attrib.normals.data() + idx.normal_index * 3));
+				}
+				if (hasTexcoord) {
+					data.texcoords.push_back(*reinterpret_cast<Vec2f*>(attrib.texcoords.data() + idx.texcoord_index * 2));
+				}
 			}
 		}
 		return data;
@@ -3,6 +3,8 @@
 #include <iostream>
 #include <random>
 #include <ctime>
+#include <cstdint>
+#include <algorithm>
 
 typedef std::uniform_real_distribution<double> UniformDouble;
 typedef std::uniform_real_distribution<float> UniformFloat;
@@ -25,3 +27,51 @@ template<typename T>
 T uniformInt(T tMin, T tMax) {
 	return std::uniform_int_distribution<T>(tMin, tMax)(globalRandomEngine);
 }
+
+// O'Neill's PCG32, 16 bytes of state. Every seqIndex selects its own sequence of 2^64 numbers,
+// and advance jumps along it in logarithmic time
+class PCG32 {
+public:
+	PCG32(uint64_t seqIndex = 0, uint64_t offset = 0) { setSequence(seqIndex, offset); }
+
+	void setSequence(uint64_t seqIndex, uint64_t offset) {
+		state = 0;
+		inc = (seqIndex << 1) | 1;
+		uniformUint();
+		state += offset;
+		uniformUint();
+	}
+
+	uint32_t uniformUint() {
+		uint64_t old = state;
+		state = old * Multiplier + inc;
+		uint32_t xorShifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+		uint32_t rot = static_cast<uint32_t>(old >> 59);
+		return (xorShifted >> rot) | (xorShifted << ((~rot + 1) & 31));
+	}
+
+	// In [0, 1)
+	float uniformFloat() {
+		return std::min(static_cast<float>(uniformUint()) * 0x1p-32f, 0x1.fffffep-1f);
+	}
+
+	void advance(uint64_t delta) {
+		uint64_t curMult = Multiplier, curPlus = inc;
+		uint64_t accMult = 1, accPlus = 0;
+		for (; delta; delta >>= 1) {
+			if (delta & 1) {
+				accMult *= curMult;
+				accPlus = accPlus * curMult + curPlus;
+			}
+			curPlus = (curMult + 1) * curPlus;
+			curMult *= curMult;
+		}
+		state = accMult * state + accPlus;
+	}
+
+private:
+	static constexpr uint64_t Multiplier = 0x5851f42d4c957f2dull;
+
+	uint64_t state;
+	uint64_t inc;
+};
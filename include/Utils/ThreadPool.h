@@ -0,0 +1,169 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Fixed set of worker threads consuming a shared FIFO of tasks. A pool may have no workers,
+// then every task runs on the thread waiting for it in TaskGroup::wait.
+// The application creates one pool that lives as long as it does and hands it to whoever needs
+// to run work in parallel, so that no render pass pays for creating threads
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    // With pinThreads worker i stays on core i + 1, leaving core 0 to the thread that creates
+    // the pool and helps out in TaskGroup::wait
+    explicit ThreadPool(int threads = std::thread::hardware_concurrency(), bool pinThreads = false) {
+        threads = std::max(threads, 0);
+        for (int i = 0; i < threads; i++) {
+            mWorkers.emplace_back([this]() { workerLoop(); });
+            if (pinThreads) {
+                pinToCore(mWorkers.back(), i + 1);
+            }
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mCond.notify_all();
+        for (auto &worker : mWorkers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator = (const ThreadPool&) = delete;
+
+    int numThreads() const { return mWorkers.size(); }
+
+    void enqueue(Task task) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTasks.push_back(std::move(task));
+        }
+        mCond.notify_one();
+    }
+
+    // Runs one queued task on the calling thread, returns false if there was none
+    bool runPendingTask() {
+        Task task;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mTasks.empty()) {
+                return false;
+            }
+            task = std::move(mTasks.front());
+            mTasks.pop_front();
+        }
+        task();
+        return true;
+    }
+
+private:
+    static void pinToCore(std::thread &thread, int core) {
+        int cores = std::max<int>(std::thread::hardware_concurrency(), 1);
+        core %= cores;
+#if defined(_WIN32)
+        SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << core);
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+    }
+
+    void workerLoop() {
+        while (true) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCond.wait(lock, [this]() { return mStop || !mTasks.empty(); });
+                if (mStop && mTasks.empty()) {
+                    return;
+                }
+                task = std::move(mTasks.front());
+                mTasks.pop_front();
+            }
+            task();
+        }
+    }
+
+private:
+    std::vector<std::thread> mWorkers;
+    std::deque<Task> mTasks;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    bool mStop = false;
+};
+
+// Tracks a set of tasks submitted to a pool. Waiting threads execute queued tasks
+// instead of blocking, so tasks may spawn and wait for nested tasks
+class TaskGroup {
+public:
+    TaskGroup(ThreadPool &pool) : mPool(pool) {}
+    ~TaskGroup() { wait(); }
+
+    ThreadPool& pool() { return mPool; }
+
+    template<typename Func>
+    void run(Func &&func) {
+        mPending++;
+        mPool.enqueue([this, func = std::forward<Func>(func)]() {
+            func();
+            mPending--;
+        });
+    }
+
+    void wait() {
+        while (mPending > 0) {
+            if (!mPool.runPendingTask()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    ThreadPool &mPool;
+    std::atomic<int> mPending = 0;
+};
+
+// Calls func(begin, end) on consecutive ranges of at most grain items covering [0, count)
+// and returns when all of them are done
+template<typename Func>
+void parallelFor(ThreadPool &pool, int count, int grain, Func &&func) {
+    int chunks = (count + grain - 1) / grain;
+    if (pool.numThreads() == 0 || chunks <= 1) {
+        for (int begin = 0; begin < count; begin += grain) {
+            func(begin, std::min(count, begin + grain));
+        }
+        return;
+    }
+    TaskGroup tasks(pool);
+    for (int i = 0; i < chunks; i++) {
+        tasks.run([&func, i, count, grain]() {
+            int begin = i * grain;
+            func(begin, std::min(count, begin + grain));
+        });
+    }
+    tasks.wait();
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+
+// Image region [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+// Hands out the tiles of an image to a fixed set of workers. Tiles are laid out in Morton order
+// and every worker starts on its own contiguous run of them, so that nearby tiles stay on one core.
+// A worker that runs dry steals the back half of the largest remaining run
+class TileScheduler {
+public:
+    void init(int width, int height, int workers, int tileSize = 16) {
+        mTiles.clear();
+        int tilesX = (width + tileSize - 1) / tileSize;
+        int tilesY = (height + tileSize - 1) / tileSize;
+        std::vector<std::pair<uint32_t, Tile>> ordered;
+        for (int y = 0; y < tilesY; y++) {
+            for (int x = 0; x < tilesX; x++) {
+                Tile tile = { x * tileSize, y * tileSize,
+                    std::min((x + 1) * tileSize, width), std::min((y + 1) * tileSize, height) };
+                ordered.push_back({ interleaveBits(x) | (interleaveBits(y) << 1), tile });
+            }
+        }
+        std::sort(ordered.begin(), ordered.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+        for (const auto &[code, tile] : ordered) {
+            mTiles.push_back(tile);
+        }
+        mAllTiles = mTiles;
+        mNumWorkers = std::max(workers, 1);
+        mRuns.reset(new Run[mNumWorkers]);
+        reset();
+    }
+
+    // Restricts the following passes to the tiles whose entry in active, in Morton order, is set
+    void select(const std::vector<bool> &active) {
+        mTiles.clear();
+        for (size_t i = 0; i < mAllTiles.size(); i++) {
+            if (active[i]) {
+                mTiles.push_back(mAllTiles[i]);
+            }
+        }
+    }
+
+    void selectAll() {
+        mTiles = mAllTiles;
+    }
+
+    // Gives every worker its initial run again for another pass
+    void reset() {
+        int numTiles = mTiles.size();
+        for (int i = 0; i < mNumWorkers; i++) {
+            mRuns[i].begin = static_cast<int64_t>(numTiles) * i / mNumWorkers;
+            mRuns[i].end = static_cast<int64_t>(numTiles) * (i + 1) / mNumWorkers;
+        }
+    }
+
+    // Next tile for worker, false once every tile of the pass has been taken
+    bool next(int worker, Tile &tile) {
+        if (pop(worker, tile)) {
+            return true;
+        }
+        while (steal(worker)) {
+            if (pop(worker, tile)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    int numTiles() const { return mTiles.size(); }
+    int numWorkers() const { return mNumWorkers; }
+
+    // Spreads the low 16 bits of x to the even bits, tile (x, y) sorts by
+    // interleaveBits(x) | (interleaveBits(y) << 1)
+    static uint32_t interleaveBits(uint32_t x) {
+        x &= 0x0000ffff;
+        x = (x | (x << 8)) & 0x00ff00ff;
+        x = (x | (x << 4)) & 0x0f0f0f0f;
+        x = (x | (x << 2)) & 0x33333333;
+        x = (x | (x << 1)) & 0x55555555;
+        return x;
+    }
+
+private:
+    struct Run {
+        std::mutex mutex;
+        int begin = 0;
+        int end = 0;
+    };
+
+    bool pop(int worker, Tile &tile) {
+        auto &run = mRuns[worker];
+        std::lock_guard<std::mutex> lock(run.mutex);
+        if (run.begin == run.end) {
+            return false;
+        }
+        tile = mTiles[run.begin++];
+        return true;
+    }
+
+    bool steal(int worker) {
+        int victim = -1;
+        int most = 0;
+        for (int i = 0; i < mNumWorkers; i++) {
+            std::lock_guard<std::mutex> lock(mRuns[i].mutex);
+            int remaining = mRuns[i].end - mRuns[i].begin;
+            if (i != worker && remaining > most) {
+                victim = i;
+                most = remaining;
+            }
+        }
+        if (victim == -1) {
+            return false;
+        }
+        int begin, end;
+        {
+            std::lock_guard<std::mutex> lock(mRuns[victim].mutex);
+            end = mRuns[victim].end;
+            begin = end - (end - mRuns[victim].begin + 1) / 2;
+            mRuns[victim].end = begin;
+        }
+        // The victim may have finished its run in between, then there is nothing to take
+        if (begin >= end) {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(mRuns[worker].mutex);
+        mRuns[worker].begin = begin;
+        mRuns[worker].end = end;
+        return true;
+    }
+
+private:
+    std::vector<Tile> mAllTiles;
+    // Tiles handed out in a pass
+    std::vector<Tile> mTiles;
+    std::unique_ptr<Run[]> mRuns;
+    int mNumWorkers = 0;
+};
@@ -11,6 +11,7 @@
 
 #include "Core/Texture.h"
 #include "Core/Integrator.h"
+#include "Core/RenderSession.h"
 #include "Utils/FrameBufferDouble.h"
 #include "Utils/ImageSave.h"
 #include "SceneLoader.h"
@@ -53,7 +54,10 @@ private:
 
 	FrameBufferDouble<RGB24> mColorBuffer;
 	IntegratorPtr mIntegrator;
+	std::shared_ptr<ThreadPool> mPool;
 	ScenePtr mScene;
 
-	Timer mTimer;
+	// Rendering stops at the time or error budget if one is set, else at the spp limit
+	RenderBudget mBudget;
+	std::unique_ptr<RenderSession> mSession;
 };
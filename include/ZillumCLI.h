@@ -0,0 +1,58 @@
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <memory>
+
+#include "Core/Integrator.h"
+#include "Core/RenderSession.h"
+#include "Utils/Timer.h"
+#include "SceneLoader.h"
+
+struct CLIOptions {
+	std::string scene = "material";
+	std::string integrator = "path2";
+	std::string sampler = "sobol";
+	std::string bvh = "binned";
+	float sbvhBudget = BVHSpatialSplitBudget;
+	std::string lightSampler;
+	int width = 1000;
+	int height = 1000;
+	int spp = 32;
+	int maxDepth = 8;
+	int pathsOnePass = 0;
+	int threads = MaxThreads;
+	bool pinThreads = false;
+	std::string splat = "atomic";
+	bool deterministic = false;
+	int seed = 0;
+	float timeBudget = 0.0f;
+	float targetError = 0.0f;
+	float adaptiveError = 0.0f;
+	int adaptiveMinSpp = 8;
+	float aoRadius = 0.5f;
+	int aoSamples = 1;
+	std::string toneMapping = "filmic";
+	bool noGamma = false;
+	std::string output = "output.png";
+};
+
+// Headless front end: renders a scene to an image file without any windowing code
+class ZillumCLI {
+public:
+	bool init(int argc, char *argv[]);
+	int run();
+
+private:
+	bool initScene();
+	bool initIntegrator();
+	bool saveImage(const std::string &path);
+	Spectrum toDisplay(Spectrum color) const;
+
+private:
+	CLIOptions mOptions;
+	IntegratorPtr mIntegrator;
+	std::shared_ptr<ThreadPool> mPool;
+	ScenePtr mScene;
+};
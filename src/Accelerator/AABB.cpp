@@ -18,6 +18,58 @@ void AABB::expand(const AABB& rhs)
 	pMax = glm::max(pMax, rhs.pMax);
 }
 
+AABB AABB::intersect(const AABB &rhs) const
+{
+	return AABB(glm::max(pMin, rhs.pMin), glm::min(pMax, rhs.pMax));
+}
+
+// Bound of the part of a convex polygon inside the box, found by clipping the polygon
+// against the six planes of the box one at a time
+AABB AABB::clipPolygon(const Vec3f *verts, int count) const
+{
+	const int MaxVerts = 16;
+	Vec3f bufA[MaxVerts], bufB[MaxVerts];
+	Vec3f *poly = bufA, *clipped = bufB;
+	count = std::min(count, MaxVerts - 6);
+	std::copy(verts, verts + count, poly);
+
+	for (int plane = 0; plane < 6 && count > 0; plane++)
+	{
+		int axis = plane >> 1;
+		bool isMax = plane & 1;
+		float pos = isMax ? pMax[axis] : pMin[axis];
+		auto inside = [&](const Vec3f &v) { return isMax ? v[axis] <= pos : v[axis] >= pos; };
+
+		int clippedCount = 0;
+		for (int i = 0; i < count; i++)
+		{
+			const Vec3f &a = poly[i];
+			const Vec3f &b = poly[(i + 1) % count];
+			if (inside(a))
+				clipped[clippedCount++] = a;
+			if (inside(a) != inside(b))
+			{
+				float t = (pos - a[axis]) / (b[axis] - a[axis]);
+				Vec3f v = a + (b - a) * t;
+				v[axis] = pos;
+				clipped[clippedCount++] = v;
+			}
+		}
+		std::swap(poly, clipped);
+		count = clippedCount;
+	}
+
+	AABB result;
+	for (int i = 0; i < count; i++)
+		result.expand(poly[i]);
+	return result.intersect(*this);
+}
+
+bool AABB::isEmpty() const
+{
+	return pMin.x > pMax.x || pMin.y > pMax.y || pMin.z > pMax.z;
+}
+
 BoxHit AABB::hit(const Ray &ray)
 {
     const float eps = 1e-6f;
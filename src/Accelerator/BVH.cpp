@@ -1,30 +1,40 @@
 #include "Core/BVH.h"
+#include "Utils/ThreadPool.h"
+#include "Utils/Error.h"
 
-using RadixSortElement = std::pair<int, int>;
+#include <limits>
+#include <memory>
+#include <array>
+#include <atomic>
 
-struct BoxRec
-{
-	AABB vertBox;
-	AABB centExtent;
-};
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_AMD64)
+#include <xmmintrin.h>
+#define BVH_USE_SSE
+#endif
 
-struct Bucket
-{
-	Bucket() : count(0) {}
-	Bucket(const Bucket& a, const Bucket& b) :
-		count(a.count + b.count), box(a.box, b.box) {}
-	int count;
-	AABB box;
-};
+// Cost of visiting an inner node relative to intersecting a primitive
+constexpr float SAHTraversalCost = 0.125f;
+// Subtrees and nodes with fewer primitives are built and binned on a single thread
+constexpr size_t ParallelBuildThreshold = 4096;
+constexpr int ParallelBinThreshold = 65536;
+// Spatial splits are only tried where the object split children overlap by more than
+// this fraction of the root area
+constexpr float SpatialSplitAlpha = 1e-5f;
+constexpr int SpatialSplitBins = 32;
+// Entries of the per thread occluder cache, enough for the top level BVH and a few mesh BVHs
+constexpr int OccluderCacheSize = 16;
+
+static std::atomic<uint64_t> NextBVHId = 1;
 
-struct BuildRec
+// Leaf of a BVH that last blocked a shadow ray traced by this thread
+struct OccluderCacheEntry
 {
+	uint64_t bvh;
 	int offset;
-	AABB nodeExtent;
-	int splitDim;
-	int lRange;
-	int rRange;
+	uint8_t leafSize;
+	uint8_t shadowMask;
 };
+static thread_local OccluderCacheEntry OccluderCache[OccluderCacheSize];
 
 using RadixSortElement = std::pair<int, int>;
 
@@ -69,341 +79,1526 @@ void radixSortLH(RadixSortElement* a, int count)
 	delete[] b;
 }
 
-void radixSort16(HittableInfo* a, int count, int dim)
+// Spreads the lower 10 bits of v so that there are two zero bits between each of them
+inline uint32_t expandBits(uint32_t v)
 {
-	RadixSortElement* b = new RadixSortElement[count];
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
 
-	int l = 0, r = count;
-	for (int i = 0; i < count; i++)
+// 30-bit Morton code of a point in the unit cube
+inline uint32_t mortonCode(const Vec3f &p)
+{
+	Vec3f q = glm::clamp(p * 1024.0f, Vec3f(0.0f), Vec3f(1023.0f));
+	return (expandBits(static_cast<uint32_t>(q.x)) << 2) | (expandBits(static_cast<uint32_t>(q.y)) << 1) |
+		expandBits(static_cast<uint32_t>(q.z));
+}
+
+inline AABB rangeBound(const HittableInfo *primInfo, int l, int r)
+{
+	AABB bound;
+	for (int i = l; i <= r; i++)
+		bound.expand(primInfo[i].bound);
+	return bound;
+}
+
+inline AABB rangeCentroidBound(const HittableInfo *primInfo, int l, int r)
+{
+	AABB bound;
+	for (int i = l; i <= r; i++)
+		bound.expand(primInfo[i].centroid);
+	return bound;
+}
+
+inline void sortByCentroid(HittableInfo *begin, HittableInfo *end, int dim)
+{
+	std::sort(begin, end, [dim](const HittableInfo &a, const HittableInfo &b)
+	{
+		return a.centroid[dim] < b.centroid[dim];
+	});
+}
+
+template<int NumBuckets>
+void partition(HittableInfo* a, int size, float axisMin, float axisMax, int splitDim, int splitPoint)
+{
+	std::partition(a, a + size, [=](const HittableInfo &info)
+	{
+		int b = NumBuckets * (info.centroid[splitDim] - axisMin) / (axisMax - axisMin);
+		b = std::max(std::min(b, NumBuckets - 1), 0);
+		return b <= splitPoint;
+	});
+}
+
+struct RayBoxData
+{
+	RayBoxData() = default;
+	RayBoxData(const Ray &ray)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			float invDir = 1.0f / ray.dir[i];
+			dirNeg[i] = invDir < 0.0f;
+			scalarOri[i] = ray.ori[i];
+			scalarInv[i] = invDir;
+#ifdef BVH_USE_SSE
+			ori[i] = _mm_set1_ps(ray.ori[i]);
+			inv[i] = _mm_set1_ps(invDir);
+#else
+			ori[i] = ray.ori[i];
+			inv[i] = invDir;
+#endif
+		}
+	}
+#ifdef BVH_USE_SSE
+	__m128 ori[3];
+	__m128 inv[3];
+#else
+	float ori[3];
+	float inv[3];
+#endif
+	// Unbroadcast copies that packets are gathered from
+	float scalarOri[3];
+	float scalarInv[3];
+	bool dirNeg[3];
+};
+
+struct NodeStackEntry
+{
+	int node;
+	float tNear;
+};
+
+// Node of a packet traversal and the bit mask of rays in the packet that have to visit it
+struct PacketStackEntry
+{
+	int node;
+	int rays;
+};
+
+// Traversal stack on the stack frame for reasonably shaped trees, on the heap for degenerated ones
+template<typename Entry>
+class NodeStack
+{
+public:
+	NodeStack(int size)
+	{
+		if (size > LocalSize)
+		{
+			mHeap.reset(new Entry[size]);
+			mData = mHeap.get();
+		}
+	}
+	Entry& operator [] (int index) { return mData[index]; }
+
+private:
+	static constexpr int LocalSize = 128;
+	Entry mLocal[LocalSize];
+	std::unique_ptr<Entry[]> mHeap;
+	Entry *mData = mLocal;
+};
+
+// Slab test against all children, returns a bit mask of the children hit within [0, dist].
+// NaNs from 0 * inf only appear in the first operand of min/max, in which case the
+// second operand is returned and the axis is effectively ignored
+inline int hitChildren(const BVHWideNode &node, const RayBoxData &ray, float dist, float *tNear)
+{
+#ifdef BVH_USE_SSE
+	__m128 tMin = _mm_setzero_ps();
+	__m128 tMax = _mm_set1_ps(dist);
+	for (int i = 0; i < 3; i++)
 	{
-		int u = *reinterpret_cast<int*>(&a[i].centroid[dim]);
-		if (u & 0x80000000) b[l++] = RadixSortElement(~u, i);
-		else b[--r] = RadixSortElement(u, i);
+		__m128 lo = _mm_load_ps(ray.dirNeg[i] ? node.boundMax[i] : node.boundMin[i]);
+		__m128 hi = _mm_load_ps(ray.dirNeg[i] ? node.boundMin[i] : node.boundMax[i]);
+		tMin = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(lo, ray.ori[i]), ray.inv[i]), tMin);
+		tMax = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(hi, ray.ori[i]), ray.inv[i]), tMax);
 	}
-	radixSortLH(b, l);
-	radixSortLH(b + l, count - l);
+	_mm_storeu_ps(tNear, tMin);
+	return _mm_movemask_ps(_mm_cmple_ps(tMin, tMax));
+#else
+	int mask = 0;
+	for (int j = 0; j < BVHWidth; j++)
+	{
+		float tMin = 0.0f;
+		float tMax = dist;
+		for (int i = 0; i < 3; i++)
+		{
+			float lo = ray.dirNeg[i] ? node.boundMax[i][j] : node.boundMin[i][j];
+			float hi = ray.dirNeg[i] ? node.boundMin[i][j] : node.boundMax[i][j];
+			float t0 = (lo - ray.ori[i]) * ray.inv[i];
+			float t1 = (hi - ray.ori[i]) * ray.inv[i];
+			tMin = t0 > tMin ? t0 : tMin;
+			tMax = t1 < tMax ? t1 : tMax;
+		}
+		tNear[j] = tMin;
+		mask |= (tMin <= tMax) << j;
+	}
+	return mask;
+#endif
+}
 
-	auto c = new HittableInfo[count];
-	memcpy(c, a, count * sizeof(HittableInfo));
+// Front to back order of the children by the sign of ray direction on the split axes
+inline void childOrder(const BVHWideNode &node, const RayBoxData &ray, int *order)
+{
+	int first = ray.dirNeg[node.splitAxis[1]];
+	int second = 2 + ray.dirNeg[node.splitAxis[2]];
+	if (ray.dirNeg[node.splitAxis[0]])
+		std::swap(first, second);
+	order[0] = first;
+	order[1] = first ^ 1;
+	order[2] = second;
+	order[3] = second ^ 1;
+}
+
+// Per ray setup of the watertight triangle test: axes permuted so that the ray travels along +z
+// and the shear that maps the ray direction onto the z axis
+struct RayTriangleData
+{
+	RayTriangleData() = default;
+	RayTriangleData(const Ray &ray)
+	{
+		int kz = Math::maxExtent(glm::abs(ray.dir));
+		int kx = (kz + 1) % 3;
+		int ky = (kx + 1) % 3;
+		if (ray.dir[kz] < 0.0f)
+			std::swap(kx, ky);
+		axis[0] = kx;
+		axis[1] = ky;
+		axis[2] = kz;
+		float shearDir[3] = { ray.dir[kx] / ray.dir[kz], ray.dir[ky] / ray.dir[kz], 1.0f / ray.dir[kz] };
+		for (int i = 0; i < 3; i++)
+		{
+#ifdef BVH_USE_SSE
+			ori[i] = _mm_set1_ps(ray.ori[axis[i]]);
+			shear[i] = _mm_set1_ps(shearDir[i]);
+#else
+			ori[i] = ray.ori[axis[i]];
+			shear[i] = shearDir[i];
+#endif
+		}
+	}
+	int axis[3];
+#ifdef BVH_USE_SSE
+	__m128 ori[3];
+	__m128 shear[3];
+#else
+	float ori[3];
+	float shear[3];
+#endif
+};
+
+#ifdef BVH_USE_SSE
+// Edge functions of the ray against the triangles of a block, same arithmetic as intersectTriangle.
+// valid is set where the ray passes through the triangle, tScaled is the hit distance times det
+struct TriangleEdges
+{
+	__m128 u, v, w, det, tScaled, valid;
+};
+
+inline TriangleEdges triangleEdges(const BVHTriangleBlock &block, const RayTriangleData &ray)
+{
+	auto shearVertex = [&ray](const float (*v)[BVHWidth], __m128 &x, __m128 &y, __m128 &z)
+	{
+		z = _mm_sub_ps(_mm_load_ps(v[ray.axis[2]]), ray.ori[2]);
+		x = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v[ray.axis[0]]), ray.ori[0]), _mm_mul_ps(ray.shear[0], z));
+		y = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(v[ray.axis[1]]), ray.ori[1]), _mm_mul_ps(ray.shear[1], z));
+	};
+	__m128 ax, ay, az, bx, by, bz, cx, cy, cz;
+	shearVertex(block.v0, ax, ay, az);
+	shearVertex(block.v1, bx, by, bz);
+	shearVertex(block.v2, cx, cy, cz);
+
+	TriangleEdges e;
+	e.u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+	e.v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+	e.w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+	__m128 zero = _mm_setzero_ps();
+	__m128 neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e.u, zero), _mm_cmplt_ps(e.v, zero)), _mm_cmplt_ps(e.w, zero));
+	__m128 pos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e.u, zero), _mm_cmpgt_ps(e.v, zero)), _mm_cmpgt_ps(e.w, zero));
+	e.det = _mm_add_ps(_mm_add_ps(e.u, e.v), e.w);
+	e.valid = _mm_andnot_ps(_mm_and_ps(neg, pos), _mm_cmpneq_ps(e.det, zero));
+	__m128 tScaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e.u, az), _mm_mul_ps(e.v, bz)), _mm_mul_ps(e.w, cz));
+	e.tScaled = _mm_mul_ps(tScaled, ray.shear[2]);
+	return e;
+}
+#else
+// Scalar edge functions of the ray against triangle i of a block, false if the ray misses it
+inline bool triangleEdges(const BVHTriangleBlock &block, const RayTriangleData &ray, int i,
+	float &u, float &v, float &w, float &det, float &tScaled)
+{
+	float x[3], y[3], z[3];
+	const float (*verts[3])[BVHWidth] = { block.v0, block.v1, block.v2 };
+	for (int j = 0; j < 3; j++)
+	{
+		z[j] = verts[j][ray.axis[2]][i] - ray.ori[2];
+		x[j] = verts[j][ray.axis[0]][i] - ray.ori[0] - ray.shear[0] * z[j];
+		y[j] = verts[j][ray.axis[1]][i] - ray.ori[1] - ray.shear[1] * z[j];
+	}
+	u = x[2] * y[1] - y[2] * x[1];
+	v = x[0] * y[2] - y[0] * x[2];
+	w = x[1] * y[0] - y[1] * x[0];
+	if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+		return false;
+	det = u + v + w;
+	tScaled = (u * z[0] + v * z[1] + w * z[2]) * ray.shear[2];
+	return det != 0.0f;
+}
+#endif
 
+// Watertight test against the first count triangles of a block.
+// Returns the nearest triangle hit within (0, dist) and shrinks dist to it, or -1
+inline int hitTriangles(const BVHTriangleBlock &block, const RayTriangleData &ray, int count, float &dist, Vec2f &bary)
+{
+	float ts[BVHWidth], vs[BVHWidth], ws[BVHWidth], dets[BVHWidth];
+#ifdef BVH_USE_SSE
+	TriangleEdges e = triangleEdges(block, ray);
+	__m128 t = _mm_div_ps(e.tScaled, e.det);
+	__m128 valid = _mm_and_ps(e.valid,
+		_mm_and_ps(_mm_cmpgt_ps(t, _mm_setzero_ps()), _mm_cmplt_ps(t, _mm_set1_ps(dist))));
+	int mask = _mm_movemask_ps(valid) & ((1 << count) - 1);
+	if (!mask)
+		return -1;
+	_mm_storeu_ps(ts, t);
+	_mm_storeu_ps(vs, e.v);
+	_mm_storeu_ps(ws, e.w);
+	_mm_storeu_ps(dets, e.det);
+#else
+	int mask = 0;
 	for (int i = 0; i < count; i++)
 	{
-		a[i] = c[b[i].second];
+		float u, tScaled;
+		if (!triangleEdges(block, ray, i, u, vs[i], ws[i], dets[i], tScaled))
+			continue;
+		ts[i] = tScaled / dets[i];
+		if (ts[i] > 0.0f && ts[i] < dist)
+			mask |= 1 << i;
 	}
-	delete[] b;
-	delete[] c;
+	if (!mask)
+		return -1;
+#endif
+	int nearest = -1;
+	for (int i = 0; i < count; i++)
+	{
+		if ((mask & (1 << i)) && ts[i] < dist)
+		{
+			dist = ts[i];
+			nearest = i;
+		}
+	}
+	if (nearest != -1)
+		bary = Vec2f(vs[nearest] / dets[nearest], ws[nearest] / dets[nearest]);
+	return nearest;
 }
 
-template<int NumBuckets>
-HittableInfo* partition(HittableInfo* a, int size, float axisMin, float axisMax, int splitDim, int splitPoint)
+// Any hit test against the triangles of a block in the bit mask lanes. The distance is never
+// needed, so instead of dividing by det the range (0, dist) is scaled by it
+inline bool occludedTriangles(const BVHTriangleBlock &block, const RayTriangleData &ray, int lanes, float dist)
 {
-	auto tmp = new HittableInfo[size];
-	std::copy(a, a + size, tmp);
-	int l = 0;
-	int r = size;
-	for (int i = 0; i < size; i++)
+#ifdef BVH_USE_SSE
+	TriangleEdges e = triangleEdges(block, ray);
+	__m128 detSign = _mm_and_ps(e.det, _mm_set1_ps(-0.0f));
+	__m128 tSigned = _mm_xor_ps(e.tScaled, detSign);
+	__m128 absDet = _mm_xor_ps(e.det, detSign);
+	__m128 valid = _mm_and_ps(e.valid, _mm_and_ps(_mm_cmpgt_ps(tSigned, _mm_setzero_ps()),
+		_mm_cmplt_ps(tSigned, _mm_mul_ps(_mm_set1_ps(dist), absDet))));
+	return _mm_movemask_ps(valid) & lanes;
+#else
+	for (int i = 0; i < BVHWidth; i++)
 	{
-		int b = NumBuckets * (tmp[i].centroid[splitDim] - axisMin) / (axisMax - axisMin);
-		b = std::max(std::min(b, NumBuckets - 1), 0);
-		(b <= splitPoint ? a[l++] : a[--r]) = tmp[i];
+		float u, v, w, det, tScaled;
+		if (!(lanes & (1 << i)) || !triangleEdges(block, ray, i, u, v, w, det, tScaled))
+			continue;
+		if (det < 0.0f)
+		{
+			det = -det;
+			tScaled = -tScaled;
+		}
+		if (tScaled > 0.0f && tScaled < dist * det)
+			return true;
 	}
-	delete[] tmp;
-	if (r == size)
-		r--;
-	return a + r - 1;
+	return false;
+#endif
 }
 
-BVH::BVH(const std::vector<HittablePtr> &hittables, BVHSplitMethod method) :
-    mSplitMethod(method)
+BVH::BVH(const std::vector<HittablePtr> &hittables, BVHSplitMethod method, float spatialSplitBudget,
+	ThreadPool *pool) :
+    mId(NextBVHId++), mSplitMethod(method), mSpatialSplitBudget(spatialSplitBudget)
 {
-    if (hittables.size() == 0)
+	mHittables = hittables;
+	for (int i = 0; i < hittables.size(); i++)
+	{
+		mRawHittables.push_back(hittables[i].get());
+		for (int j = 0; j < hittables[i]->numPrimitives(); j++)
+			mPrimitives.push_back({ i, j });
+	}
+    if (mPrimitives.size() == 0)
         return;
     std::vector<HittableInfo> hittableInfo;
 
-    AABB rootBox, rootCentExtent;
-	for (const auto &hittable : hittables)
+    AABB rootCentExtent;
+	for (const auto &ref : mPrimitives)
 	{
-		auto box = hittable->bound();
-		rootBox.expand(box);
+		auto box = mRawHittables[ref.hittable]->primitiveBound(ref.prim);
 		rootCentExtent.expand(box.centroid());
-		hittableInfo.push_back({ box, box.centroid(), hittable });
+		hittableInfo.push_back({ box, box.centroid(), static_cast<int>(hittableInfo.size()) });
+	}
+	if (mSplitMethod == BVHSplitMethod::SBVH)
+		spatialSplitBuild(hittableInfo);
+	else
+	{
+		mTree.resize(mPrimitives.size() * 2 - 1);
+		build(hittableInfo, rootCentExtent, pool);
 	}
-    mTreeSize = hittables.size() * 2 - 1;
-	mTree.resize(mTreeSize);
-	//standardBuild(hittableInfo, rootBox);
-	quickBuild(hittableInfo, rootCentExtent);
-    buildHitTable();
+	mTreeSize = mTree.size();
+	mSAHCost = computeSAHCost();
+
+	mNumReferences = hittableInfo.size();
+	std::vector<BVHPrimitive> ordered;
+	ordered.reserve(hittableInfo.size());
+	for (const auto &info : hittableInfo)
+		ordered.push_back(mPrimitives[info.index]);
+	mPrimitives = std::move(ordered);
+	collapse();
+}
+
+int BVH::hitLeaf(int offset, uint8_t leafSize, const Ray &ray, const RayTriangleData &triData,
+	float &dist, int &prim, Vec2f &bary)
+{
+	int count = leafSize & BVHLeafSizeMask;
+	if (leafSize & BVHTriangleLeaf)
+	{
+		int lane = hitTriangles(mTriangleBlocks[offset / BVHWidth], triData, count, dist, bary);
+		if (lane == -1)
+			return -1;
+		prim = mPrimitives[offset + lane].prim;
+		return offset + lane;
+	}
+	int hit = -1;
+	for (int j = offset; j < offset + count; j++)
+	{
+		auto primHit = mRawHittables[mPrimitives[j].hittable]->primitiveHit(ray, mPrimitives[j].prim);
+		if (primHit.has_value() && primHit->dist < dist)
+		{
+			dist = primHit->dist;
+			bary = primHit->bary;
+			prim = primHit->prim;
+			hit = j;
+		}
+	}
+	return hit;
+}
+
+bool BVH::occludedLeaf(int offset, uint8_t leafSize, uint8_t shadowMask, const Ray &ray, const RayTriangleData &triData,
+	float dist)
+{
+	if (leafSize & BVHTriangleLeaf)
+		return occludedTriangles(mTriangleBlocks[offset / BVHWidth], triData, shadowMask, dist);
+	int count = leafSize & BVHLeafSizeMask;
+	for (int j = 0; j < count; j++)
+	{
+		const auto &ref = mPrimitives[offset + j];
+		if ((shadowMask & (1 << j)) && mRawHittables[ref.hittable]->primitiveOccluded(ray, ref.prim, dist))
+			return true;
+	}
+	return false;
+}
+
+bool BVH::occludedByCached(const Ray &ray, const RayTriangleData &triData, float dist)
+{
+	const auto &entry = OccluderCache[mId % OccluderCacheSize];
+	return entry.bvh == mId && occludedLeaf(entry.offset, entry.leafSize, entry.shadowMask, ray, triData, dist);
+}
+
+void BVH::cacheOccluder(int offset, uint8_t leafSize, uint8_t shadowMask)
+{
+	OccluderCache[mId % OccluderCacheSize] = { mId, offset, leafSize, shadowMask };
+}
+
+// Rays of a packet in SoA form, so that a child bound is tested against several rays at once.
+// negative holds the direction signs as all-ones masks that pick the near and far slab per ray
+struct alignas(16) RayPacketBoxData
+{
+	RayPacketBoxData(const RayBoxData *rays, int count)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			for (int r = 0; r < BVHPacketSize; r++)
+			{
+				bool valid = r < count;
+				ori[i][r] = valid ? rays[r].scalarOri[i] : 0.0f;
+				inv[i][r] = valid ? rays[r].scalarInv[i] : 0.0f;
+				negative[i][r] = (valid && rays[r].dirNeg[i]) ? ~0u : 0u;
+			}
+		}
+	}
+	float ori[3][BVHPacketSize];
+	float inv[3][BVHPacketSize];
+	uint32_t negative[3][BVHPacketSize];
+};
+static_assert(BVHPacketSize % 4 == 0);
+
+// Slab test of the rays in the packet against the children of a node, fills the bit mask of
+// rays that hit each child. The node is fetched once and each child bound is tested against four
+// rays at a time, with the same NaN handling as hitChildren
+inline void packetHitChildren(const BVHWideNode &node, const RayPacketBoxData &packet, const float *dists,
+	int active, int *childRays)
+{
+	for (int j = 0; j < BVHWidth; j++)
+	{
+		int mask = 0;
+#ifdef BVH_USE_SSE
+		for (int r = 0; r < BVHPacketSize; r += 4)
+		{
+			__m128 tMin = _mm_setzero_ps();
+			__m128 tMax = _mm_load_ps(dists + r);
+			for (int i = 0; i < 3; i++)
+			{
+				__m128 boundMin = _mm_set1_ps(node.boundMin[i][j]);
+				__m128 boundMax = _mm_set1_ps(node.boundMax[i][j]);
+				__m128 negative = _mm_load_ps(reinterpret_cast<const float*>(packet.negative[i] + r));
+				__m128 lo = _mm_or_ps(_mm_and_ps(negative, boundMax), _mm_andnot_ps(negative, boundMin));
+				__m128 hi = _mm_or_ps(_mm_and_ps(negative, boundMin), _mm_andnot_ps(negative, boundMax));
+				__m128 ori = _mm_load_ps(packet.ori[i] + r);
+				__m128 inv = _mm_load_ps(packet.inv[i] + r);
+				tMin = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(lo, ori), inv), tMin);
+				tMax = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(hi, ori), inv), tMax);
+			}
+			mask |= _mm_movemask_ps(_mm_cmple_ps(tMin, tMax)) << r;
+		}
+#else
+		for (int r = 0; r < BVHPacketSize; r++)
+		{
+			float tMin = 0.0f;
+			float tMax = dists[r];
+			for (int i = 0; i < 3; i++)
+			{
+				bool negative = packet.negative[i][r];
+				float lo = negative ? node.boundMax[i][j] : node.boundMin[i][j];
+				float hi = negative ? node.boundMin[i][j] : node.boundMax[i][j];
+				float t0 = (lo - packet.ori[i][r]) * packet.inv[i][r];
+				float t1 = (hi - packet.ori[i][r]) * packet.inv[i][r];
+				tMin = t0 > tMin ? t0 : tMin;
+				tMax = t1 < tMax ? t1 : tMax;
+			}
+			mask |= (tMin <= tMax) << r;
+		}
+#endif
+		childRays[j] = mask & active;
+	}
+}
+
+// Lowest set bit, the ray that decides the child order for the whole packet
+inline int firstRay(int rays)
+{
+	int r = 0;
+	while (!(rays & (1 << r)))
+		r++;
+	return r;
+}
+
+void BVH::closestHit8(const Ray *rays, int count, HitInfo *hits)
+{
+	Error::check(count >= 0 && count <= BVHPacketSize, "BVH::closestHit8 takes at most BVHPacketSize rays");
+	alignas(16) float dist[BVHPacketSize] = {};
+	int prim[BVHPacketSize];
+	int hit[BVHPacketSize];
+	Vec2f bary[BVHPacketSize];
+	RayBoxData boxData[BVHPacketSize];
+	RayTriangleData triData[BVHPacketSize];
+	for (int r = 0; r < count; r++)
+	{
+		dist[r] = 1e8f;
+		prim[r] = 0;
+		hit[r] = -1;
+		bary[r] = Vec2f(0.0f);
+		boxData[r] = RayBoxData(rays[r]);
+		triData[r] = RayTriangleData(rays[r]);
+	}
+
+	RayPacketBoxData packet(boxData, count);
+
+	NodeStack<PacketStackEntry> stack(mStackSize);
+	int top = 0;
+	if (!mNodes.empty() && count > 0)
+		stack[top++] = { 0, (1 << count) - 1 };
+
+	while (top)
+	{
+		auto [nodeIndex, active] = stack[--top];
+		const auto &node = mNodes[nodeIndex];
+		int childRays[BVHWidth];
+		packetHitChildren(node, packet, dist, active, childRays);
+
+		int order[BVHWidth];
+		childOrder(node, boxData[firstRay(active)], order);
+		for (int i = 0; i < BVHWidth; i++)
+		{
+			int slot = order[i];
+			int child = node.child[slot];
+			if (!childRays[slot] || !(child & BVHLeafMark))
+				continue;
+			for (int r = 0; r < count; r++)
+			{
+				if (!(childRays[slot] & (1 << r)))
+					continue;
+				int leafHit = hitLeaf(child & ~BVHLeafMark, node.leafSize[slot], rays[r], triData[r],
+					dist[r], prim[r], bary[r]);
+				if (leafHit != -1)
+					hit[r] = leafHit;
+			}
+		}
+		for (int i = BVHWidth - 1; i >= 0; i--)
+		{
+			int slot = order[i];
+			if (childRays[slot] && !(node.child[slot] & BVHLeafMark))
+				stack[top++] = { node.child[slot], childRays[slot] };
+		}
+	}
+	for (int r = 0; r < count; r++)
+	{
+		if (hit[r] == -1)
+			hits[r] = { dist[r], nullptr, 0, Vec2f(0.0f) };
+		else
+			hits[r] = { dist[r], mHittables[mPrimitives[hit[r]].hittable], prim[r], bary[r] };
+	}
+}
+
+int BVH::occluded8(const Ray *rays, const float *dists, int count)
+{
+	Error::check(count >= 0 && count <= BVHPacketSize, "BVH::occluded8 takes at most BVHPacketSize rays");
+	if (count == 1)
+		return testIntersec(rays[0], dists[0]) ? 1 : 0;
+
+	if (mNodes.empty())
+		return 0;
+
+	alignas(16) float dist[BVHPacketSize] = {};
+	RayBoxData boxData[BVHPacketSize];
+	RayTriangleData triData[BVHPacketSize];
+	int occluded = 0;
+	for (int r = 0; r < count; r++)
+	{
+		dist[r] = dists[r];
+		boxData[r] = RayBoxData(rays[r]);
+		triData[r] = RayTriangleData(rays[r]);
+		if (occludedByCached(rays[r], triData[r], dist[r]))
+			occluded |= 1 << r;
+	}
+
+	RayPacketBoxData packet(boxData, count);
+
+	int all = (1 << count) - 1;
+	NodeStack<PacketStackEntry> stack(mStackSize);
+	int top = 0;
+	if (occluded != all)
+		stack[top++] = { 0, all & ~occluded };
+
+	// Rays leave the packet as soon as they are found occluded
+	while (top && occluded != all)
+	{
+		auto [nodeIndex, active] = stack[--top];
+		active &= ~occluded;
+		if (!active)
+			continue;
+		const auto &node = mNodes[nodeIndex];
+		int childRays[BVHWidth];
+		packetHitChildren(node, packet, dist, active, childRays);
+
+		int order[BVHWidth];
+		childOrder(node, boxData[firstRay(active)], order);
+		for (int i = 0; i < BVHWidth; i++)
+		{
+			int slot = order[i];
+			int child = node.child[slot];
+			if (!childRays[slot] || !(child & BVHLeafMark) || !node.shadowMask[slot])
+				continue;
+			for (int r = 0; r < count; r++)
+			{
+				if (!(childRays[slot] & ~occluded & (1 << r)))
+					continue;
+				if (occludedLeaf(child & ~BVHLeafMark, node.leafSize[slot], node.shadowMask[slot], rays[r], triData[r],
+					dist[r]))
+				{
+					occluded |= 1 << r;
+					cacheOccluder(child & ~BVHLeafMark, node.leafSize[slot], node.shadowMask[slot]);
+				}
+			}
+		}
+		for (int i = BVHWidth - 1; i >= 0; i--)
+		{
+			int slot = order[i];
+			int rays = childRays[slot] & ~occluded;
+			if (rays && !(node.child[slot] & BVHLeafMark))
+				stack[top++] = { node.child[slot], rays };
+		}
+	}
+	return occluded;
 }
 
 bool BVH::testIntersec(const Ray &ray, float dist)
 {
-    if (mTreeSize == 0)
+    if (mNodes.empty())
         return false;
-    auto &table = mHitTables[Math::cubeMapFace(-ray.dir)];
-
-    int k = 0;
-    while (k != mTreeSize)
-    {
-        auto [box, hittable, size] = mTree[table[k].nodeIndex];
-        auto [boxHit, tMin, tMax] = box.hit(ray);
-
-        if (!boxHit || (boxHit && tMin > dist))
-        {
-            k = table[k].misNext;
-            continue;
-        }
-
-        if (hittable != nullptr)
-        {
-            auto t = hittable->closestHit(ray);
-            if (t.has_value())
-            {
-                if (t.value() < dist)
-                    return true;
-            }
-        }
-        k++;
-    }
+	RayBoxData rayData(ray);
+	RayTriangleData triData(ray);
+	if (occludedByCached(ray, triData, dist))
+		return true;
+	NodeStack<NodeStackEntry> stack(mStackSize);
+	int top = 0;
+	stack[top++] = { 0, 0.0f };
+
+	while (top)
+	{
+		const auto &node = mNodes[stack[--top].node];
+		float tNear[BVHWidth];
+		int mask = hitChildren(node, rayData, dist, tNear);
+		if (!mask)
+			continue;
+
+		int order[BVHWidth];
+		childOrder(node, rayData, order);
+		for (int i = 0; i < BVHWidth; i++)
+		{
+			int slot = order[i];
+			if (!(mask & (1 << slot)))
+				continue;
+			int child = node.child[slot];
+			if (!(child & BVHLeafMark) || !node.shadowMask[slot])
+				continue;
+			if (occludedLeaf(child & ~BVHLeafMark, node.leafSize[slot], node.shadowMask[slot], ray, triData, dist))
+			{
+				cacheOccluder(child & ~BVHLeafMark, node.leafSize[slot], node.shadowMask[slot]);
+				return true;
+			}
+		}
+		for (int i = BVHWidth - 1; i >= 0; i--)
+		{
+			int slot = order[i];
+			if ((mask & (1 << slot)) && !(node.child[slot] & BVHLeafMark))
+				stack[top++] = { node.child[slot], tNear[slot] };
+		}
+	}
     return false;
 }
 
-std::pair<float, HittablePtr> BVH::closestHit(const Ray &ray)
-{
-    if (mTreeSize == 0)
-        return {0.0f, nullptr};
-    float dist = 1e8f;
-    std::shared_ptr<Hittable> hit;
-    auto &table = mHitTables[Math::cubeMapFace(-ray.dir)];
-
-    int k = 0;
-    while (k != mTreeSize)
-    {
-        auto [box, hittable, size] = mTree[table[k].nodeIndex];
-        auto [boxHit, tMin, tMax] = box.hit(ray);
-
-        if (!boxHit || (boxHit && tMin > dist))
-        {
-            k = table[k].misNext;
-            continue;
-        }
-
-        if (hittable != nullptr)
-        {
-            auto t = hittable->closestHit(ray);
-            if (t.has_value())
-            {
-                if (t.value() < dist)
-                {
-                    dist = t.value();
-                    hit = hittable;
-                }
-            }
-        }
-        k++;
-    }
-    return {dist, hit};
-}
-
-void BVH::quickBuild(std::vector<HittableInfo> &primInfo, const AABB &rootExtent)
+int BVH::closestReference(const Ray &ray, float &dist, int &prim, Vec2f &bary)
+{
+    if (mNodes.empty())
+        return -1;
+	int hit = -1;
+	RayBoxData rayData(ray);
+	RayTriangleData triData(ray);
+	NodeStack<NodeStackEntry> stack(mStackSize);
+	int top = 0;
+	stack[top++] = { 0, 0.0f };
+
+	while (top)
+	{
+		auto [nodeIndex, tEnter] = stack[--top];
+		if (tEnter > dist)
+			continue;
+		const auto &node = mNodes[nodeIndex];
+		float tNear[BVHWidth];
+		int mask = hitChildren(node, rayData, dist, tNear);
+		if (!mask)
+			continue;
+
+		// Leaves are intersected in front-to-back order right away to shrink dist,
+		// inner nodes are pushed back to front so the nearest one is popped first
+		int order[BVHWidth];
+		childOrder(node, rayData, order);
+		for (int i = 0; i < BVHWidth; i++)
+		{
+			int slot = order[i];
+			int child = node.child[slot];
+			if (!(mask & (1 << slot)) || !(child & BVHLeafMark) || tNear[slot] > dist)
+				continue;
+			int leafHit = hitLeaf(child & ~BVHLeafMark, node.leafSize[slot], ray, triData, dist, prim, bary);
+			if (leafHit != -1)
+				hit = leafHit;
+		}
+		for (int i = BVHWidth - 1; i >= 0; i--)
+		{
+			int slot = order[i];
+			if ((mask & (1 << slot)) && !(node.child[slot] & BVHLeafMark) && tNear[slot] <= dist)
+				stack[top++] = { node.child[slot], tNear[slot] };
+		}
+	}
+	return hit;
+}
+
+HitInfo BVH::closestHit(const Ray &ray)
+{
+	float dist = 1e8f;
+	int prim = 0;
+	Vec2f bary(0.0f);
+	int hit = closestReference(ray, dist, prim, bary);
+	if (hit == -1)
+		return { dist, nullptr, 0, Vec2f(0.0f) };
+	return { dist, mHittables[mPrimitives[hit].hittable], prim, bary };
+}
+
+std::optional<PrimitiveHit> BVH::closestPrimitiveHit(const Ray &ray)
+{
+	float dist = 1e8f;
+	int prim = 0;
+	Vec2f bary(0.0f);
+	if (closestReference(ray, dist, prim, bary) == -1)
+		return std::nullopt;
+	return PrimitiveHit{ dist, bary, prim };
+}
+
+void BVH::build(std::vector<HittableInfo> &primInfo, const AABB &rootExtent, ThreadPool *pool)
+{
+	if (mSplitMethod == BVHSplitMethod::HLBVH)
+		sortByMortonCode(primInfo, rootExtent);
+
+	BuildRec root = { 0, rootExtent, 0, static_cast<int>(primInfo.size()) - 1 };
+	if (pool == nullptr || primInfo.size() < ParallelBuildThreshold)
+		buildSubtree(primInfo, root, nullptr);
+	else
+	{
+		TaskGroup tasks(*pool);
+		buildSubtree(primInfo, root, &tasks);
+		tasks.wait();
+	}
+	mMortonCodes.clear();
+	mMortonCodes.shrink_to_fit();
+}
+
+// Builds the subtree of rec into the node range [rec.offset, rec.offset + 2 * count - 1)
+// and its primitive range. Subtrees of different tasks never share nodes or primitives,
+// so large ones are handed to other threads as they come up
+void BVH::buildSubtree(std::vector<HittableInfo> &primInfo, const BuildRec &rec, TaskGroup *tasks)
 {
     std::stack<BuildRec> stack;
-	stack.push({ 0, rootExtent, rootExtent.maxExtent(), 0, static_cast<int>(primInfo.size()) - 1 });
+	stack.push(rec);
+	std::vector<float> sweepAreas;
 
-	constexpr int NumBuckets = 16;
-	int depth = 0;
 	while (!stack.empty())
 	{
-		mDepth = std::max(mDepth, depth);
-		auto [offset, nodeExtent, splitDim, l, r] = stack.top();
+		auto [offset, nodeExtent, l, r] = stack.top();
 		stack.pop();
-		int size = (r - l) * 2 + 1;
 		auto &node = mTree[offset];
-        node.size = size;
-        node.hittable = (size == 1) ? primInfo[l].hittable : nullptr;
+		node.count = 0;
+		int nBoxes = r - l + 1;
+		int splitDim = nodeExtent.maxExtent();
+
+		auto pushChildren = [&](int splitPoint, const AABB &lchCentBox, const AABB &rchCentBox)
+		{
+			int rch = offset + 2 * (splitPoint - l) + 2;
+			node.offset = rch;
+			BuildRec rchRec = { rch, rchCentBox, splitPoint + 1, r };
+			if (tasks && r - splitPoint >= ParallelBuildThreshold)
+				tasks->run([this, &primInfo, rchRec, tasks]() { buildSubtree(primInfo, rchRec, tasks); });
+			else
+				stack.push(rchRec);
+			stack.push({ offset + 1, lchCentBox, l, splitPoint });
+		};
 
-		if (l == r)
+		if (nBoxes == 1 || nodeExtent.pMin[splitDim] == nodeExtent.pMax[splitDim])
 		{
-			node.bound = primInfo[l].bound;
-			depth--;
+			node.bound = AABB();
+			for (int i = l; i <= r; i++)
+				node.bound.expand(primInfo[i].bound);
+			if (nBoxes <= BVHMaxLeafSize)
+			{
+				node.offset = l;
+				node.count = nBoxes;
+				continue;
+			}
+			// All centroids coincide, nothing for any split method to tell apart
+			pushChildren(l + nBoxes / 2 - 1, nodeExtent, nodeExtent);
 			continue;
 		}
-		depth++;
-		int nBoxes = r - l + 1;
-		if (nBoxes == 2)
+
+		BVHSplit split;
+		switch (mSplitMethod)
 		{
-			node.bound = AABB(primInfo[l].bound, primInfo[r].bound);
-			if (primInfo[l].centroid[splitDim] > primInfo[r].centroid[splitDim])
-				std::swap(primInfo[l], primInfo[r]);
-			stack.push({ offset + 2, primInfo[r].centroid, 0, r, r });
-			stack.push({ offset + 1, primInfo[l].centroid, 0, l, l });
+		case BVHSplitMethod::SAH:
+			split = sweepSplit(primInfo.data(), l, r, sweepAreas);
+			break;
+		case BVHSplitMethod::BinnedSAH:
+			split = binnedSplit(primInfo.data(), l, r, nodeExtent, tasks);
+			break;
+		case BVHSplitMethod::Middle:
+			split = middleSplit(primInfo.data(), l, r, nodeExtent);
+			break;
+		case BVHSplitMethod::EqualCounts:
+			split = equalCountsSplit(primInfo.data(), l, r, nodeExtent);
+			break;
+		case BVHSplitMethod::HLBVH:
+			split = mortonSplit(primInfo.data(), l, r);
+			break;
+		}
+		node.bound = split.bound;
+
+		if (split.splitPoint == -1)
+		{
+			node.offset = l;
+			node.count = nBoxes;
 			continue;
 		}
+		pushChildren(split.splitPoint, split.lchCentBox, split.rchCentBox);
+	}
+}
 
-		float axisMin = nodeExtent.pMin[splitDim];
-		float axisMax = nodeExtent.pMax[splitDim];
+BVHSplit BVH::binnedSplit(HittableInfo *primInfo, int l, int r, const AABB &nodeExtent, TaskGroup *tasks)
+{
+	int nBoxes = r - l + 1;
+	int splitDim = nodeExtent.maxExtent();
+	float axisMin = nodeExtent.pMin[splitDim];
+	float axisMax = nodeExtent.pMax[splitDim];
 
-		Bucket buckets[NumBuckets];
-		Bucket prefix[NumBuckets];
-		Bucket suffix[NumBuckets];
+	Bucket buckets[BVHNumBuckets];
+	Bucket prefix[BVHNumBuckets];
+	Bucket suffix[BVHNumBuckets];
+	binPrimitives(primInfo, l, r, splitDim, axisMin, axisMax, buckets, tasks);
 
-		for (int i = l; i <= r; i++)
+	prefix[0] = buckets[0];
+	suffix[BVHNumBuckets - 1] = buckets[BVHNumBuckets - 1];
+	for (int i = 1; i < BVHNumBuckets; i++)
+	{
+		prefix[i] = Bucket(prefix[i - 1], buckets[i]);
+		suffix[BVHNumBuckets - 1 - i] = Bucket(suffix[BVHNumBuckets - i], buckets[BVHNumBuckets - i - 1]);
+	}
+	BVHSplit split;
+	split.bound = prefix[BVHNumBuckets - 1].box;
+
+	int splitPoint = 0;
+	float minCost = prefix[0].count * prefix[0].box.surfaceArea() +
+		suffix[1].count * suffix[1].box.surfaceArea();
+	for (int i = 1; i < BVHNumBuckets - 1; i++)
+	{
+		float cost = prefix[i].count * prefix[i].box.surfaceArea() +
+			suffix[i + 1].count * suffix[i + 1].box.surfaceArea();
+		if (cost < minCost)
 		{
-			int b = NumBuckets * (primInfo[i].centroid[splitDim] - axisMin) / (axisMax - axisMin);
-			b = std::max(std::min(b, NumBuckets - 1), 0);
-			buckets[b].count++;
-			buckets[b].box.expand(primInfo[i].bound);
+			minCost = cost;
+			splitPoint = i;
 		}
+	}
+
+	float splitCost = SAHTraversalCost + minCost / split.bound.surfaceArea();
+	if (nBoxes <= BVHMaxLeafSize && nBoxes <= splitCost)
+		return split;
 
-		prefix[0] = buckets[0];
-		suffix[NumBuckets - 1] = buckets[NumBuckets - 1];
-		for (int i = 1; i < NumBuckets; i++)
+	int lCount = prefix[splitPoint].count;
+	if (lCount == 0 || lCount == nBoxes)
+	{
+		split.splitPoint = l + nBoxes / 2 - 1;
+		split.lchCentBox = split.rchCentBox = nodeExtent;
+		return split;
+	}
+	partition<BVHNumBuckets>(primInfo + l, nBoxes, axisMin, axisMax, splitDim, splitPoint);
+	split.splitPoint = l + lCount - 1;
+	split.lchCentBox = prefix[splitPoint].centBox;
+	split.rchCentBox = suffix[splitPoint + 1].centBox;
+	return split;
+}
+
+void BVH::binPrimitives(const HittableInfo *primInfo, int l, int r, int splitDim, float axisMin, float axisMax,
+	Bucket *buckets, TaskGroup *tasks)
+{
+	auto bin = [=](int begin, int end, Bucket *result)
+	{
+		for (int i = begin; i <= end; i++)
 		{
-			prefix[i] = Bucket(prefix[i - 1], buckets[i]);
-			suffix[NumBuckets - 1 - i] = Bucket(suffix[NumBuckets - i], buckets[NumBuckets - i - 1]);
+			int b = BVHNumBuckets * (primInfo[i].centroid[splitDim] - axisMin) / (axisMax - axisMin);
+			b = std::max(std::min(b, BVHNumBuckets - 1), 0);
+			result[b].count++;
+			result[b].box.expand(primInfo[i].bound);
+			result[b].centBox.expand(primInfo[i].centroid);
 		}
-		node.bound = prefix[NumBuckets - 1].box;
+	};
+	int nBoxes = r - l + 1;
+	if (!tasks || nBoxes < ParallelBinThreshold)
+	{
+		bin(l, r, buckets);
+		return;
+	}
+	// Only the top levels are large enough for binning to be worth splitting up
+	int nChunks = (nBoxes + ParallelBinThreshold - 1) / ParallelBinThreshold;
+	std::vector<std::array<Bucket, BVHNumBuckets>> chunkBuckets(nChunks);
+	TaskGroup chunkTasks(tasks->pool());
+	for (int i = 0; i < nChunks; i++)
+	{
+		int begin = l + i * ParallelBinThreshold;
+		int end = std::min(begin + ParallelBinThreshold - 1, r);
+		chunkTasks.run([&, i, begin, end]() { bin(begin, end, chunkBuckets[i].data()); });
+	}
+	chunkTasks.wait();
+	for (const auto &chunk : chunkBuckets)
+	{
+		for (int i = 0; i < BVHNumBuckets; i++)
+			buckets[i] = Bucket(buckets[i], chunk[i]);
+	}
+}
+
+// Evaluates SAH at every primitive boundary along all three axes instead of at bucket boundaries
+BVHSplit BVH::sweepSplit(HittableInfo *primInfo, int l, int r, std::vector<float> &areas)
+{
+	int nBoxes = r - l + 1;
+	BVHSplit split;
+	split.bound = rangeBound(primInfo, l, r);
+	areas.resize(nBoxes);
 
-		int splitPoint = 0;
-		float minCost = prefix[0].count * prefix[0].box.surfaceArea() +
-			suffix[1].count * suffix[1].box.surfaceArea();
-		for (int i = 1; i < NumBuckets - 1; i++)
+	float minCost = std::numeric_limits<float>::infinity();
+	int bestDim = 0;
+	int sortedDim = -1;
+	for (int dim = 0; dim < 3; dim++)
+	{
+		sortByCentroid(primInfo + l, primInfo + r + 1, dim);
+		sortedDim = dim;
+
+		AABB box;
+		for (int i = r; i > l; i--)
 		{
-			float cost = prefix[i].count * prefix[i].box.surfaceArea() +
-				suffix[i + 1].count * suffix[i + 1].box.surfaceArea();
+			box.expand(primInfo[i].bound);
+			areas[i - l] = box.surfaceArea();
+		}
+		box = AABB();
+		for (int i = l; i < r; i++)
+		{
+			box.expand(primInfo[i].bound);
+			float cost = (i - l + 1) * box.surfaceArea() + (r - i) * areas[i - l + 1];
 			if (cost < minCost)
 			{
 				minCost = cost;
-				splitPoint = i;
+				bestDim = dim;
+				split.splitPoint = i;
 			}
 		}
-		auto itr = partition<NumBuckets>(&primInfo[l], nBoxes, axisMin, axisMax, splitDim, splitPoint);
-		splitPoint = itr - &primInfo[0];
+	}
+
+	float splitCost = SAHTraversalCost + minCost / split.bound.surfaceArea();
+	if (nBoxes <= BVHMaxLeafSize && nBoxes <= splitCost)
+	{
+		split.splitPoint = -1;
+		return split;
+	}
+	if (bestDim != sortedDim)
+		sortByCentroid(primInfo + l, primInfo + r + 1, bestDim);
+	split.lchCentBox = rangeCentroidBound(primInfo, l, split.splitPoint);
+	split.rchCentBox = rangeCentroidBound(primInfo, split.splitPoint + 1, r);
+	return split;
+}
+
+BVHSplit BVH::middleSplit(HittableInfo *primInfo, int l, int r, const AABB &nodeExtent)
+{
+	int nBoxes = r - l + 1;
+	BVHSplit split;
+	split.bound = rangeBound(primInfo, l, r);
+	if (nBoxes <= BVHMaxLeafSize)
+		return split;
+
+	int splitDim = nodeExtent.maxExtent();
+	float axisMid = nodeExtent.centroid()[splitDim];
+	auto itr = std::partition(primInfo + l, primInfo + r + 1, [=](const HittableInfo &info)
+	{
+		return info.centroid[splitDim] < axisMid;
+	});
+	split.splitPoint = static_cast<int>(itr - primInfo) - 1;
+	if (split.splitPoint < l || split.splitPoint >= r)
+		return equalCountsSplit(primInfo, l, r, nodeExtent);
+
+	split.lchCentBox = rangeCentroidBound(primInfo, l, split.splitPoint);
+	split.rchCentBox = rangeCentroidBound(primInfo, split.splitPoint + 1, r);
+	return split;
+}
 
-		AABB lchCentBox, rchCentBox;
-		for (int i = l; i <= splitPoint; i++)
-			lchCentBox.expand(primInfo[i].centroid);
-		for (int i = splitPoint + 1; i <= r; i++)
-			rchCentBox.expand(primInfo[i].centroid);
+BVHSplit BVH::equalCountsSplit(HittableInfo *primInfo, int l, int r, const AABB &nodeExtent)
+{
+	int nBoxes = r - l + 1;
+	BVHSplit split;
+	split.bound = rangeBound(primInfo, l, r);
+	if (nBoxes <= BVHMaxLeafSize)
+		return split;
+
+	int splitDim = nodeExtent.maxExtent();
+	split.splitPoint = l + nBoxes / 2 - 1;
+	std::nth_element(primInfo + l, primInfo + split.splitPoint, primInfo + r + 1,
+		[splitDim](const HittableInfo &a, const HittableInfo &b)
+		{
+			return a.centroid[splitDim] < b.centroid[splitDim];
+		});
+	split.lchCentBox = rangeCentroidBound(primInfo, l, split.splitPoint);
+	split.rchCentBox = rangeCentroidBound(primInfo, split.splitPoint + 1, r);
+	return split;
+}
 
-		stack.push({ offset + 2 * (splitPoint - l) + 2, rchCentBox, rchCentBox.maxExtent(), splitPoint + 1, r });
-		stack.push({ offset + 1, lchCentBox, lchCentBox.maxExtent(), l, splitPoint });
+// Primitives are sorted by Morton code before the build, so every node splits its
+// range where the highest bit differing between its first and last code flips
+BVHSplit BVH::mortonSplit(HittableInfo *primInfo, int l, int r)
+{
+	int nBoxes = r - l + 1;
+	BVHSplit split;
+	split.bound = rangeBound(primInfo, l, r);
+	if (nBoxes <= BVHMaxLeafSize)
+		return split;
+
+	uint32_t first = mMortonCodes[l];
+	uint32_t last = mMortonCodes[r];
+	if (first == last)
+		split.splitPoint = l + nBoxes / 2 - 1;
+	else
+	{
+		int bit = 31;
+		while (!((first ^ last) & (1u << bit)))
+			bit--;
+		uint32_t lastOfLeft = first | ((1u << bit) - 1);
+		auto itr = std::upper_bound(mMortonCodes.begin() + l, mMortonCodes.begin() + r + 1, lastOfLeft);
+		split.splitPoint = static_cast<int>(itr - mMortonCodes.begin()) - 1;
 	}
+	split.lchCentBox = rangeCentroidBound(primInfo, l, split.splitPoint);
+	split.rchCentBox = rangeCentroidBound(primInfo, split.splitPoint + 1, r);
+	return split;
 }
 
-void BVH::standardBuild(std::vector<HittableInfo> &primInfo, const AABB &rootExtent)
+void BVH::sortByMortonCode(std::vector<HittableInfo> &primInfo, const AABB &rootExtent)
 {
-	// TODO: fix craching bug here.
-	std::stack<BuildRec> stack;
-	stack.push({ 0, rootExtent, rootExtent.maxExtent(), 0, static_cast<int>(primInfo.size()) - 1 });
+	int count = primInfo.size();
+	Vec3f extent = rootExtent.pMax - rootExtent.pMin;
+	std::vector<RadixSortElement> keys(count);
+	for (int i = 0; i < count; i++)
+	{
+		Vec3f p = (primInfo[i].centroid - rootExtent.pMin) / glm::max(extent, Vec3f(1e-20f));
+		keys[i] = { static_cast<int>(mortonCode(p)), i };
+	}
+	radixSortLH(keys.data(), count);
+
+	std::vector<HittableInfo> sorted(count);
+	mMortonCodes.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		sorted[i] = primInfo[keys[i].second];
+		mMortonCodes[i] = keys[i].first;
+	}
+	primInfo.swap(sorted);
+}
+
+AABB BVH::clippedBound(int ref, const AABB &box) const
+{
+	return mRawHittables[mPrimitives[ref].hittable]->clippedBound(mPrimitives[ref].prim, box);
+}
+
+int BVH::createNode(int parent)
+{
+	int index = mTree.size();
+	mTree.push_back({ AABB(), 0, 0 });
+	// Left children are always built right after their parents, only right ones need linking
+	if (parent != -1 && index != parent + 1)
+		mTree[parent].offset = index;
+	return index;
+}
+
+// SBVH build (Stich et al. 2009). Besides object splits, a node may be split by a plane with
+// references straddling it clipped into both children, which removes the overlap object splits
+// leave behind with long thin primitives. Duplicated references are limited by the budget
+void BVH::spatialSplitBuild(std::vector<HittableInfo> &primInfo)
+{
+	struct SpatialBuildRec
+	{
+		int parent;
+		std::vector<HittableInfo> refs;
+	};
+	int numRefs = primInfo.size();
+	int maxRefs = static_cast<int>(primInfo.size() * (1.0f + mSpatialSplitBudget));
+	float rootArea = rangeBound(primInfo.data(), 0, numRefs - 1).surfaceArea();
 
-	auto prefixes = new BoxRec[primInfo.size()];
-	auto suffixes = new BoxRec[primInfo.size()];
+	std::vector<HittableInfo> leafRefs;
+	std::stack<SpatialBuildRec> stack;
+	stack.push({ -1, std::move(primInfo) });
+	mTree.clear();
 
 	while (!stack.empty())
 	{
-		auto [offset, nodeExtent, splitDim, l, r] = stack.top();
+		auto [parent, refs] = std::move(stack.top());
 		stack.pop();
-		int size = (r - l) * 2 + 1;
-        auto &node = mTree[offset];
-        node.size = size;
-        node.hittable = (size == 1) ? primInfo[l].hittable : nullptr;
+		int index = createNode(parent);
+		int nRefs = refs.size();
+		AABB bound = rangeBound(refs.data(), 0, nRefs - 1);
+		mTree[index].bound = bound;
 
-		if (l == r)
+		auto makeLeaf = [&]()
 		{
-            node.bound = primInfo[l].bound;
+			mTree[index].offset = leafRefs.size();
+			mTree[index].count = nRefs;
+			leafRefs.insert(leafRefs.end(), refs.begin(), refs.end());
+		};
+		if (nRefs == 1)
+		{
+			makeLeaf();
 			continue;
 		}
-		int nBoxes = r - l + 1;
-		radixSort16(primInfo.data() + l, nBoxes, splitDim);
-		if (nBoxes == 2)
+
+		auto objectSplit = findObjectSplit(refs);
+		SpatialSplit spatialSplit;
+		AABB overlap = objectSplit.lBound.intersect(objectSplit.rBound);
+		// Only worth trying where the children of the object split overlap noticeably, and not
+		// for ranges that fit in a leaf where duplicated references cost more than they save
+		if (numRefs < maxRefs && nRefs > BVHMaxLeafSize && !overlap.isEmpty() && overlap.surfaceArea() > SpatialSplitAlpha * rootArea)
+			spatialSplit = findSpatialSplit(refs, bound);
+
+		float minCost = std::min(objectSplit.cost, spatialSplit.cost);
+		float splitCost = SAHTraversalCost + minCost / bound.surfaceArea();
+		if (nRefs <= BVHMaxLeafSize && nRefs <= splitCost)
 		{
-			node.bound = AABB(primInfo[l].bound, primInfo[r].bound);
-			stack.push({ offset + 2, primInfo[r].bound, 0, r, r });
-			stack.push({ offset + 1, primInfo[l].bound, 0, l, l });
+			makeLeaf();
 			continue;
 		}
-		
-		auto prefix = prefixes + l;
-		auto suffix = suffixes + l;
-		prefix[0] = { primInfo[l].bound, primInfo[l].centroid };
-		suffix[nBoxes - 1] = { primInfo[r].bound, primInfo[r].centroid };
 
-		for (int i = 1; i < nBoxes; i++)
+		std::vector<HittableInfo> lRefs, rRefs;
+		if (spatialSplit.cost < objectSplit.cost)
+			performSpatialSplit(refs, bound, spatialSplit, lRefs, rRefs, numRefs, maxRefs);
+		else if (objectSplit.dim != -1)
 		{
-			prefix[i] = { AABB(prefix[i - 1].vertBox, primInfo[l + i].bound),
-				AABB(prefix[i - 1].centExtent, primInfo[l + i].centroid) };
-			suffix[nBoxes - i - 1] = { AABB(suffix[nBoxes - i].vertBox, primInfo[r - i].bound),
-				AABB(suffix[nBoxes - i].centExtent, primInfo[r - i].centroid) };
+			for (const auto &ref : refs)
+				(ref.centroid[objectSplit.dim] < objectSplit.pos ? lRefs : rRefs).push_back(ref);
 		}
-		node.bound = prefix[nBoxes - 1].vertBox;
+		if (lRefs.empty() || rRefs.empty())
+		{
+			if (nRefs <= BVHMaxLeafSize)
+			{
+				makeLeaf();
+				continue;
+			}
+			// Nothing separates the references, split them by count
+			lRefs.assign(refs.begin(), refs.begin() + nRefs / 2);
+			rRefs.assign(refs.begin() + nRefs / 2, refs.end());
+		}
+		refs.clear();
+		refs.shrink_to_fit();
+		stack.push({ index, std::move(rRefs) });
+		stack.push({ index, std::move(lRefs) });
+	}
+	primInfo = std::move(leafRefs);
+}
+
+ObjectSplit BVH::findObjectSplit(const std::vector<HittableInfo> &refs)
+{
+	ObjectSplit split;
+	AABB centBound = rangeCentroidBound(refs.data(), 0, refs.size() - 1);
+	for (int dim = 0; dim < 3; dim++)
+	{
+		float axisMin = centBound.pMin[dim];
+		float axisMax = centBound.pMax[dim];
+		if (axisMin == axisMax)
+			continue;
+
+		Bucket buckets[BVHNumBuckets];
+		binPrimitives(refs.data(), 0, refs.size() - 1, dim, axisMin, axisMax, buckets, nullptr);
+
+		Bucket suffix[BVHNumBuckets];
+		suffix[BVHNumBuckets - 1] = buckets[BVHNumBuckets - 1];
+		for (int i = BVHNumBuckets - 2; i >= 0; i--)
+			suffix[i] = Bucket(buckets[i], suffix[i + 1]);
+
+		Bucket prefix;
+		for (int i = 0; i < BVHNumBuckets - 1; i++)
+		{
+			prefix = Bucket(prefix, buckets[i]);
+			if (prefix.count == 0 || suffix[i + 1].count == 0)
+				continue;
+			float cost = prefix.count * prefix.box.surfaceArea() + suffix[i + 1].count * suffix[i + 1].box.surfaceArea();
+			if (cost < split.cost)
+			{
+				split.cost = cost;
+				split.dim = dim;
+				split.pos = suffix[i + 1].centBox.pMin[dim];
+				split.lBound = prefix.box;
+				split.rBound = suffix[i + 1].box;
+			}
+		}
+	}
+	return split;
+}
 
-		auto getCost = [&](int i) -> float
+SpatialSplit BVH::findSpatialSplit(const std::vector<HittableInfo> &refs, const AABB &bound)
+{
+	struct SpatialBin
+	{
+		AABB box;
+		int enter = 0;
+		int exit = 0;
+	};
+	SpatialSplit split;
+	for (int dim = 0; dim < 3; dim++)
+	{
+		float axisMin = bound.pMin[dim];
+		float extent = bound.pMax[dim] - axisMin;
+		if (extent <= 0.0f)
+			continue;
+		auto binOf = [=](float x)
 		{
-			return prefix[i].vertBox.surfaceArea() * (i + 1) +
-				suffix[i + 1].vertBox.surfaceArea() * (nBoxes - i - 1);
+			int b = SpatialSplitBins * (x - axisMin) / extent;
+			return std::max(std::min(b, SpatialSplitBins - 1), 0);
 		};
+		auto planeOf = [=](int i) { return axisMin + extent * i / SpatialSplitBins; };
 
-		int splitPoint = l;
-		float minCost = getCost(0);
-		for (int i = 1; i < nBoxes - 1; i++)
+		SpatialBin bins[SpatialSplitBins];
+		for (const auto &ref : refs)
 		{
-			float cost = getCost(i);
-			if (cost < minCost)
+			int first = binOf(ref.bound.pMin[dim]);
+			int last = binOf(ref.bound.pMax[dim]);
+			for (int i = first; i <= last; i++)
 			{
-				minCost = cost;
-				splitPoint = l + i;
+				AABB slab = ref.bound;
+				slab.pMin[dim] = std::max(slab.pMin[dim], planeOf(i));
+				slab.pMax[dim] = std::min(slab.pMax[dim], planeOf(i + 1));
+				bins[i].box.expand(first == last ? ref.bound : clippedBound(ref.index, slab));
 			}
+			bins[first].enter++;
+			bins[last].exit++;
+		}
+
+		AABB suffixBox[SpatialSplitBins];
+		int suffixExit[SpatialSplitBins];
+		suffixBox[SpatialSplitBins - 1] = bins[SpatialSplitBins - 1].box;
+		suffixExit[SpatialSplitBins - 1] = bins[SpatialSplitBins - 1].exit;
+		for (int i = SpatialSplitBins - 2; i >= 0; i--)
+		{
+			suffixBox[i] = AABB(bins[i].box, suffixBox[i + 1]);
+			suffixExit[i] = bins[i].exit + suffixExit[i + 1];
 		}
-		AABB lchCentBox = prefix[splitPoint - l].vertBox;
-		AABB rchCentBox = suffix[splitPoint - l + 1].vertBox;
 
-		stack.push({ offset + 2 * (splitPoint - l) + 2, rchCentBox, rchCentBox.maxExtent(), splitPoint + 1, r });
-		stack.push({ offset + 1, lchCentBox, lchCentBox.maxExtent(), l, splitPoint });
+		AABB prefixBox;
+		int prefixEnter = 0;
+		for (int i = 0; i < SpatialSplitBins - 1; i++)
+		{
+			prefixBox.expand(bins[i].box);
+			prefixEnter += bins[i].enter;
+			if (prefixEnter == 0 || suffixExit[i + 1] == 0)
+				continue;
+			float cost = prefixEnter * prefixBox.surfaceArea() + suffixExit[i + 1] * suffixBox[i + 1].surfaceArea();
+			if (cost < split.cost)
+			{
+				split.cost = cost;
+				split.dim = dim;
+				split.pos = planeOf(i + 1);
+			}
+		}
 	}
-	delete[] prefixes;
-	delete[] suffixes;
+	return split;
 }
 
-void BVH::buildHitTable()
+void BVH::performSpatialSplit(const std::vector<HittableInfo> &refs, const AABB &bound, const SpatialSplit &split, std::vector<HittableInfo> &lRefs, std::vector<HittableInfo> &rRefs,
+	int &numRefs, int maxRefs)
 {
-    bool (*cmpFuncs[6])(const glm::vec3 & a, const glm::vec3 & b) =
+	int dim = split.dim;
+	AABB lSide = bound, rSide = bound;
+	lSide.pMax[dim] = split.pos;
+	rSide.pMin[dim] = split.pos;
+
+	for (const auto &ref : refs)
 	{
-		[](const glm::vec3& a, const glm::vec3& b) { return a.x > b.x; },	// X+
-		[](const glm::vec3& a, const glm::vec3& b) { return a.x < b.x; },	// X-
-		[](const glm::vec3& a, const glm::vec3& b) { return a.y > b.y; },	// Y+
-		[](const glm::vec3& a, const glm::vec3& b) { return a.y < b.y; },	// Y-
-		[](const glm::vec3& a, const glm::vec3& b) { return a.z > b.z; },	// Z+
-		[](const glm::vec3& a, const glm::vec3& b) { return a.z < b.z; }	// Z-
+		if (ref.bound.pMax[dim] <= split.pos)
+			lRefs.push_back(ref);
+		else if (ref.bound.pMin[dim] >= split.pos)
+			rRefs.push_back(ref);
+		else if (numRefs >= maxRefs)
+			(ref.centroid[dim] < split.pos ? lRefs : rRefs).push_back(ref);
+		else
+		{
+			// Straddling reference, each side keeps the part of the primitive it contains
+			AABB lBound = clippedBound(ref.index, ref.bound.intersect(lSide));
+			AABB rBound = clippedBound(ref.index, ref.bound.intersect(rSide));
+			if (lBound.isEmpty())
+				rRefs.push_back(ref);
+			else if (rBound.isEmpty())
+				lRefs.push_back(ref);
+			else
+			{
+				lRefs.push_back({ lBound, lBound.centroid(), ref.index });
+				rRefs.push_back({ rBound, rBound.centroid(), ref.index });
+				numRefs++;
+			}
+		}
+	}
+}
+
+float BVH::computeSAHCost() const
+{
+	float rootArea = mTree[0].bound.surfaceArea();
+	if (rootArea <= 0.0f)
+		return 0.0f;
+	float cost = 0.0f;
+	std::stack<int> stack;
+	stack.push(0);
+	while (!stack.empty())
+	{
+		const auto &node = mTree[stack.top()];
+		int index = stack.top();
+		stack.pop();
+		float area = node.bound.surfaceArea() / rootArea;
+		if (node.count)
+		{
+			cost += node.count * area;
+			continue;
+		}
+		cost += SAHTraversalCost * area;
+		stack.push(node.offset);
+		stack.push(index + 1);
+	}
+	return cost;
+}
+
+void BVH::collapse()
+{
+	struct CollapseRec
+	{
+		int treeIndex;
+		int nodeIndex;
+		int depth;
+	};
+	auto children = [this](int index) -> std::pair<int, int>
+	{
+		return { index + 1, mTree[index].offset };
+	};
+	// Puts the child with smaller centroid along the axis separating the two first,
+	// which is what the traversal relies on to visit children in ray direction order
+	auto orderPair = [this](int &a, int &b) -> int
+	{
+		Vec3f diff = mTree[b].bound.centroid() - mTree[a].bound.centroid();
+		int axis = Math::maxExtent(glm::abs(diff));
+		if (diff[axis] < 0.0f)
+			std::swap(a, b);
+		return axis;
 	};
 
-	auto stack = new int[mTreeSize];
-	for (int i = 0; i < 6; i++)
+	// Lays out the primitives of a leaf at the next multiple of BVHWidth and fills its triangle
+	// block if all of them are triangles, returns the offset and the leafSize and shadowMask entries.
+	// Triangle leaves and the others are laid out apart so that only triangle leaves take a block,
+	// the others are moved after them once all leaves are known
+	std::vector<BVHPrimitive> triangleLeafPrimitives, otherLeafPrimitives;
+	auto addLeaf = [&](const BVHNode &leaf) -> std::tuple<int, uint8_t, uint8_t>
 	{
-		auto &table = mHitTables[i];
-		table.resize(mTreeSize);
-		size_t top = 0;
-		int index = 0;
-		stack[top++] = 0;
+		BVHTriangleBlock block = {};
+		bool triangles = true;
+		for (int i = 0; i < leaf.count && triangles; i++)
+		{
+			Vec3f verts[3];
+			const auto &ref = mPrimitives[leaf.offset + i];
+			triangles = mRawHittables[ref.hittable]->worldTriangle(ref.prim, verts);
+			for (int j = 0; j < 3 && triangles; j++)
+			{
+				block.v0[j][i] = verts[0][j];
+				block.v1[j][i] = verts[1][j];
+				block.v2[j][i] = verts[2][j];
+			}
+		}
+		if (triangles)
+			mTriangleBlocks.push_back(block);
 
-		while (top)
+		auto &leafPrimitives = triangles ? triangleLeafPrimitives : otherLeafPrimitives;
+		int offset = leafPrimitives.size();
+		leafPrimitives.insert(leafPrimitives.end(), mPrimitives.begin() + leaf.offset,
+			mPrimitives.begin() + leaf.offset + leaf.count);
+		leafPrimitives.resize(offset + BVHWidth, { 0, 0 });
+
+		uint8_t shadowMask = 0;
+		for (int i = 0; i < leaf.count; i++)
 		{
-			int nodeIndex = stack[--top];
-			auto nodeSize = mTree[nodeIndex].size;
-			table[index] = { index + nodeSize, nodeIndex };
-			index++;
+			if (mRawHittables[leafPrimitives[offset + i].hittable]->castsShadows())
+				shadowMask |= 1 << i;
+		}
+		return { offset, static_cast<uint8_t>(leaf.count | (triangles ? BVHTriangleLeaf : 0)), shadowMask };
+	};
 
-			if (nodeSize == 1)
-				continue;
+	mBound = mTree[0].bound;
+	mNodes.clear();
+	mNodes.emplace_back();
+	mTriangleBlocks.clear();
+	mDepth = 0;
 
-			int lSize = mTree[nodeIndex + 1].size;
-			int lch = nodeIndex + 1;
-			int rch = nodeIndex + 1 + lSize;
+	std::stack<CollapseRec> stack;
+	stack.push({ 0, 0, 1 });
+	while (!stack.empty())
+	{
+		auto [treeIndex, nodeIndex, depth] = stack.top();
+		stack.pop();
+		mDepth = std::max(mDepth, depth);
+
+		int slots[BVHWidth] = { -1, -1, -1, -1 };
+		BVHWideNode node;
+		std::fill(node.leafSize, node.leafSize + BVHWidth, 0);
+		std::fill(node.shadowMask, node.shadowMask + BVHWidth, 0);
+		std::fill(node.splitAxis, node.splitAxis + 3, 0);
+
+		if (mTree[treeIndex].count)
+			slots[0] = treeIndex;
+		else
+		{
+			auto [l, r] = children(treeIndex);
+			node.splitAxis[0] = orderPair(l, r);
+			int halves[2] = { l, r };
+			for (int i = 0; i < 2; i++)
+			{
+				int half = halves[i];
+				if (mTree[half].count)
+				{
+					slots[i * 2] = half;
+					continue;
+				}
+				auto [hl, hr] = children(half);
+				node.splitAxis[i + 1] = orderPair(hl, hr);
+				slots[i * 2] = hl;
+				slots[i * 2 + 1] = hr;
+			}
+		}
+
+		for (int i = 0; i < BVHWidth; i++)
+		{
+			if (slots[i] == -1)
+			{
+				for (int j = 0; j < 3; j++)
+				{
+					node.boundMin[j][i] = std::numeric_limits<float>::infinity();
+					node.boundMax[j][i] = -std::numeric_limits<float>::infinity();
+				}
+				node.child[i] = BVHLeafMark;
+				continue;
+			}
+			const auto &treeNode = mTree[slots[i]];
+			for (int j = 0; j < 3; j++)
+			{
+				node.boundMin[j][i] = treeNode.bound.pMin[j];
+				node.boundMax[j][i] = treeNode.bound.pMax[j];
+			}
+			if (treeNode.count)
+			{
+				auto [offset, leafSize, shadowMask] = addLeaf(treeNode);
+				node.child[i] = BVHLeafMark | offset;
+				node.leafSize[i] = leafSize;
+				node.shadowMask[i] = shadowMask;
+			}
+			else
+			{
+				node.child[i] = mNodes.size();
+				mNodes.emplace_back();
+				stack.push({ slots[i], node.child[i], depth + 1 });
+			}
+		}
+		mNodes[nodeIndex] = node;
+	}
+	// Each visited node leaves at most BVHWidth - 1 siblings on the traversal stack
+	mStackSize = mDepth * (BVHWidth - 1) + 1;
 
-			if (!cmpFuncs[i](mTree[lch].bound.centroid(), mTree[rch].bound.centroid()))
-				std::swap(lch, rch);
-			stack[top++] = rch;
-			stack[top++] = lch;
+	int otherLeavesOffset = triangleLeafPrimitives.size();
+	for (auto &node : mNodes)
+	{
+		for (int i = 0; i < BVHWidth; i++)
+		{
+			if ((node.child[i] & BVHLeafMark) && node.leafSize[i] && !(node.leafSize[i] & BVHTriangleLeaf))
+				node.child[i] += otherLeavesOffset;
 		}
 	}
-	delete[] stack;
+	mPrimitives = std::move(triangleLeafPrimitives);
+	mPrimitives.insert(mPrimitives.end(), otherLeafPrimitives.begin(), otherLeafPrimitives.end());
+
+	mTree.clear();
+	mTree.shrink_to_fit();
 }
\ No newline at end of file
@@ -0,0 +1,297 @@
+#include "Core/LightBVH.h"
+
+#include <algorithm>
+#include <array>
+#include <limits>
+
+constexpr int LightBVHNumBuckets = 12;
+// Below this depth subtrees are split at the median instead, so that the path to any light
+// fits the 64 bits of its bit trail
+constexpr int LightBVHMaxSAHDepth = 40;
+
+namespace
+{
+	float safeAcos(float x)
+	{
+		return glm::acos(glm::clamp(x, -1.0f, 1.0f));
+	}
+
+	float safeSqrt(float x)
+	{
+		return glm::sqrt(glm::max(x, 0.0f));
+	}
+
+	// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+	float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+	{
+		return (cosA > cosB) ? 1.0f : cosA * cosB + sinA * sinB;
+	}
+
+	float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+	{
+		return (cosA > cosB) ? 0.0f : sinA * cosB - cosA * sinB;
+	}
+
+	// Rotates v by angle around the unit vector axis
+	Vec3f rotate(const Vec3f &v, const Vec3f &axis, float angle)
+	{
+		float c = glm::cos(angle), s = glm::sin(angle);
+		return v * c + glm::cross(axis, v) * s + axis * glm::dot(axis, v) * (1.0f - c);
+	}
+}
+
+LightBounds::LightBounds(const LightBounds &a, const LightBounds &b)
+{
+	if (a.phi == 0.0f)
+	{
+		*this = b;
+		return;
+	}
+	if (b.phi == 0.0f)
+	{
+		*this = a;
+		return;
+	}
+	bound = AABB(a.bound, b.bound);
+	phi = a.phi + b.phi;
+	cosThetaE = glm::min(a.cosThetaE, b.cosThetaE);
+
+	// Smallest cone around both cones of normals
+	float thetaA = safeAcos(a.cosThetaO);
+	float thetaB = safeAcos(b.cosThetaO);
+	float thetaD = safeAcos(glm::dot(a.w, b.w));
+	if (glm::min(thetaD + thetaB, Math::Pi) <= thetaA)
+	{
+		w = a.w;
+		cosThetaO = a.cosThetaO;
+		return;
+	}
+	if (glm::min(thetaD + thetaA, Math::Pi) <= thetaB)
+	{
+		w = b.w;
+		cosThetaO = b.cosThetaO;
+		return;
+	}
+	float thetaO = (thetaA + thetaD + thetaB) * 0.5f;
+	Vec3f axis = glm::cross(a.w, b.w);
+	if (thetaO >= Math::Pi || Math::lengthSquare(axis) == 0.0f)
+	{
+		w = a.w;
+		cosThetaO = -1.0f;
+		return;
+	}
+	w = rotate(a.w, glm::normalize(axis), thetaO - thetaA);
+	cosThetaO = glm::cos(thetaO);
+}
+
+float LightBounds::importance(const Vec3f &p, const Vec3f &n) const
+{
+	// Distance to the center, clamped for points inside the bounds so that they don't blow up
+	Vec3f center = bound.centroid();
+	float radius = glm::distance(bound.pMin, bound.pMax) * 0.5f;
+	float dist2 = glm::max(Math::distSquare(p, center), radius);
+	Vec3f wi = glm::normalize(p - center);
+
+	// Angle from the axis to p, less the spread of the normals and of the bounds seen from p
+	float cosThetaW = glm::dot(w, wi);
+	float sinThetaW = safeSqrt(1.0f - cosThetaW * cosThetaW);
+	float sinThetaO = safeSqrt(1.0f - cosThetaO * cosThetaO);
+	float radius2 = radius * radius;
+	float distToCenter2 = Math::distSquare(p, center);
+	float cosThetaB = (distToCenter2 < radius2) ? -1.0f : safeSqrt(1.0f - radius2 / distToCenter2);
+	float sinThetaB = safeSqrt(1.0f - cosThetaB * cosThetaB);
+
+	float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+	float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+	float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+	if (cosThetaP <= cosThetaE)
+		return 0.0f;
+
+	float result = phi * cosThetaP / dist2;
+	if (n != Vec3f(0.0f))
+	{
+		float cosThetaI = Math::absDot(wi, n);
+		float sinThetaI = safeSqrt(1.0f - cosThetaI * cosThetaI);
+		result *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+	}
+	return glm::max(result, 0.0f);
+}
+
+float LightBounds::orientationMeasure() const
+{
+	float thetaO = safeAcos(cosThetaO);
+	float thetaE = safeAcos(cosThetaE);
+	float thetaW = glm::min(thetaO + thetaE, Math::Pi);
+	float sinThetaO = safeSqrt(1.0f - cosThetaO * cosThetaO);
+	return 2.0f * Math::Pi * (1.0f - cosThetaO) + Math::Pi * 0.5f *
+		(2.0f * thetaW * sinThetaO - glm::cos(thetaO - 2.0f * thetaW) - 2.0f * thetaO * sinThetaO + cosThetaO);
+}
+
+LightBVH::LightBVH(const std::vector<LightPtr> &lights)
+{
+	std::vector<std::pair<int, LightBounds>> bounded;
+	for (size_t i = 0; i < lights.size(); i++)
+	{
+		auto [axis, cosThetaO] = lights[i]->normalBounds();
+		// One sided emitters send light up to 90 degrees away from the normal
+		LightBounds bounds(lights[i]->bound(), axis, lights[i]->luminance(), cosThetaO, 0.0f);
+		if (bounds.phi > 0.0f)
+			bounded.push_back({ static_cast<int>(i), bounds });
+	}
+	if (bounded.empty())
+		return;
+
+	std::vector<uint64_t> trails(lights.size());
+	mNodes.reserve(bounded.size() * 2 - 1);
+	build(bounded, 0, bounded.size(), 0, 0, trails);
+	for (const auto &[index, bounds] : bounded)
+		mBitTrails[lights[index].get()] = trails[index];
+}
+
+int LightBVH::build(std::vector<std::pair<int, LightBounds>> &lights, int begin, int end,
+	uint64_t bitTrail, int depth, std::vector<uint64_t> &trails)
+{
+	int nodeIndex = mNodes.size();
+	if (end - begin == 1)
+	{
+		mNodes.push_back({ lights[begin].second, lights[begin].first, true });
+		trails[lights[begin].first] = bitTrail;
+		return nodeIndex;
+	}
+
+	AABB bound, centroidBound;
+	for (int i = begin; i < end; i++)
+	{
+		bound.expand(lights[i].second.bound);
+		centroidBound.expand(AABB(lights[i].second.bound.centroid()));
+	}
+	Vec3f extent = bound.pMax - bound.pMin;
+	float maxExtent = Math::maxComponent(extent);
+
+	// Bucket split of least cost, where a side costs its power times the measure of its directions
+	// times its surface area. Thin dimensions are penalized so that boxes stay roughly cubic
+	float minCost = std::numeric_limits<float>::infinity();
+	int minDim = -1, minBucket = -1;
+	for (int dim = 0; depth < LightBVHMaxSAHDepth && dim < 3; dim++)
+	{
+		float lo = Math::vecElement(centroidBound.pMin, dim);
+		float hi = Math::vecElement(centroidBound.pMax, dim);
+		if (hi == lo)
+			continue;
+		std::array<LightBounds, LightBVHNumBuckets> buckets;
+		for (int i = begin; i < end; i++)
+		{
+			float c = Math::vecElement(lights[i].second.bound.centroid(), dim);
+			int b = glm::min(static_cast<int>(LightBVHNumBuckets * (c - lo) / (hi - lo)), LightBVHNumBuckets - 1);
+			buckets[b] = LightBounds(buckets[b], lights[i].second);
+		}
+		auto cost = [&](const LightBounds &b)
+		{
+			return b.phi * b.orientationMeasure() * b.bound.surfaceArea();
+		};
+		float kr = maxExtent / Math::vecElement(extent, dim);
+		for (int split = 0; split < LightBVHNumBuckets - 1; split++)
+		{
+			LightBounds below, above;
+			for (int b = 0; b <= split; b++)
+				below = LightBounds(below, buckets[b]);
+			for (int b = split + 1; b < LightBVHNumBuckets; b++)
+				above = LightBounds(above, buckets[b]);
+			float c = kr * (cost(below) + cost(above));
+			if (below.phi > 0.0f && above.phi > 0.0f && c < minCost)
+			{
+				minCost = c;
+				minDim = dim;
+				minBucket = split;
+			}
+		}
+	}
+
+	int mid;
+	if (minDim == -1)
+	{
+		mid = (begin + end) / 2;
+		int dim = centroidBound.maxExtent();
+		std::nth_element(lights.begin() + begin, lights.begin() + mid, lights.begin() + end,
+			[dim](const auto &a, const auto &b)
+			{
+				return Math::vecElement(a.second.bound.centroid(), dim) < Math::vecElement(b.second.bound.centroid(), dim);
+			});
+	}
+	else
+	{
+		float lo = Math::vecElement(centroidBound.pMin, minDim);
+		float hi = Math::vecElement(centroidBound.pMax, minDim);
+		auto it = std::partition(lights.begin() + begin, lights.begin() + end,
+			[=](const auto &light)
+			{
+				float c = Math::vecElement(light.second.bound.centroid(), minDim);
+				int b = glm::min(static_cast<int>(LightBVHNumBuckets * (c - lo) / (hi - lo)), LightBVHNumBuckets - 1);
+				return b <= minBucket;
+			});
+		mid = it - lights.begin();
+	}
+
+	mNodes.push_back({ LightBounds(), 0, false });
+	int left = build(lights, begin, mid, bitTrail, depth + 1, trails);
+	int right = build(lights, mid, end, bitTrail | (1ull << depth), depth + 1, trails);
+	mNodes[nodeIndex].offset = right;
+	mNodes[nodeIndex].bounds = LightBounds(mNodes[left].bounds, mNodes[right].bounds);
+	return nodeIndex;
+}
+
+std::optional<std::pair<int, float>> LightBVH::sample(const Vec3f &p, const Vec3f &n, float u) const
+{
+	if (mNodes.empty())
+		return std::nullopt;
+	int nodeIndex = 0;
+	float pmf = 1.0f;
+	while (!mNodes[nodeIndex].leaf)
+	{
+		const auto &node = mNodes[nodeIndex];
+		float left = mNodes[nodeIndex + 1].bounds.importance(p, n);
+		float right = mNodes[node.offset].bounds.importance(p, n);
+		if (left == 0.0f && right == 0.0f)
+			return std::nullopt;
+		float pLeft = left / (left + right);
+		if (u < pLeft)
+		{
+			nodeIndex++;
+			u = glm::min(u / pLeft, Math::OneMinusEpsilon);
+			pmf *= pLeft;
+		}
+		else
+		{
+			nodeIndex = node.offset;
+			u = glm::min((u - pLeft) / (1.0f - pLeft), Math::OneMinusEpsilon);
+			pmf *= 1.0f - pLeft;
+		}
+	}
+	// A single light at the root is taken without its importance, unless it can't reach p
+	if (nodeIndex == 0 && mNodes[0].bounds.importance(p, n) == 0.0f)
+		return std::nullopt;
+	return std::make_pair(mNodes[nodeIndex].offset, pmf);
+}
+
+float LightBVH::pdf(const Vec3f &p, const Vec3f &n, const Light *light) const
+{
+	auto trail = mBitTrails.find(light);
+	if (trail == mBitTrails.end())
+		return 0.0f;
+	uint64_t bits = trail->second;
+	int nodeIndex = 0;
+	float pmf = 1.0f;
+	while (!mNodes[nodeIndex].leaf)
+	{
+		const auto &node = mNodes[nodeIndex];
+		float left = mNodes[nodeIndex + 1].bounds.importance(p, n);
+		float right = mNodes[node.offset].bounds.importance(p, n);
+		float taken = (bits & 1) ? right : left;
+		if (taken == 0.0f)
+			return 0.0f;
+		pmf *= taken / (left + right);
+		nodeIndex = (bits & 1) ? node.offset : nodeIndex + 1;
+		bits >>= 1;
+	}
+	return pmf;
+}
@@ -1,27 +1,39 @@
 #include "Core/Integrator.h"
 
+// Occlusion rays all leave the hit point, so they are traced as packets
 Spectrum traceOnePath(const AOIntegParam &param, ScenePtr scene, Ray ray, Vec3f n, SamplerPtr sampler)
 {
-    Spectrum ao(0.0f);
-    for (int i = 0; i < param.samplesOneTime; i++)
+    int occluded = 0;
+    for (int i = 0; i < param.samplesOneTime; i += BVHPacketSize)
     {
-        auto wi = Math::sampleHemisphereCosine(n, sampler->get2()).first;
-        auto occRay = Ray(ray.ori, wi).offset();
-        if (scene->quickIntersect(occRay, param.radius))
-            ao += Spectrum(1.0f);
+        int count = std::min(BVHPacketSize, param.samplesOneTime - i);
+        Ray occRays[BVHPacketSize];
+        float dists[BVHPacketSize];
+        for (int j = 0; j < count; j++)
+        {
+            auto wi = Math::sampleHemisphereCosine(n, sampler->get2()).first;
+            occRays[j] = Ray(ray.ori, wi).offset();
+            dists[j] = param.radius;
+        }
+        int mask = scene->occluded8(occRays, dists, count);
+        for (int j = 0; j < count; j++)
+            occluded += (mask >> j) & 1;
     }
-    return Spectrum(1.0f) - ao / (float)param.samplesOneTime;
+    return Spectrum(1.0f - static_cast<float>(occluded) / param.samplesOneTime);
 }
 
 Spectrum AOIntegrator::tracePixel(Ray ray, SamplerPtr sampler)
 {
-    auto [dist, obj] = mScene->closestHit(ray);
+    auto [dist, obj, prim, bary] = mScene->closestHit(ray);
     if (obj == nullptr)
         return Vec3f(1.0f);
 
     auto pos = ray.get(dist);
     ray.ori = pos;
-    return traceOnePath(mParam, mScene, ray, obj->normalGeom(pos), sampler);
+    Vec3f n = obj->type() == HittableType::Object ?
+        dynamic_cast<Object*>(obj.get())->surfaceInfo(pos, prim, bary).ng :
+        obj->normalGeom(pos);
+    return traceOnePath(mParam, mScene, ray, n, sampler);
 }
 
 void AOIntegrator2::renderOnePass()
@@ -33,27 +45,25 @@ void AOIntegrator2::renderOnePass()
     }
 
     auto &film = mScene->mCamera->film();
-    int pathsOnePass = mPathsOnePass ? mPathsOnePass : film.width * film.height / mThreads;
-    std::thread *threads = new std::thread[mThreads];
-    for (int i = 0; i < mThreads; i++)
+    int paths = passPaths(mPathsOnePass ? mPathsOnePass * mThreads : film.width() * film.height());
+    beginSplatting();
+    tracePaths(paths, [this](int first, int count)
     {
         auto threadSampler = mSampler->copy();
-        threadSampler->nextSamples(pathsOnePass * i);
-        threads[i] = std::thread(&AOIntegrator2::trace, this, pathsOnePass, threadSampler);
-    }
-    for (int i = 0; i < mThreads; i++)
-        threads[i].join();
-    delete[] threads;
+        threadSampler->nextSamples(first);
+        trace(count, threadSampler);
+    });
+    endSplatting();
 
-    mSampler->nextSamples(pathsOnePass * mThreads);
-    mParam.spp += static_cast<float>(pathsOnePass) * mThreads / (film.width * film.height);
+    mSampler->nextSamples(paths);
+    mParam.spp += static_cast<float>(paths) / (film.width() * film.height());
     mResultScale = 1.0f / mParam.spp;
     std::cout << "\r[AOIntegrator2 spp: " << std::fixed << std::setprecision(3) << mParam.spp << "]";
 }
 
 void AOIntegrator2::reset()
 {
-    mScene->mCamera->film().fill(Spectrum(0.0f));
+    mScene->mCamera->film().clear(pool());
     mParam.spp = 0;
 }
 
@@ -63,7 +73,7 @@ void AOIntegrator2::trace(int paths, SamplerPtr sampler)
     {
         Vec2f uv = sampler->get2();
         Ray ray = mScene->mCamera->generateRay(uv * Vec2f(2.0f, -2.0f) + Vec2f(-1.0f, 1.0f), sampler);
-        auto [dist, obj] = mScene->closestHit(ray);
+        auto [dist, obj, prim, bary] = mScene->closestHit(ray);
 
         Spectrum result(0.0f);
         if (obj == nullptr)
@@ -72,12 +82,11 @@ void AOIntegrator2::trace(int paths, SamplerPtr sampler)
         {
             Vec3f pos = ray.get(dist);
             auto object = dynamic_cast<Object *>(obj.get());
-            SurfaceInfo sInfo = object->surfaceInfo(pos);
+            SurfaceInfo sInfo = object->surfaceInfo(pos, prim, bary);
             ray.ori = pos;
             result = traceOnePath(mParam, mScene, ray, sInfo.ng, sampler);
         }
-        if (!Math::isBlack(result))
-            addToFilmLocked(uv, result);
+        addSampleToFilm(uv, result);
         sampler->nextSample();
     }
 }
\ No newline at end of file
@@ -62,7 +62,8 @@ struct Vertex {
         Camera *camera;
     };
 
-    Sampler* sampler;
+    // Of the path, for BSDFs that evaluate stochastically
+    Sampler* sampler = nullptr;
     VertexType type;
 };
 
@@ -95,6 +96,17 @@ struct Path {
     int length = 0;
 };
 
+// Environment vertices keep the direction toward the environment instead of a position
+Vec3f direction(const Vertex &fr, const Vertex &to) {
+    if (to.type == VertexType::EnvLight) {
+        return to.dir;
+    }
+    if (fr.type == VertexType::EnvLight) {
+        return -fr.dir;
+    }
+    return glm::normalize(to.pos - fr.pos);
+}
+
 float g(const Vertex &a, const Vertex &b, ScenePtr scene) {
     return scene->g(a.pos, b.pos, a.getNormal(), b.getNormal());
 }
@@ -114,73 +126,92 @@ float convertPdf(const Vertex &fr, const Vertex &to, float pdfSolidAngle) {
 }
 
 Spectrum bsdf(const Vertex &fr, const Vertex &to, TransportMode mode) {
-    Vec3f wi = glm::normalize(to.pos - fr.pos);
-    return fr.f(fr.dir, wi, mode);
-}
-
-// fr must be a source vertex, either radiance or importance
-float twoPointPdf(const Vertex &fr, const Vertex &to) {
-    Vec3f wi = glm::normalize(to.pos - fr.pos);
-    if (fr.type == VertexType::Camera) {
-        return convertPdf(fr, to, fr.camera->pdfIe(Ray(fr.pos, wi)).pdfDir);
-    }
-    else if (fr.type == VertexType::AreaLight) {
-        return convertPdf(fr, to, fr.areaLight->pdfLe(Ray(fr.pos, wi)).pdfDir);
-    }
-    // TODO: handle environment light
-    return 0;
-}
-
-// fr must be a surface vertex
-float threePointPdf(const Vertex &prev, const Vertex &fr, const Vertex &to, TransportMode mode) {
-    Vec3f wi = glm::normalize(to.pos - fr.pos);
-    Vec3f wo = glm::normalize(prev.pos - fr.pos);
-    return convertPdf(fr, to, fr.pdf(wo, wi, mode));
+    return fr.f(fr.dir, direction(fr, to), mode);
 }
 
+// Density of a light subpath starting at light, per solid angle for the environment
 float pdfLightOrigin(const Vertex &light, const Vertex &ref, ScenePtr scene) {
     if (light.type == VertexType::EnvLight) {
-        // TODO: environment light
-        return 0.0f;
+        return light.envLight->pdfLi(light.dir) * scene->pdfSampleEnv();
     }
     Ray ray(light.pos, glm::normalize(light.pos - ref.pos));
     return light.areaLight->pdfLe(ray).pdfPos * scene->pdfSampleLight(light.areaLight);
 }
 
+// Density of light emitting toward ref, per unit area at ref
 float pdfLight(const Vertex &light, const Vertex &ref, ScenePtr scene) {
     if (light.type == VertexType::EnvLight) {
-        // TODO: env light
-        return 0.0f;
+        // Parallel rays through the disk of Scene::sampleLeEnv
+        return scene->pdfLeEnv(-light.dir).pdfPos * Math::satDot(ref.getNormal(), light.dir);
     }
-    return light.areaLight->pdfLi(ref.pos, light.pos) * scene->pdfSampleLight(light.areaLight);
+    Ray ray(light.pos, glm::normalize(ref.pos - light.pos));
+    return convertPdf(light, ref, light.areaLight->pdfLe(ray).pdfDir);
+}
+
+// fr must be a source vertex, either radiance or importance
+float twoPointPdf(const Vertex &fr, const Vertex &to, ScenePtr scene) {
+    if (fr.type == VertexType::Camera) {
+        Vec3f wi = glm::normalize(to.pos - fr.pos);
+        return convertPdf(fr, to, fr.camera->pdfIe(Ray(fr.pos, wi)).pdfDir);
+    }
+    return pdfLight(fr, to, scene);
+}
+
+// fr must be a surface vertex
+float threePointPdf(const Vertex &prev, const Vertex &fr, const Vertex &to, TransportMode mode) {
+    Vec3f wi = direction(fr, to);
+    Vec3f wo = direction(fr, prev);
+    return convertPdf(fr, to, fr.pdf(wo, wi, mode));
 }
 
 void generateLightPath(const BDPTIntegParam &param, ScenePtr scene, Sampler* sampler, Path &path) {
     auto [lightSource, pdfSource] = scene->sampleLightAndEnv(sampler->get2(), sampler->get1());
-    // TODO: handle environment light
-    if (lightSource.index() != 0) {
-        return;
-    }
-    auto light = std::get<0>(lightSource);
 
-    auto leSamp = light->sampleLe(sampler->get<4>());
-    Vec3f wo = -leSamp.ray.dir;
+    Vertex vertex;
+    Ray ray;
+    Spectrum throughput;
+    float pdfSolidAngle = 0.0f;
 
-    auto vertex = Path::createAreaLight(leSamp.ray.ori, light.get());
-    vertex.throughput = leSamp.Le / (pdfSource * leSamp.pdfPos);
-    vertex.pdfCamward = pdfSource * leSamp.pdfPos;
-    vertex.isDelta = false; // light->isDelta();
-    path.addVertex(vertex);
+    if (lightSource.index() == 0) {
+        auto light = std::get<0>(lightSource);
+        auto leSamp = light->sampleLe(sampler->get<4>());
 
-    Ray ray = leSamp.ray.offset();
-    float pdfSolidAngle = leSamp.pdfDir;
-    Spectrum throughput = path[0].throughput * Math::satDot(light->normalGeom(leSamp.ray.ori), -wo) / pdfSolidAngle;
+        vertex = Path::createAreaLight(leSamp.ray.ori, light.get());
+        vertex.throughput = leSamp.Le / (pdfSource * leSamp.pdfPos);
+        vertex.pdfCamward = pdfSource * leSamp.pdfPos;
+        vertex.isDelta = false; // light->isDelta();
+        path.addVertex(vertex);
+
+        ray = leSamp.ray.offset();
+        throughput = vertex.throughput * Math::satDot(light->normalGeom(leSamp.ray.ori), ray.dir) / leSamp.pdfDir;
+        pdfSolidAngle = leSamp.pdfDir;
+    }
+    else {
+        auto env = std::get<1>(lightSource);
+        auto [emiRay, Le, pdf] = scene->sampleLeEnv(sampler->get<6>());
+        if (pdf == 0.0f) {
+            return;
+        }
+        auto [pdfPos, pdfDir] = scene->pdfLeEnv(emiRay.dir);
+
+        // The vertex stands for the direction the light comes from, so its density is the one
+        // of the direction and the origin on the disk goes to the next vertex
+        vertex = Path::createEnvLight(-emiRay.dir, env.get());
+        vertex.throughput = Le / (pdfSource * pdfDir);
+        vertex.pdfCamward = pdfSource * pdfDir;
+        vertex.isDelta = false;
+        path.addVertex(vertex);
+
+        ray = emiRay;
+        throughput = vertex.throughput / pdfPos;
+    }
+    Vec3f wo = -ray.dir;
 
     for (int bounce = 1; bounce < param.maxConnectDepth; bounce++) {
         if (Math::isBlack(throughput)) {
             break;
         }
-        auto [hitDist, hit] = scene->closestHit(ray);
+        auto [hitDist, hit, prim, bary] = scene->closestHit(ray);
 
         if (!hit) {
             break;
@@ -191,7 +222,7 @@ void generateLightPath(const BDPTIntegParam &param, ScenePtr scene, Sampler* sam
         auto object = dynamic_cast<Object*>(hit.get());
 
         Vec3f pos = ray.get(hitDist);
-        auto surf = object->surfaceInfo(pos);
+        auto surf = object->surfaceInfo(pos, prim, bary);
 
         if (glm::dot(surf.ns, wo) < 0) {
             if (!surf.bsdf->type().hasType(BSDFType::Transmission)) {
@@ -201,11 +232,19 @@ void generateLightPath(const BDPTIntegParam &param, ScenePtr scene, Sampler* sam
         bool deltaBsdf = surf.bsdf->type().isDelta();
 
         vertex = Path::createSurface(pos, surf, wo);
+        vertex.sampler = sampler;
         vertex.throughput = throughput;
-        vertex.pdfCamward = convertPdf(path[bounce - 1], vertex, pdfSolidAngle);
+        // The first vertex lit by the environment takes the density of its origin on the disk
+        vertex.pdfCamward = (bounce == 1 && path[0].type == VertexType::EnvLight) ?
+            pdfLight(path[0], vertex, scene) : convertPdf(path[bounce - 1], vertex, pdfSolidAngle);
         vertex.isDelta = deltaBsdf;
         path.addVertex(vertex);
 
+        if (bounce > 1) {
+            path[bounce - 2].pdfLitward = threePointPdf(path[bounce], path[bounce - 1], path[bounce - 2],
+                TransportMode::Radiance);
+        }
+
         auto sample = surf.sample(surf.ns, wo, sampler, TransportMode::Importance);
 
         if (!sample) {
@@ -227,10 +266,6 @@ void generateLightPath(const BDPTIntegParam &param, ScenePtr scene, Sampler* sam
         if (bounce >= param.maxLightDepth && !param.rrLightPath) {
             break;
         }
-        if (bounce > 1) {
-            path[bounce - 2].pdfLitward = threePointPdf(path[bounce], path[bounce - 1], path[bounce - 2],
-                TransportMode::Radiance);
-        }
 
         float cosWi = type.isDelta() ? 1.0f : Math::satDot(surf.ng, wi) * glm::abs(glm::dot(surf.ns, wo)
             / glm::dot(surf.ng, wo));
@@ -258,9 +293,18 @@ void generateCameraPath(const BDPTIntegParam &param, ScenePtr scene, Ray ray, Sa
         if (Math::isBlack(throughput)) {
             break;
         }
-        auto [hitDist, hit] = scene->closestHit(ray);
+        auto [hitDist, hit, prim, bary] = scene->closestHit(ray);
         if (!hit) {
-            // TODO: create environment light vertex
+            vertex = Path::createEnvLight(ray.dir, scene->mEnv.get());
+            vertex.throughput = throughput;
+            vertex.pdfLitward = convertPdf(path[bounce - 1], vertex, pdfSolidAngle);
+            vertex.isDelta = false;
+            path.addVertex(vertex);
+
+            if (bounce > 1) {
+                path[bounce - 2].pdfCamward = threePointPdf(path[bounce], path[bounce - 1], path[bounce - 2],
+                    TransportMode::Importance);
+            }
             break;
         }
 
@@ -281,7 +325,7 @@ void generateCameraPath(const BDPTIntegParam &param, ScenePtr scene, Ray ray, Sa
         }
 
         auto object = dynamic_cast<Object*>(hit.get());
-        auto surf = object->surfaceInfo(pos);
+        auto surf = object->surfaceInfo(pos, prim, bary);
         if (glm::dot(surf.ns, wo) < 0) {
             auto bxdf = surf.bsdf->type();
             if (!surf.bsdf->type().hasType(BSDFType::Transmission)) {
@@ -291,11 +335,17 @@ void generateCameraPath(const BDPTIntegParam &param, ScenePtr scene, Ray ray, Sa
         bool deltaBsdf = surf.bsdf->type().isDelta();
 
         vertex = Path::createSurface(pos, surf, wo);
+        vertex.sampler = sampler;
         vertex.throughput = throughput;
         vertex.pdfLitward = convertPdf(path[bounce - 1], vertex, pdfSolidAngle);
         vertex.isDelta = deltaBsdf;
         path.addVertex(vertex);
 
+        if (bounce > 1) {
+            path[bounce - 2].pdfCamward = threePointPdf(path[bounce], path[bounce - 1], path[bounce - 2],
+                TransportMode::Importance);
+        }
+
         auto sample = surf.sample(surf.ns, wo, sampler, TransportMode::Radiance);
         if (!sample) {
             break;
@@ -317,10 +367,6 @@ void generateCameraPath(const BDPTIntegParam &param, ScenePtr scene, Ray ray, Sa
         if (bounce >= param.maxCameraDepth && !param.rrCameraPath) {
             break;
         }
-        if (bounce > 1) {
-            path[bounce - 2].pdfCamward = threePointPdf(path[bounce], path[bounce - 1], path[bounce - 2],
-                TransportMode::Importance);
-        }
 
         throughput *= bsdf * cosWi / bsdfPdf;
         pdfSolidAngle = bsdfPdf;
@@ -368,26 +414,19 @@ float MISWeight(Path &lightPath, Path &cameraPath, int s, int t, ScenePtr scene)
     TempAssignment<float> tmpPdfCamwardVt, tmpPdfCamwardVtPred;
     
     if (s == 0) {
-        if (vt->type == VertexType::AreaLight) {
-            auto [pdfPos, pdfDir] = vt->areaLight->pdfLe({ vt->pos, glm::normalize(vtPred->pos - vt->pos) });
-            tmpPdfCamwardVt = { vt->pdfCamward, pdfPos * scene->pdfSampleLight(vt->areaLight) };
-            tmpPdfCamwardVtPred = { vtPred->pdfCamward, convertPdf(*vt, *vtPred, pdfDir) };
-        }
-        else if (vt->type == VertexType::EnvLight) {
-            // TODO: env light
-            return 0.0f;
-        }
-        else {
+        if (vt->type != VertexType::AreaLight && vt->type != VertexType::EnvLight) {
             return 0.0f;
         }
+        tmpPdfCamwardVt = { vt->pdfCamward, pdfLightOrigin(*vt, *vtPred, scene) };
+        tmpPdfCamwardVtPred = { vtPred->pdfCamward, pdfLight(*vt, *vtPred, scene) };
     }
     else {
         tmpDeltaVs = { vs->isDelta, false };
         tmpDeltaVt = { vt->isDelta, false };
         tmpPdfLitwardVs = { vs->pdfLitward,
-            vtPred ? threePointPdf(*vtPred, *vt, *vs, TransportMode::Radiance) : twoPointPdf(*vt, *vs) };
+            vtPred ? threePointPdf(*vtPred, *vt, *vs, TransportMode::Radiance) : twoPointPdf(*vt, *vs, scene) };
         tmpPdfCamwardVt = { vt->pdfCamward,
-            vsPred ? threePointPdf(*vsPred, *vs, *vt, TransportMode::Importance) : twoPointPdf(*vs, *vt) };
+            vsPred ? threePointPdf(*vsPred, *vs, *vt, TransportMode::Importance) : twoPointPdf(*vs, *vt, scene) };
 
         if (vsPred) {
             tmpPdfLitwardVsPred = { vsPred->pdfLitward,
@@ -404,9 +443,10 @@ float MISWeight(Path &lightPath, Path &cameraPath, int s, int t, ScenePtr scene)
 
     float sum = 0.0f;
     float r = 1.0f;
-    for (int i = s - 1; i > 0; i--) {
+    // Down to the light vertex, which the camera path hits in the strategy without light vertices
+    for (int i = s - 1; i >= 0; i--) {
         r *= remapPdf(lightPath[i].pdfLitward) / remapPdf(lightPath[i].pdfCamward);
-        if (!lightPath[i].isDelta && !lightPath[i - 1].isDelta) {
+        if (!lightPath[i].isDelta && (i == 0 || !lightPath[i - 1].isDelta)) {
             sum += r;
         }
     }
@@ -435,7 +475,7 @@ Spectrum connectPaths(Path &lightPath, Path &cameraPath, int s, int t,
             result = vt.areaLight->Le(emiRay) * vt.throughput;
         }
         else if (vt.type == VertexType::EnvLight) {
-            // TODO: env light
+            result = vt.envLight->radiance(vt.dir) * vt.throughput;
         }
         else {
             return Spectrum(0.0f);
@@ -457,31 +497,60 @@ Spectrum connectPaths(Path &lightPath, Path &cameraPath, int s, int t,
             auto [lightSource, pdfSource] = scene->sampleLightAndEnv(sampler->get2(), sampler->get1());
 
             if (lightSource.index() == 1) {
-                // TODO: environment light
-                return Spectrum(0.0f);
-            }
-            auto light = std::get<0>(lightSource);
-            auto LiSample = light->sampleLi(vt.pos, sampler->get2());
+                auto env = std::get<1>(lightSource);
+                auto [wi, weight, pdfLi] = scene->sampleLiEnv(vt.pos, sampler->get2(), sampler->get2());
 
-            if (!LiSample) {
-                return Spectrum(0.0f);
+                if (pdfLi == 0) {
+                    return Spectrum(0.0f);
+                }
+                endPoint = Path::createEnvLight(wi, env.get());
+                endPoint.throughput = weight / pdfSource;
+                endPoint.pdfCamward = pdfLi * pdfSource;
+                endPoint.isDelta = false;
+
+                result = endPoint.throughput * bsdf(vt, endPoint, TransportMode::Radiance) * vt.throughput *
+                    Math::satDot(vt.normShad, wi);
             }
-            auto [wi, Li, dist, pdfLi] = LiSample.value();
+            else {
+                auto light = std::get<0>(lightSource);
+                auto LiSample = light->sampleLi(vt.pos, sampler->get2());
+
+                if (!LiSample) {
+                    return Spectrum(0.0f);
+                }
+                auto [wi, Li, dist, pdfLi] = LiSample.value();
 
-            if (pdfLi == 0) {
+                if (pdfLi == 0) {
+                    return Spectrum(0.0f);
+                }
+                Vec3f pLit = Ray(vt.pos, wi).get(dist);
+
+                if (!scene->visible(vt.pos, pLit)) {
+                    return Spectrum(0.0f);
+                }
+
+                endPoint = Path::createAreaLight(pLit, light.get());
+                endPoint.throughput = Li / (pdfLi * pdfSource);
+                endPoint.pdfCamward = light->pdfLe({ pLit, -wi }).pdfPos * pdfSource;
+                endPoint.isDelta = false; // light->isDelta();
+
+                result = endPoint.throughput * bsdf(vt, endPoint, TransportMode::Radiance) * vt.throughput *
+                    Math::satDot(vt.normShad, wi);
+            }
+        }
+        else if (vs.type == VertexType::EnvLight) {
+            // The direction of the light subpath is an independent sample of the environment, so
+            // it connects to any vertex with the cosine at that vertex in place of the geometry term
+            if (vt.isDelta) {
                 return Spectrum(0.0f);
             }
-            Vec3f pLit = Ray(vt.pos, wi).get(dist);
-
-            if (!scene->visible(vt.pos, pLit)) {
+            Vec3f wi = vs.dir;
+            if (scene->quickIntersect(Ray(vt.pos, wi).offset(), 1e30f)) {
                 return Spectrum(0.0f);
             }
+            endPoint = vs;
+            endPoint.throughput = vs.envLight->radiance(wi) / vs.pdfCamward;
 
-            endPoint = Path::createAreaLight(pLit, light.get());
-            endPoint.throughput = Li / (pdfLi * pdfSource);
-            endPoint.pdfCamward = light->pdfLe({ pLit, -wi }).pdfPos * pdfSource;
-            endPoint.isDelta = false; // light->isDelta();
-            
             result = endPoint.throughput * bsdf(vt, endPoint, TransportMode::Radiance) * vt.throughput *
                 Math::satDot(vt.normShad, wi);
         }
@@ -600,7 +669,7 @@ Spectrum BDPTIntegrator::eval(Path &lightPath, Path &cameraPath, SamplerPtr samp
                 continue;
             }
             if (uvRaster) {
-                addToFilmLocked(*uvRaster, est);
+                splatToFilm(*uvRaster, est);
             }
             else {
                 result += est;
@@ -611,9 +680,11 @@ Spectrum BDPTIntegrator::eval(Path &lightPath, Path &cameraPath, SamplerPtr samp
 }
 
 Spectrum BDPTIntegrator::tracePixel(Ray ray, SamplerPtr sampler) {
+    // Both subpaths take their dimensions from the sample of the pixel, the camera path first so
+    // that its bounces get the same dimensions whatever the length of the light path
     Path lightPath, cameraPath;
-    generateLightPath(mParam, mScene, mLightSampler.get(), lightPath);
     generateCameraPath(mParam, mScene, ray, sampler.get(), cameraPath);
+    generateLightPath(mParam, mScene, sampler.get(), lightPath);
     return eval(lightPath, cameraPath, sampler);
 }
 
@@ -631,34 +702,32 @@ void BDPTIntegrator2::renderOnePass() {
         return;
     }
     auto &film = mScene->mCamera->film();
-    int pathsOnePass = mPathsOnePass ? mPathsOnePass : film.width * film.height / mThreads;
+    int paths = passPaths(mPathsOnePass ? mPathsOnePass * mThreads : film.width() * film.height());
 
     Timer timer;
 
-    std::vector<std::thread> threads;
-    for (int i = 0; i < mThreads; i++) {
+    beginSplatting();
+    tracePaths(paths, [this](int first, int count) {
         auto cameraSampler = mSampler->copy();
         auto lightSampler = mLightSampler->copy();
-        cameraSampler->nextSamples(pathsOnePass * i);
-        lightSampler->nextSamples(pathsOnePass * i);
-        threads.emplace_back(std::thread(&BDPTIntegrator2::trace, this, pathsOnePass, lightSampler, cameraSampler));
-    }
-    for (auto& thread : threads) {
-        thread.join();
-    }
+        cameraSampler->nextSamples(first);
+        lightSampler->nextSamples(first);
+        trace(count, lightSampler, cameraSampler);
+    });
+    endSplatting();
 
-    accumTimeBDPT += timer.get() / (pathsOnePass * mThreads) * 1e9;
+    accumTimeBDPT += timer.get() / paths * 1e9;
 
-    mSampler->nextSamples(pathsOnePass * mThreads);
-    mLightSampler->nextSamples(pathsOnePass * mThreads);
-    mParam.spp += static_cast<float>(pathsOnePass) * mThreads / (film.width * film.height);
+    mSampler->nextSamples(paths);
+    mLightSampler->nextSamples(paths);
+    mParam.spp += static_cast<float>(paths) / (film.width() * film.height());
     mResultScale = 1.0f / mParam.spp;
     std::cout << "\r[BDPTIntegrator2 spp: " << std::fixed << std::setprecision(3) << mParam.spp << "]";
     std::cout << accumTimeBDPT / (++sppBDPT);
 }
 
 void BDPTIntegrator2::reset() {
-    mScene->mCamera->film().fill(Spectrum(0.0f));
+    mScene->mCamera->film().clear(pool());
     mParam.spp = 0;
 }
 
@@ -685,10 +754,10 @@ void BDPTIntegrator2::traceOnePath(SamplerPtr lightSampler, SamplerPtr cameraSam
             std::optional<Vec2f> uvRaster;
             Spectrum est = connectPaths(lightPath, cameraPath, s, t, mScene, lightSampler, mParam.resampleEndPoint, uvRaster);
             if (uvRaster) {
-                addToFilmLocked(*uvRaster, est);
+                splatToFilm(*uvRaster, est);
             }
             else {
-                addToFilmLocked(uv, est);
+                splatToFilm(uv, est);
             }
         }
         return;
@@ -712,7 +781,7 @@ void BDPTIntegrator2::traceOnePath(SamplerPtr lightSampler, SamplerPtr cameraSam
                 continue;
             }
             if (uvRaster) {
-                addToFilmLocked(*uvRaster, est);
+                splatToFilm(*uvRaster, est);
             }
             else {
                 result += est;
@@ -734,7 +803,7 @@ void BDPTIntegrator2::traceOnePath(SamplerPtr lightSampler, SamplerPtr cameraSam
                     continue;
                 }
                 if (uvRaster) {
-                    addToFilmLocked(*uvRaster, est);
+                    splatToFilm(*uvRaster, est);
                 }
                 else {
                     result += est;
@@ -742,7 +811,5 @@ void BDPTIntegrator2::traceOnePath(SamplerPtr lightSampler, SamplerPtr cameraSam
             }
         }
     }
-    if (!Math::isBlack(result)) {
-        addToFilmLocked(uv, result);
-    }
+    addSampleToFilm(uv, result);
 }
\ No newline at end of file
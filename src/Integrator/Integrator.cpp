@@ -1,21 +1,170 @@
 #include "Core/Integrator.h"
 
 #include <array>
+#include <limits>
 
 void Integrator::setModified() {
     mModified = true;
     mFinished = false;
 }
 
-void Integrator::addToFilmLocked(const Vec2f &uv, const Spectrum &val){
+ThreadPool &Integrator::pool() {
+    if (mPool == nullptr) {
+        mPool = std::make_shared<ThreadPool>(mThreads - 1);
+    }
+    return *mPool;
+}
+
+// Unique over all integrators, so that a thread can tell a new pass from the one it last splatted in
+static std::atomic<uint64_t> SplatPassCounter = 0;
+
+Spectrum Integrator::estimate(int x, int y) {
+    const auto &pixel = mScene->mCamera->film()(x, y);
+    return mPerPixelMean ? pixel.mean() : pixel.sum * mResultScale;
+}
+
+float Integrator::imageError() {
+    if (splatsLightPaths()) {
+        return std::numeric_limits<float>::infinity();
+    }
+    auto errors = tileErrors();
+    float sum = 0.0f;
+    for (float error : errors) {
+        sum += error;
+    }
+    return errors.empty() ? 0.0f : sum / errors.size();
+}
+
+std::vector<float> Integrator::tileErrors() {
+    auto &film = mScene->mCamera->film();
+    std::vector<float> errors(film.numTiles());
+    parallelFor(pool(), film.numTiles(), 16, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            errors[i] = film.tileError(i);
+        }
+    });
+    return errors;
+}
+
+void Integrator::beginSplatting() {
+    auto &film = mScene->mCamera->film();
+    int pixels = film.numStoredPixels();
+    if (mSplatMode == FilmSplatMode::Locked && mFilmLockCount != pixels) {
+        mFilmLocks.reset(new std::mutex[pixels]);
+        mFilmLockCount = pixels;
+    }
+    else if (mSplatMode == FilmSplatMode::PerThread) {
+        // Every worker of the pool and the thread waiting for the pass
+        mSplatBuffers.resize(pool().numThreads() + 1);
+        for (auto &buffer : mSplatBuffers) {
+            if (buffer != nullptr && buffer->numStoredPixels() != pixels) {
+                buffer.reset();
+            }
+        }
+        mSplatSlots = 0;
+        mSplatPass = ++SplatPassCounter;
+    }
+    else if (mSplatMode == FilmSplatMode::Atomic && mAtomicCount != pixels) {
+        mAtomicPixels.reset(new AtomicPixel[pixels]);
+        mAtomicCount = pixels;
+    }
+    else if (mSplatMode == FilmSplatMode::FixedPoint && mFixedPointCount != pixels) {
+        mFixedPointPixels.reset(new FixedPointPixel[pixels]);
+        mFixedPointCount = pixels;
+    }
+}
+
+void Integrator::endSplatting() {
+    auto &film = mScene->mCamera->film();
+    if (mSplatMode == FilmSplatMode::Atomic) {
+        parallelFor(pool(), film.numTiles(), 4, [&](int begin, int end) {
+            for (int i = begin * FilmTilePixels; i < end * FilmTilePixels; i++) {
+                mAtomicPixels[i].moveTo(film[i]);
+            }
+        });
+        return;
+    }
+    if (mSplatMode == FilmSplatMode::FixedPoint) {
+        parallelFor(pool(), film.numTiles(), 4, [&](int begin, int end) {
+            for (int i = begin * FilmTilePixels; i < end * FilmTilePixels; i++) {
+                mFixedPointPixels[i].moveTo(film[i]);
+            }
+        });
+        return;
+    }
+    if (mSplatMode != FilmSplatMode::PerThread) {
+        return;
+    }
+    int slots = std::min<int>(mSplatSlots, mSplatBuffers.size());
+    for (int i = 0; i < slots; i++) {
+        film.merge(*mSplatBuffers[i], pool());
+    }
+}
+
+int Integrator::splatSlot() {
+    thread_local uint64_t pass = 0;
+    thread_local int slot = 0;
+    if (pass != mSplatPass) {
+        pass = mSplatPass;
+        slot = mSplatSlots++;
+        if (slot < static_cast<int>(mSplatBuffers.size()) && mSplatBuffers[slot] == nullptr) {
+            // Cleared by the thread that writes it
+            auto &film = mScene->mCamera->film();
+            mSplatBuffers[slot] = std::make_unique<Film>();
+            mSplatBuffers[slot]->init(film.width(), film.height());
+            mSplatBuffers[slot]->clear();
+        }
+    }
+    return slot;
+}
+
+template<bool IsSample>
+void Integrator::addToFilm(const Vec2f &uv, const Spectrum &val) {
     if (!Camera::inFilmBound(uv)) {
         return;
     }
     auto &film = mScene->mCamera->film();
-    auto &filmLocker = mScene->mCamera->filmLocker()(uv.x, uv.y);
-    filmLocker.lock();
-    film(uv.x, uv.y) += val;
-    filmLocker.unlock();
+    int index = film.index(uv);
+
+    if (mSplatMode == FilmSplatMode::PerThread) {
+        // Only the workers of the pool and the thread waiting for them have a slot
+        int slot = splatSlot();
+        Error::check(slot < static_cast<int>(mSplatBuffers.size()), "Splat from a thread outside the pool");
+        auto &pixel = (*mSplatBuffers[slot])[index];
+        IsSample ? pixel.addSample(val) : pixel.splat(val);
+        return;
+    }
+    else if (mSplatMode == FilmSplatMode::Locked) {
+        std::lock_guard<std::mutex> lock(mFilmLocks[index]);
+        IsSample ? film[index].addSample(val) : film[index].splat(val);
+        return;
+    }
+    else if (mSplatMode == FilmSplatMode::FixedPoint) {
+        auto &pixel = mFixedPointPixels[index];
+        IsSample ? pixel.atomicAddSample(val) : pixel.atomicSplat(val);
+        return;
+    }
+    auto &pixel = mAtomicPixels[index];
+    IsSample ? pixel.atomicAddSample(val) : pixel.atomicSplat(val);
+}
+
+void Integrator::addSampleToPixel(int x, int y, const Spectrum &val) {
+    auto &film = mScene->mCamera->film();
+    if (mSplatMode == FilmSplatMode::Locked) {
+        int index = film.index(x, y);
+        std::lock_guard<std::mutex> lock(mFilmLocks[index]);
+        film[index].addSample(val);
+        return;
+    }
+    film(x, y).addSample(val);
+}
+
+void Integrator::splatToFilm(const Vec2f &uv, const Spectrum &val) {
+    addToFilm<false>(uv, val);
+}
+
+void Integrator::addSampleToFilm(const Vec2f &uv, const Spectrum &val) {
+    addToFilm<true>(uv, val);
 }
 
 void Integrator::addToDebugBuffer(int index, const Vec2f &uv, const Spectrum &val) {
@@ -38,53 +187,82 @@ void Integrator::addToDebugBuffer(int index, const Vec2i &pixel, const Spectrum
 }
 
 PixelIndependentIntegrator::PixelIndependentIntegrator(ScenePtr scene, int maxSpp, IntegratorType type) :
-    mMaxSpp(maxSpp), mLimitSpp(maxSpp != 0), mPixelPos(0, 0), Integrator(scene, type) {
-    auto film = scene->mCamera->film();
-    mWidth = film.width;
-    mHeight = film.height;
+    mMaxSpp(maxSpp), mLimitSpp(maxSpp != 0), Integrator(scene, type) {
+    auto &film = scene->mCamera->film();
+    mWidth = film.width();
+    mHeight = film.height();
 }
 
 void PixelIndependentIntegrator::renderOnePass() {
+    if (mTiles.numWorkers() != mThreads) {
+        mTiles.init(mWidth, mHeight, mThreads, FilmTileSize);
+    }
     if (mModified) {
-        mScene->mCamera->film().fill(Vec3f(0.0f));
+        mScene->mCamera->film().clear(pool());
         mCurspp = 0;
         mModified = false;
+        mTiles.selectAll();
     }
     if (mLimitSpp && mCurspp >= mMaxSpp) {
         mFinished = true;
         return;
     }
-    
-    std::vector<std::thread> threads;
-    for (int i = 0; i < mThreads; i++) {
-        int start = (mWidth / mThreads) * i;
-        int end = std::min(mWidth, (mWidth / mThreads) * (i + 1));
-        if (i == mThreads - 1) {
-            end = mWidth;
+
+    // Once every pixel has minSpp samples, passes only go over the tiles that are still noisy
+    mPerPixelMean = mAdaptive.targetError > 0.0f;
+    int numTiles = mScene->mCamera->film().numTiles();
+    int activeTiles = numTiles;
+    if (mPerPixelMean && mCurspp >= mAdaptive.minSpp) {
+        auto errors = tileErrors();
+        std::vector<bool> active(errors.size());
+        for (size_t i = 0; i < errors.size(); i++) {
+            active[i] = errors[i] > mAdaptive.targetError;
+        }
+        mTiles.select(active);
+        activeTiles = std::count(active.begin(), active.end(), true);
+        if (activeTiles == 0) {
+            mFinished = true;
+            return;
         }
-        auto threadSampler = (i == 0) ? mSampler : mSampler->copy();
-        threads.push_back(std::thread(&PixelIndependentIntegrator::doTracing, this, start, end, threadSampler));
     }
-    mSampler->nextSample();
+    mTiles.reset();
 
-    for (int i = 0; i < mThreads; i++) {
-        threads[i].join();
+    // One task per worker, each with its own sampler on the sample index of this pass
+    beginSplatting();
+    {
+        TaskGroup tasks(pool());
+        for (int i = 0; i < mThreads; i++) {
+            auto workerSampler = mSampler->copy();
+            tasks.run([this, i, workerSampler]() { doTracing(i, workerSampler); });
+        }
+        tasks.wait();
     }
+    endSplatting();
+    mSampler->nextSample();
 
     mCurspp++;
     std::cout << "\r" << std::setw(4) << mCurspp << "/" << mMaxSpp << " spp  ";
 
     float perc = (float)mCurspp / (float)mMaxSpp * 100.0f;
     std::cout << "  " << std::fixed << std::setprecision(2) << perc << "%";
+    if (mPerPixelMean) {
+        std::cout << "  " << activeTiles << "/" << numTiles << " tiles";
+    }
     scaleResult();
 }
 
-void PixelIndependentIntegrator::doTracing(int start, int end, SamplerPtr sampler) {
+void PixelIndependentIntegrator::doTracing(int worker, SamplerPtr sampler) {
+    Tile tile;
+    while (mTiles.next(worker, tile)) {
+        traceTile(tile, sampler);
+    }
+}
+
+void PixelIndependentIntegrator::traceTile(const Tile &tile, SamplerPtr sampler) {
     float invW = 1.0f / mWidth;
     float invH = 1.0f / mHeight;
-    for (int x = start; x < end; x++) {
-        for (int y = 0; y < mHeight; y++) {
-            mPixelPos = { x, y };
+    for (int y = tile.y0; y < tile.y1; y++) {
+        for (int x = tile.x0; x < tile.x1; x++) {
             sampler->setPixel(x, y);
             float sx = 2.0f * (x + 0.5f) * invW - 1.0f;
             float sy = 1.0f - 2.0f * (y + 0.5f) * invH;
@@ -97,11 +275,9 @@ void PixelIndependentIntegrator::doTracing(int start, int end, SamplerPtr sample
                 result = Spectrum(0.0f);
             }
             result = glm::clamp(result, Spectrum(0.0f), Spectrum(1e8f));
-            auto resultBuffer = mScene->mCamera->film();
-            resultBuffer(x, y) += result;
+            addSampleToPixel(x, y, result);
         }
     }
-    std::cout << "A";
 }
 
 void PixelIndependentIntegrator::scaleResult() {
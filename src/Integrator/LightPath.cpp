@@ -7,37 +7,49 @@ double accumTimeLPT = 0.0;
 void LightPathIntegrator::renderOnePass()
 {
     auto &film = mScene->mCamera->film();
+    if (mParam.maxSpp && mPathCount >= static_cast<uint64_t>(mParam.maxSpp) * film.width() * film.height())
+    {
+        mFinished = true;
+        return;
+    }
     BSDFMollifyRadius = glm::pow(mResultScale, 0.1f);
+    int paths = passPaths(mPathsOnePass ? mPathsOnePass * mThreads : film.width() * film.height());
     Timer timer;
-    std::thread *threads = new std::thread[mThreads];
-    for (int i = 0; i < mThreads; i++)
+    beginSplatting();
+    tracePaths(paths, [this](int first, int count)
     {
         auto threadSampler = mSampler->copy();
-        threadSampler->nextSamples(mPathsOnePass * i);
-        threads[i] = std::thread(&LightPathIntegrator::trace, this, threadSampler);
-    }
-    for (int i = 0; i < mThreads; i++)
-        threads[i].join();
-    delete[] threads;
+        threadSampler->nextSamples(first);
+        trace(count, threadSampler);
+    });
+    endSplatting();
 
-    accumTimeLPT += timer.get() / (mPathsOnePass * mThreads) * 1e9;
+    accumTimeLPT += timer.get() / paths * 1e9;
 
-    mSampler->nextSamples(mPathsOnePass * mThreads);
-    mPathCount += mPathsOnePass * mThreads;
-    mResultScale = static_cast<float>(film.width) * film.height / mPathCount;
+    mSampler->nextSamples(paths);
+    mPathCount += paths;
+    mResultScale = static_cast<float>(film.width()) * film.height() / mPathCount;
     std::cout << "\r[LightPathIntegrator paths: " << mPathCount << ", spp: " << std::fixed << std::setprecision(3) << 1.0f / mResultScale << "]";
     std::cout << accumTimeLPT / (++sppLPT);
 }
 
+float LightPathIntegrator::completion() const
+{
+    if (!mParam.maxSpp)
+        return -1.0f;
+    auto &film = mScene->mCamera->film();
+    return static_cast<float>(mPathCount) / (static_cast<float>(mParam.maxSpp) * film.width() * film.height());
+}
+
 void LightPathIntegrator::reset()
 {
-    mScene->mCamera->film().fill(Spectrum(0.0f));
+    mScene->mCamera->film().clear(pool());
     mPathCount = 0;
 }
 
-void LightPathIntegrator::trace(SamplerPtr sampler)
+void LightPathIntegrator::trace(int paths, SamplerPtr sampler)
 {
-    for (int i = 0; i < mPathsOnePass; i++)
+    for (int i = 0; i < paths; i++)
     {
         traceOnePath(sampler.get());
         sampler->nextSample();
@@ -67,9 +79,10 @@ void LightPathIntegrator::traceOnePath(Sampler* sampler)
             if (mScene->visible(pLit, pCam))
             {
                 auto Le = areaLight->Le({ pLit, wi });
-                auto contrib = Le * Ii / (pdfIi * pdfPos * pdfSource);
+                float cosLit = Math::satDot(areaLight->normalGeom(pLit), wi);
+                auto contrib = Le * Ii * cosLit / (pdfIi * pdfPos * pdfSource);
                 if (!Math::isBlack(contrib))
-                    addToFilmLocked(uvRaster, contrib);
+                    splatToFilm(uvRaster, contrib);
             }
         }
 
@@ -82,17 +95,19 @@ void LightPathIntegrator::traceOnePath(Sampler* sampler)
     }
     else
     {
-        auto envLight = std::get<1>(lightSource);
+        // The environment can't reach the camera directly, only through surfaces
         auto [emiRay, Le, pdf] = mScene->sampleLeEnv(sampler->get<6>());
+        if (pdf == 0.0f)
+            return;
 
         wo = -emiRay.dir;
-        ray = { emiRay.ori, emiRay.dir };
+        ray = emiRay;
         throughput = Le / (pdfSource * pdf);
     }
 
     for (int bounce = 1; bounce < TracingDepthLimit; bounce++)
     {
-        auto [distObj, hit] = mScene->closestHit(ray);
+        auto [distObj, hit, prim, bary] = mScene->closestHit(ray);
         if (!hit)
             break;
         if (hit->type() != HittableType::Object)
@@ -100,7 +115,7 @@ void LightPathIntegrator::traceOnePath(Sampler* sampler)
         auto obj = dynamic_cast<Object*>(hit.get());
 
         Vec3f pos = ray.get(distObj);
-        auto surf = obj->surfaceInfo(pos);
+        auto surf = obj->surfaceInfo(pos, prim, bary);
 
         if (glm::dot(surf.ns, wo) < 0)
         {
@@ -123,7 +138,7 @@ void LightPathIntegrator::traceOnePath(Sampler* sampler)
                         throughput * cosWi / pdf;
                     
                     if (!Math::hasNan(res) && !Math::isNan(pdf) && pdf > 1e-8f && !Math::isBlack(res))
-                        addToFilmLocked(uvRaster, res);
+                        splatToFilm(uvRaster, res);
                 }
             }
         }
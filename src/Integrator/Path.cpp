@@ -20,7 +20,7 @@ Spectrum traceOnePath(const PathIntegParam &param, ScenePtr scene, Vec3f pos, Ve
         auto lightSample = sampler->get<5>();
         if (!deltaBsdf && param.sampleDirect)
         {
-            auto [wi, coef, lightPdf] = scene->sampleLiLightAndEnv(pos, lightSample);
+            auto [wi, coef, lightPdf] = scene->sampleLiLightAndEnv(pos, surf.ns, lightSample);
             if (lightPdf != 0)
             {
                 float bsdfPdf = surf.pdf(surf.ns, wo, wi, sampler);
@@ -41,14 +41,14 @@ Spectrum traceOnePath(const PathIntegParam &param, ScenePtr scene, Vec3f pos, Ve
         throughput *= bsdf * cosWi / bsdfPdf;
 
         auto newRay = Ray(pos, wi).offset();
-        auto [dist, obj] = scene->closestHit(newRay);
+        auto [dist, obj, prim, bary] = scene->closestHit(newRay);
 
         if (scene->isLightOrEnv(obj)) {
             float weight = 1.f;
             auto hitPos = newRay.get(dist);
 
             if (!type.isDelta() && param.sampleDirect) {
-                float lightPdf = scene->pdfL(obj, pos, hitPos, wi);
+                float lightPdf = scene->pdfL(obj, pos, surf.ns, hitPos, wi);
                 weight = (lightPdf <= 0) ? 0 : (param.MIS ? Math::powerHeuristic(bsdfPdf, lightPdf) : (1. - param.directWeight));
             }
             result += scene->L(obj, pos, hitPos, wi) * throughput * weight;
@@ -71,14 +71,14 @@ Spectrum traceOnePath(const PathIntegParam &param, ScenePtr scene, Vec3f pos, Ve
         pos = newRay.get(dist);
         wo = -wi;
         auto nextObj = dynamic_cast<Object*>(obj.get());
-        surf = nextObj->surfaceInfo(pos);
+        surf = nextObj->surfaceInfo(pos, prim, bary);
     }
     return result;
 }
 
 Spectrum PathIntegrator::tracePixel(Ray ray, SamplerPtr sampler)
 {
-    auto [dist, obj] = mScene->closestHit(ray);
+    auto [dist, obj, prim, bary] = mScene->closestHit(ray);
 
     if (obj == nullptr)
         return mScene->mEnv->radiance(ray.dir);
@@ -93,7 +93,7 @@ Spectrum PathIntegrator::tracePixel(Ray ray, SamplerPtr sampler)
     {
         Vec3f pos = ray.get(dist);
         auto object = dynamic_cast<Object*>(obj.get());
-        SurfaceInfo surf = object->surfaceInfo(pos);
+        SurfaceInfo surf = object->surfaceInfo(pos, prim, bary);
         return traceOnePath(mParam, mScene, pos, -ray.dir, surf, sampler.get());
     }
     Error::impossiblePath();
@@ -112,25 +112,48 @@ void PathIntegrator2::renderOnePass()
         return;
     }
     auto &film = mScene->mCamera->film();
-    int pathsOnePass = mPathsOnePass ? mPathsOnePass : film.width * film.height / mThreads;
-    std::thread *threads = new std::thread[mThreads];
+    int paths = passPaths(mPathsOnePass ? mPathsOnePass * mThreads : film.width() * film.height());
+
+    // Once the image has minSpp samples per pixel on average, paths go to tiles in proportion
+    // to their error and converged tiles get none
+    mPerPixelMean = mAdaptive.targetError > 0.0f;
+    if (mPerPixelMean && mParam.spp >= mAdaptive.minSpp)
+    {
+        auto errors = tileErrors();
+        std::vector<float> weights(errors.size(), 0.0f);
+        int activeTiles = 0;
+        for (size_t i = 0; i < errors.size(); i++)
+        {
+            if (errors[i] <= mAdaptive.targetError)
+                continue;
+            auto [x0, y0, x1, y1] = film.tileBounds(i);
+            weights[i] = std::min(errors[i], 1.0f) * (x1 - x0) * (y1 - y0);
+            activeTiles++;
+        }
+        if (activeTiles == 0)
+        {
+            mFinished = true;
+            return;
+        }
+        mTileDistrib = Piecewise1D(weights);
+        mAdapting = true;
+    }
 
     Timer timer;
 
-    for (int i = 0; i < mThreads; i++)
+    beginSplatting();
+    tracePaths(paths, [this](int first, int count)
     {
         auto threadSampler = mSampler->copy();
-        threadSampler->nextSamples(pathsOnePass * i);
-        threads[i] = std::thread(&PathIntegrator2::trace, this, pathsOnePass, threadSampler);
-    }
-    for (int i = 0; i < mThreads; i++)
-        threads[i].join();
-    delete[] threads;
+        threadSampler->nextSamples(first);
+        trace(count, threadSampler);
+    });
+    endSplatting();
 
-    accumTime += timer.get() / (pathsOnePass * mThreads) * 1e9;
+    accumTime += timer.get() / paths * 1e9;
 
-    mSampler->nextSamples(pathsOnePass * mThreads);
-    mParam.spp += static_cast<float>(pathsOnePass) * mThreads / (film.width * film.height);
+    mSampler->nextSamples(paths);
+    mParam.spp += static_cast<float>(paths) / (film.width() * film.height());
     mResultScale = 1.0f / mParam.spp;
     std::cout << "\r[PathIntegrator2 spp: " << std::fixed << std::setprecision(3) << mParam.spp << "]";
     std::cout << accumTime / (++spp);
@@ -138,17 +161,28 @@ void PathIntegrator2::renderOnePass()
 
 void PathIntegrator2::reset()
 {
-    mScene->mCamera->film().fill(Spectrum(0.0f));
+    mScene->mCamera->film().clear(pool());
     mParam.spp = 0;
+    mAdapting = false;
+}
+
+Vec2f PathIntegrator2::sampleFilm(Sampler *sampler)
+{
+    if (!mAdapting)
+        return sampler->get2();
+    auto &film = mScene->mCamera->film();
+    auto [x0, y0, x1, y1] = film.tileBounds(mTileDistrib.sample(sampler->get2()));
+    Vec2f u = sampler->get2();
+    return Vec2f((x0 + u.x * (x1 - x0)) / film.width(), (y0 + u.y * (y1 - y0)) / film.height());
 }
 
 void PathIntegrator2::trace(int paths, SamplerPtr sampler)
 {
     for (int i = 0; i < paths; i++)
     {
-        Vec2f uv = sampler->get2();
+        Vec2f uv = sampleFilm(sampler.get());
         Ray ray = mScene->mCamera->generateRay(uv * Vec2f(2.0f, -2.0f) + Vec2f(-1.0f, 1.0f), sampler);
-        auto [dist, obj] = mScene->closestHit(ray);
+        auto [dist, obj, prim, bary] = mScene->closestHit(ray);
         Spectrum result;
 
         if (obj == nullptr)
@@ -163,11 +197,10 @@ void PathIntegrator2::trace(int paths, SamplerPtr sampler)
         {
             Vec3f pos = ray.get(dist);
             auto object = dynamic_cast<Object*>(obj.get());
-            SurfaceInfo surf = object->surfaceInfo(pos);
+            SurfaceInfo surf = object->surfaceInfo(pos, prim, bary);
             result = traceOnePath(mParam, mScene, pos, -ray.dir, surf, sampler.get());
         }
-        if (!Math::isBlack(result))
-            addToFilmLocked(uv, result);
+        addSampleToFilm(uv, result);
         sampler->nextSample();
     }
 }
\ No newline at end of file
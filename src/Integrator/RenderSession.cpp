@@ -0,0 +1,89 @@
+#include "Core/RenderSession.h"
+
+#include <limits>
+
+// Part of a pass the first pass traces when it has a time budget, to measure the pass time
+// without running over a short budget
+const float RenderProbeFraction = 0.125f;
+// Shorter passes are not worth their overhead, the render ends instead
+const float RenderMinPassFraction = 0.01f;
+
+bool RenderSession::renderPass() {
+    if (mIntegrator->isFinished() || mErrorMet) {
+        return false;
+    }
+    float fraction = nextPassFraction();
+    if (fraction <= 0.0f) {
+        return false;
+    }
+
+    mIntegrator->setPassFraction(fraction);
+    uint64_t rays = Scene::numRays();
+    Timer passTimer;
+    mIntegrator->renderOnePass();
+    double passTime = passTimer.get();
+    mIntegrator->setPassFraction(1.0f);
+
+    // Integrators find out that they are done at the start of a pass and return right away
+    if (mIntegrator->isFinished()) {
+        return false;
+    }
+    mPasses++;
+    double fullPassTime = passTime / fraction;
+    mPassTime = mPassTime > 0.0 ? 0.5 * (mPassTime + fullPassTime) : fullPassTime;
+
+    double elapsed = mTimer.get();
+    bool needError = mBudget.targetError > 0.0f || mProgress;
+    float error = needError ? mIntegrator->imageError() : std::numeric_limits<float>::infinity();
+    if (mBudget.targetError > 0.0f && error <= mBudget.targetError) {
+        mErrorMet = true;
+    }
+    if (mProgress) {
+        double raysPerSecond = passTime > 0.0 ? (Scene::numRays() - rays) / passTime : 0.0;
+        mProgress({ mPasses, elapsed, estimateRemaining(elapsed, error), raysPerSecond, error });
+    }
+    return true;
+}
+
+float RenderSession::nextPassFraction() {
+    if (mBudget.seconds <= 0.0) {
+        return 1.0f;
+    }
+    double left = mBudget.seconds - mTimer.get();
+    if (left <= 0.0) {
+        return 0.0f;
+    }
+    bool partial = mIntegrator->partialPasses();
+    if (mPassTime == 0.0) {
+        return partial ? RenderProbeFraction : 1.0f;
+    }
+    if (mPassTime <= left) {
+        return 1.0f;
+    }
+    if (partial) {
+        float fraction = left / mPassTime;
+        return fraction >= RenderMinPassFraction ? fraction : 0.0f;
+    }
+    return mPassTime * 0.5 <= left ? 1.0f : 0.0f;
+}
+
+double RenderSession::estimateRemaining(double elapsed, float error) const {
+    double remaining = -1.0;
+    auto consider = [&remaining](double estimate) {
+        estimate = std::max(estimate, 0.0);
+        remaining = remaining < 0.0 ? estimate : std::min(remaining, estimate);
+    };
+    if (mBudget.seconds > 0.0) {
+        consider(mBudget.seconds - elapsed);
+    }
+    float completion = mIntegrator->completion();
+    if (completion > 0.0f) {
+        consider(elapsed * (1.0f - completion) / completion);
+    }
+    // Error falls with the square root of the samples taken
+    if (mBudget.targetError > 0.0f && std::isfinite(error)) {
+        float ratio = error / mBudget.targetError;
+        consider(elapsed * (ratio * ratio - 1.0f));
+    }
+    return remaining;
+}
@@ -101,7 +101,7 @@ Spectrum traceCameraPath(const TriplePathIntegParam &param, ScenePtr scene, Vec3
         throughput *= bsdf * cosWi / bsdfPdf;
 
         auto nextRay = Ray(pos, wi).offset();
-        auto [dist, obj] = scene->closestHit(nextRay);
+        auto [dist, obj, prim, bary] = scene->closestHit(nextRay);
         
         float pdfDirToNext = surf.pdf(surf.ns, wo, wi, sampler, TransportMode::Radiance);
         float pdfDirToPrev = surf.pdf(surf.ns, wi, wo, sampler, TransportMode::Importance);;
@@ -151,7 +151,7 @@ Spectrum traceCameraPath(const TriplePathIntegParam &param, ScenePtr scene, Vec3
 
         Vec3f nextPos = nextRay.get(dist);
         auto nextObj = dynamic_cast<Object*>(obj.get());
-        auto nextSurf = nextObj->surfaceInfo(nextPos);
+        auto nextSurf = nextObj->surfaceInfo(nextPos, prim, bary);
 
         float coef = ((bounce == 1) ? 1.0f : remap(pdfDirToPrev * Math::absDot(prevNorm, wo))) /
             remap(pdfDirToNext * Math::absDot(nextSurf.ns, wi));
@@ -200,7 +200,7 @@ void TriplePathIntegrator::traceLightPath(Sampler* sampler) {
     float s1t1 = 1.0f;
 
     for (int bounce = 1; bounce < TracingDepthLimit; bounce++) {
-        auto [distObj, hit] = mScene->closestHit(ray);
+        auto [distObj, hit, prim, bary] = mScene->closestHit(ray);
         if (!hit) {
             break;
         }
@@ -210,7 +210,7 @@ void TriplePathIntegrator::traceLightPath(Sampler* sampler) {
         auto obj = dynamic_cast<Object *>(hit.get());
 
         Vec3f pos = ray.get(distObj);
-        auto surf = obj->surfaceInfo(pos);
+        auto surf = obj->surfaceInfo(pos, prim, bary);
 
         if (glm::dot(surf.ns, wo) < 0) {
             if (!surf.bsdf->type().hasType(BSDFType::Transmission)) {
@@ -251,7 +251,7 @@ void TriplePathIntegrator::traceLightPath(Sampler* sampler) {
                     Spectrum res = contrib * weight;
                     if (!Math::isNan(weight) && weight > 0) {
                         //if (bounce == mParam.maxLightDepth)
-                        addToFilmLocked(uvRaster, res * static_cast<float>(LPTtoPT));
+                        splatToFilm(uvRaster, res * static_cast<float>(LPTtoPT));
                     }
                 }
             }
@@ -301,36 +301,34 @@ int sppTPT = 0;
 
 void TriplePathIntegrator::renderOnePass() {
     if (mMaxSpp && mParam.spp >= mMaxSpp) {
+        mFinished = true;
         return;
     }
     auto &film = mScene->mCamera->film();
-    int pathsOnePass = mPathsOnePass ? mPathsOnePass : film.width * film.height / mThreads;
-    std::thread *threads = new std::thread[mThreads];
+    int paths = passPaths(mPathsOnePass ? mPathsOnePass * mThreads : film.width() * film.height());
 
     Timer timer;
 
-    for (int i = 0; i < mThreads; i++) {
+    beginSplatting();
+    tracePaths(paths, [this](int first, int count) {
         auto threadSampler = mSampler->copy();
-        threadSampler->nextSamples(pathsOnePass * i);
-        threads[i] = std::thread(&TriplePathIntegrator::trace, this, pathsOnePass, threadSampler);
-    }
-    for (int i = 0; i < mThreads; i++) {
-        threads[i].join();
-    }
-    delete[] threads;
+        threadSampler->nextSamples(first);
+        trace(count, threadSampler);
+    });
+    endSplatting();
 
-    mSampler->nextSamples(pathsOnePass * mThreads);
+    mSampler->nextSamples(paths);
 
-    accumTimeTPT += timer.get() / (pathsOnePass * mThreads * 2) * 1e9;
+    accumTimeTPT += timer.get() / (paths * 2) * 1e9;
 
-    mParam.spp += static_cast<float>(pathsOnePass) * mThreads / (film.width * film.height);
+    mParam.spp += static_cast<float>(paths) / (film.width() * film.height());
     mResultScale = 1.0f / mParam.spp;
     std::cout << "\r[TriPathIntegrator spp: " << std::fixed << std::setprecision(3) << mParam.spp << "]";
     std::cout << accumTimeTPT / (++sppTPT);
 }
 
 void TriplePathIntegrator::reset() {
-    mScene->mCamera->film().fill(Spectrum(0.0f));
+    mScene->mCamera->film().clear(pool());
     mParam.spp = 0;
 }
 
@@ -338,7 +336,7 @@ void TriplePathIntegrator::trace(int paths, SamplerPtr sampler) {
     for (int i = 0; i < paths; i++) {
         Vec2f uv = sampler->get2();
         Ray ray = mScene->mCamera->generateRay(uv * Vec2f(2.0f, -2.0f) + Vec2f(-1.0f, 1.0f), sampler);
-        auto [dist, obj] = mScene->closestHit(ray);
+        auto [dist, obj, prim, bary] = mScene->closestHit(ray);
         Spectrum result(0.0f);
 
         if (obj == nullptr) {
@@ -352,12 +350,12 @@ void TriplePathIntegrator::trace(int paths, SamplerPtr sampler) {
         else if (obj->type() == HittableType::Object) {
             Vec3f pos = ray.get(dist);
             auto object = dynamic_cast<Object*>(obj.get());
-            SurfaceInfo surf = object->surfaceInfo(pos);
+            SurfaceInfo surf = object->surfaceInfo(pos, prim, bary);
             auto [pdfPos, pdfDir] = mScene->mCamera->pdfIe(ray);
             result = traceCameraPath(mParam, mScene, pos, -ray.dir, surf, ray.ori, mScene->mCamera->f(), sampler.get(),
                 remap(pdfPos) / remap(pdfToArea(ray.ori, pos, surf.ns, pdfDir)));
         }
-        addToFilmLocked(uv, result);
+        addSampleToFilm(uv, result);
 
         if (i % LPTtoPT == 0) {
             traceLightPath(sampler.get());
@@ -0,0 +1,334 @@
+#include "Core/Integrator.h"
+
+#include <algorithm>
+
+// Paths per task of a stage loop, a multiple of BVHPacketSize
+const int WavefrontChunkSize = 1024;
+// Paths of a pass are traced in waves of this many per thread. Waves that keep the path
+// states in cache beat larger ones, the stages touch every state a few times per bounce
+const int WavefrontPathsPerThread = 1 << 14;
+
+void WavefrontPaths::resize(int size)
+{
+    uv.resize(size);
+    sampleIndex.resize(size);
+    sampleDim.resize(size);
+    ray.resize(size);
+    hit.resize(size);
+    pos.resize(size);
+    surface.resize(size);
+    bounce.resize(size);
+    throughput.resize(size);
+    radiance.resize(size);
+    etaScale.resize(size);
+    bsdfPdf.resize(size);
+    etaFactor.resize(size);
+    rrWeight.resize(size);
+    deltaBounce.resize(size);
+    shadowRay.resize(size);
+    shadowRadiance.resize(size);
+}
+
+template<typename Func>
+void WavefrontPathIntegrator::parallelFor(int count, Func &&func)
+{
+    ::parallelFor(pool(), count, WavefrontChunkSize, [&](int begin, int end)
+    {
+        func(mChunkSamplers[begin / WavefrontChunkSize], begin, end);
+    });
+}
+
+void WavefrontPathIntegrator::renderOnePass()
+{
+    if (mMaxSpp && mParam.spp >= mMaxSpp)
+    {
+        mFinished = true;
+        return;
+    }
+    auto &film = mScene->mCamera->film();
+    int paths = passPaths(mPathsOnePass ? mPathsOnePass * mThreads : film.width() * film.height());
+
+    uint64_t firstSample = mSampler->sampleIndex();
+    int waveSize = WavefrontPathsPerThread * mThreads;
+    beginSplatting();
+    for (int i = 0; i < paths; i += waveSize)
+        traceWave(std::min(waveSize, paths - i), firstSample + i);
+    endSplatting();
+
+    mSampler->nextSamples(paths);
+    mParam.spp += static_cast<float>(paths) / (film.width() * film.height());
+    mResultScale = 1.0f / mParam.spp;
+    std::cout << "\r[WavefrontPathIntegrator spp: " << std::fixed << std::setprecision(3) << mParam.spp << "]" <<
+        std::setprecision(2) << " generate " << stageTime(WavefrontStage::Generate) <<
+        "s, intersect " << stageTime(WavefrontStage::Intersect) << "s, shade " << stageTime(WavefrontStage::Shade) <<
+        "s, shadow " << stageTime(WavefrontStage::Shadow) << "s, accumulate " << stageTime(WavefrontStage::Accumulate) << "s";
+}
+
+void WavefrontPathIntegrator::reset()
+{
+    mScene->mCamera->film().clear(pool());
+    mParam.spp = 0;
+    std::fill(std::begin(mStageTime), std::end(mStageTime), 0.0);
+}
+
+void WavefrontPathIntegrator::traceWave(int paths, uint64_t firstSample)
+{
+    mPaths.resize(paths);
+    // Every chunk of a stage loop gets its own sampler. Reseeding makes samplers without
+    // sample indices produce a different stream per chunk
+    int chunks = (paths + WavefrontChunkSize - 1) / WavefrontChunkSize;
+    mChunkSamplers.resize(chunks);
+    for (int i = 0; i < chunks; i++)
+    {
+        mChunkSamplers[i] = mSampler->copy();
+        mChunkSamplers[i]->nextSamples(i);
+    }
+
+    auto timed = [this](WavefrontStage stage, auto &&func)
+    {
+        Timer timer;
+        func();
+        mStageTime[static_cast<int>(stage)] += timer.get();
+    };
+    timed(WavefrontStage::Generate, [&]() { generate(paths, firstSample); });
+    while (!mActive.empty())
+    {
+        timed(WavefrontStage::Intersect, [&]() { intersect(); });
+        timed(WavefrontStage::Shade, [&]() { shade(); });
+        timed(WavefrontStage::Shadow, [&]() { traceShadowRays(); });
+    }
+    timed(WavefrontStage::Accumulate, [&]() { accumulate(paths); });
+}
+
+void WavefrontPathIntegrator::generate(int paths, uint64_t firstSample)
+{
+    mActive.resize(paths);
+    parallelFor(paths, [&](const SamplerPtr &sampler, int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            sampler->setSample(firstSample + i, 0);
+            Vec2f uv = sampler->get2();
+            mPaths.uv[i] = uv;
+            mPaths.ray[i] = mScene->mCamera->generateRay(uv * Vec2f(2.0f, -2.0f) + Vec2f(-1.0f, 1.0f), sampler);
+            mPaths.sampleIndex[i] = firstSample + i;
+            mPaths.sampleDim[i] = sampler->dimension();
+            mPaths.bounce[i] = 0;
+            mPaths.throughput[i] = Spectrum(1.0f);
+            mPaths.radiance[i] = Spectrum(0.0f);
+            mPaths.etaScale[i] = 1.0f;
+            mActive[i] = i;
+        }
+    });
+}
+
+void WavefrontPathIntegrator::intersect()
+{
+    parallelFor(mActive.size(), [&](const SamplerPtr &sampler, int begin, int end)
+    {
+        for (int i = begin; i < end; i += BVHPacketSize)
+        {
+            int count = std::min(BVHPacketSize, end - i);
+            Ray rays[BVHPacketSize];
+            HitInfo hits[BVHPacketSize];
+            for (int j = 0; j < count; j++)
+                rays[j] = mPaths.ray[mActive[i + j]];
+            mScene->closestHit8(rays, count, hits);
+            for (int j = 0; j < count; j++)
+                mPaths.hit[mActive[i + j]] = std::move(hits[j]);
+        }
+    });
+}
+
+// Paths leaving a stage are marked as ~path in the queue and removed after the loop
+void WavefrontPathIntegrator::shade()
+{
+    parallelFor(mActive.size(), [&](const SamplerPtr &sampler, int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            if (!resolveHit(mActive[i], sampler.get()))
+                mActive[i] = ~mActive[i];
+        }
+    });
+    mActive.erase(std::remove_if(mActive.begin(), mActive.end(), [](int path) { return path < 0; }), mActive.end());
+
+    // Consecutive paths with the same material run the same BSDF code
+    std::vector<std::pair<BSDF*, int>> byMaterial(mActive.size());
+    for (size_t i = 0; i < mActive.size(); i++)
+        byMaterial[i] = { mPaths.surface[mActive[i]].bsdf.get(), mActive[i] };
+    std::sort(byMaterial.begin(), byMaterial.end());
+    for (size_t i = 0; i < mActive.size(); i++)
+        mActive[i] = byMaterial[i].second;
+
+    parallelFor(mActive.size(), [&](const SamplerPtr &sampler, int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            if (!scatter(mActive[i], sampler.get()))
+                mActive[i] = ~mActive[i];
+        }
+    });
+
+    // Later stages go back to path order, which walks the path states sequentially.
+    // Paths ending here still count their direct lighting
+    std::sort(mActive.begin(), mActive.end(), [](int a, int b) { return (a < 0 ? ~a : a) < (b < 0 ? ~b : b); });
+    mShadowQueue.clear();
+    int alive = 0;
+    for (int path : mActive)
+    {
+        int index = path < 0 ? ~path : path;
+        if (mPaths.shadowRadiance[index] != Spectrum(0.0f))
+            mShadowQueue.push_back(index);
+        if (path >= 0)
+            mActive[alive++] = path;
+    }
+    mActive.resize(alive);
+}
+
+void WavefrontPathIntegrator::traceShadowRays()
+{
+    parallelFor(mShadowQueue.size(), [&](const SamplerPtr &sampler, int begin, int end)
+    {
+        for (int i = begin; i < end; i += BVHPacketSize)
+        {
+            int count = std::min(BVHPacketSize, end - i);
+            Ray rays[BVHPacketSize];
+            float dists[BVHPacketSize];
+            for (int j = 0; j < count; j++)
+            {
+                const auto &shadow = mPaths.shadowRay[mShadowQueue[i + j]];
+                rays[j] = shadow.ray;
+                dists[j] = shadow.dist;
+            }
+            int occluded = mScene->occluded8(rays, dists, count);
+            for (int j = 0; j < count; j++)
+            {
+                int path = mShadowQueue[i + j];
+                if (!(occluded & (1 << j)))
+                    mPaths.radiance[path] += mPaths.shadowRadiance[path];
+            }
+        }
+    });
+}
+
+void WavefrontPathIntegrator::accumulate(int paths)
+{
+    parallelFor(paths, [&](const SamplerPtr &sampler, int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+            addSampleToFilm(mPaths.uv[i], mPaths.radiance[i]);
+    });
+}
+
+// Adds the emission found by the last ray and decides whether the path goes on,
+// in which case the surface at the hit is evaluated for scatter
+bool WavefrontPathIntegrator::resolveHit(int path, Sampler *sampler)
+{
+    const Ray &ray = mPaths.ray[path];
+    const auto &[dist, obj, prim, bary] = mPaths.hit[path];
+    Spectrum &throughput = mPaths.throughput[path];
+
+    if (mPaths.bounce[path] == 0)
+    {
+        if (obj == nullptr)
+        {
+            mPaths.radiance[path] = mScene->mEnv->radiance(ray.dir);
+            return false;
+        }
+        if (obj->type() == HittableType::Light)
+        {
+            auto light = dynamic_cast<Light*>(obj.get());
+            mPaths.radiance[path] = light->Le({ ray.get(dist), -ray.dir });
+            return false;
+        }
+    }
+    else
+    {
+        if (mScene->isLightOrEnv(obj))
+        {
+            float weight = 1.0f;
+            Vec3f pos = mPaths.pos[path];
+            Vec3f hitPos = ray.get(dist);
+            if (!mPaths.deltaBounce[path] && mParam.sampleDirect)
+            {
+                float lightPdf = mScene->pdfL(obj, pos, mPaths.surface[path].ns, hitPos, ray.dir);
+                weight = (lightPdf <= 0) ? 0 :
+                    (mParam.MIS ? Math::powerHeuristic(mPaths.bsdfPdf[path], lightPdf) : (1.0f - mParam.directWeight));
+            }
+            mPaths.radiance[path] += mScene->L(obj, pos, hitPos, ray.dir) * throughput * weight;
+            return false;
+        }
+
+        mPaths.etaScale[path] *= mPaths.etaFactor[path];
+        int bounce = mPaths.bounce[path];
+        if (bounce >= mParam.rrStartDepth && mParam.russianRoulette)
+        {
+            sampler->setSample(mPaths.sampleIndex[path], mPaths.sampleDim[path]);
+            float continueProb = glm::min<float>(mPaths.rrWeight[path] * mPaths.etaScale[path], 0.95f);
+            bool terminate = sampler->get1() >= continueProb;
+            mPaths.sampleDim[path] = sampler->dimension();
+            if (terminate)
+                return false;
+            throughput /= continueProb;
+        }
+        if (bounce >= mParam.maxDepth && !mParam.russianRoulette)
+            return false;
+    }
+
+    Vec3f pos = ray.get(dist);
+    mPaths.bounce[path]++;
+    mPaths.pos[path] = pos;
+    mPaths.surface[path] = dynamic_cast<Object*>(obj.get())->surfaceInfo(pos, prim, bary);
+    return true;
+}
+
+// Samples a light, leaving its shadow ray for the shadow stage, and the next direction. The BSDF
+// is evaluated toward the light before it is sampled, in the sample dimensions PathIntegrator2 uses
+bool WavefrontPathIntegrator::scatter(int path, Sampler *sampler)
+{
+    SurfaceInfo &surf = mPaths.surface[path];
+    Vec3f pos = mPaths.pos[path];
+    Vec3f wo = -mPaths.ray[path].dir;
+    Spectrum &throughput = mPaths.throughput[path];
+    mPaths.shadowRadiance[path] = Spectrum(0.0f);
+    sampler->setSample(mPaths.sampleIndex[path], mPaths.sampleDim[path]);
+
+    BSDFPtr mat = surf.bsdf;
+    if (glm::dot(surf.ns, wo) <= 0 && !mat->type().hasType(BSDFType::Transmission))
+        surf.flipNormal();
+    bool deltaBsdf = mat->type().isDelta();
+
+    auto lightSample = sampler->get<5>();
+    if (!deltaBsdf && mParam.sampleDirect)
+    {
+        ShadowRay shadow;
+        auto [wi, coef, lightPdf] = mScene->sampleLiLightAndEnv(pos, surf.ns, lightSample, &shadow);
+        if (lightPdf != 0)
+        {
+            float bsdfPdf = surf.pdf(surf.ns, wo, wi, sampler);
+            float weight = mParam.MIS ? Math::powerHeuristic(lightPdf, bsdfPdf) : mParam.directWeight;
+            mPaths.shadowRadiance[path] = surf.f(surf.ns, wo, wi, sampler) * throughput *
+                Math::absDot(surf.ns, wi) * coef * weight;
+            mPaths.shadowRay[path] = shadow;
+        }
+    }
+
+    auto bsdfSample = surf.sample(surf.ns, wo, sampler);
+    mPaths.sampleDim[path] = sampler->dimension();
+    if (!bsdfSample)
+        return false;
+    auto [wi, bsdf, bsdfPdf, type, eta] = bsdfSample.value();
+
+    float cosWi = type.isDelta() ? 1.0f : Math::absDot(surf.ns, wi);
+    if (bsdfPdf < 1e-8f || Math::isNan(bsdfPdf) || Math::isInf(bsdfPdf) || cosWi < 1e-6f)
+        return false;
+    throughput *= bsdf * cosWi / bsdfPdf;
+
+    mPaths.ray[path] = Ray(pos, wi).offset();
+    mPaths.bsdfPdf[path] = bsdfPdf;
+    mPaths.deltaBounce[path] = type.isDelta();
+    mPaths.etaFactor[path] = type.isTransmission() ? Math::square(eta) : 1.0f;
+    mPaths.rrWeight[path] = Math::maxComponent(bsdf / bsdfPdf);
+    return true;
+}
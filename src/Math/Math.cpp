@@ -51,15 +51,6 @@ glm::mat3 localToWorldFrame(const Vec3f &N) {
     return glm::mat3(T, B, N);
 }
 
-uint32_t inverseBits(uint32_t bits) {
-    bits = (bits << 16u) | (bits >> 16u);
-    bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
-    bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
-    bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
-    bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
-    return bits;
-}
-
 float radicalInverse(uint32_t bits) {
     return float(inverseBits(bits)) * 2.3283064365386963e-10;
 }
@@ -45,18 +45,82 @@ int Piecewise1D::sample(const Vec2f &u) const {
     return (ry <= table[rx].second / sumDistrib) ? rx : table[rx].first;
 }
 
-PiecewiseIndependent2D::PiecewiseIndependent2D(float *pdf, int width, int height) {
-    std::vector<float> colDistrib(height);
-    for (int i = 0; i < height; i++) {
-        std::vector<float> table(pdf + i * width, pdf + (i + 1) * width);
-        Piecewise1D rowDistrib(table);
-        rowTables.push_back(rowDistrib);
-        colDistrib[i] = rowDistrib.sum();
-    }
-    colTable = Piecewise1D(colDistrib);
+Piecewise2D::Piecewise2D(std::vector<float> &&weights, int width, int height) :
+    mWidth(width), mHeight(height), mConditional(size_t(width) * height), mPdf(std::move(weights)) {
+    std::vector<float> scaled;
+    std::vector<int> small, large;
+    std::vector<float> rowSums(height);
+    for (int y = 0; y < height; y++) {
+        rowSums[y] = buildAlias(&mPdf[size_t(y) * width], width, &mConditional[size_t(y) * width],
+            scaled, small, large);
+    }
+    mMarginal.resize(height);
+    mSum = buildAlias(rowSums.data(), height, mMarginal.data(), scaled, small, large);
+
+    float scale = (mSum > 0.0f) ? float(width) * height / mSum : 0.0f;
+    for (auto &pdf : mPdf) {
+        pdf *= scale;
+    }
+}
+
+Vec2f Piecewise2D::sample(const Vec2f &u1, const Vec2f &u2) const {
+    Vec2f offset;
+    int y = sampleAlias(mMarginal.data(), mHeight, u1, offset.y);
+    int x = sampleAlias(&mConditional[size_t(y) * mWidth], mWidth, u2, offset.x);
+    return (Vec2f(x, y) + offset) / Vec2f(mWidth, mHeight);
+}
+
+float Piecewise2D::pdf(const Vec2f &p) const {
+    int x = glm::clamp(static_cast<int>(p.x * mWidth), 0, mWidth - 1);
+    int y = glm::clamp(static_cast<int>(p.y * mHeight), 0, mHeight - 1);
+    return mPdf[size_t(y) * mWidth + x];
+}
+
+// Vose's method, returns the sum of the weights. All zero weights give a uniform table
+float Piecewise2D::buildAlias(const float *weights, int n, Entry *table, std::vector<float> &scaled,
+    std::vector<int> &small, std::vector<int> &large) {
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += weights[i];
+    }
+    if (sum <= 0.0) {
+        for (int i = 0; i < n; i++) {
+            table[i] = { 1.0f, i };
+        }
+        return 0.0f;
+    }
+
+    scaled.resize(n);
+    small.clear();
+    large.clear();
+    for (int i = 0; i < n; i++) {
+        scaled[i] = static_cast<float>(weights[i] * n / sum);
+        (scaled[i] < 1.0f ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back();
+        small.pop_back();
+        int l = large.back();
+        table[s] = { scaled[s], l };
+        scaled[l] -= 1.0f - scaled[s];
+        if (scaled[l] < 1.0f) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Left over only by rounding, both are full cells
+    for (int i : small) {
+        table[i] = { 1.0f, i };
+    }
+    for (int i : large) {
+        table[i] = { 1.0f, i };
+    }
+    return static_cast<float>(sum);
 }
 
-std::pair<int, int> PiecewiseIndependent2D::sample(const Vec2f &u1, const Vec2f &u2) const {
-    int row = colTable.sample(u1);
-    return std::pair<int, int>(rowTables[row].sample(u2), row);
+int Piecewise2D::sampleAlias(const Entry *table, int n, const Vec2f &u, float &offset) {
+    float scaled = u.x * n;
+    int i = glm::min(static_cast<int>(scaled), n - 1);
+    offset = glm::min(scaled - i, Math::OneMinusEpsilon);
+    return (u.y < table[i].threshold) ? i : table[i].alias;
 }
\ No newline at end of file
@@ -75,4 +75,11 @@ namespace Math {
         float z = glm::sqrt(1.0f - glm::dot(uv, uv));
         return Vec3f(uv, z);
     }
+
+    Vec3f sampleUniformSphere(const Vec2f &u) {
+        float z = 1.0f - 2.0f * u.x;
+        float r = glm::sqrt(glm::max(1.0f - z * z, 0.0f));
+        float phi = 2.0f * Pi * u.y;
+        return Vec3f(r * glm::cos(phi), r * glm::sin(phi), z);
+    }
 }
\ No newline at end of file
@@ -1,15 +1,45 @@
 #include "Core/Sampler.h"
 
-IndependentSampler::IndependentSampler() :
-    Sampler(SamplerType::Independent) {
-    rng.seed(globalRandomEngine());
+IndependentSampler::IndependentSampler(uint32_t seed) :
+    seed(seed), pixel(Math::hash(0, 0, seed)), Sampler(SamplerType::Independent) {
+    restart();
 }
 
 float IndependentSampler::get1() {
-    return std::uniform_real_distribution<float>(0.0f, Math::OneMinusEpsilon)(rng);
+    dim++;
+    return rng.uniformFloat();
+}
+
+void IndependentSampler::setPixel(int x, int y) {
+    pixel = Math::hash(x, y, seed);
+    dim = 0;
+    restart();
+}
+
+void IndependentSampler::nextSample() {
+    index++;
+    dim = 0;
+    restart();
+}
+
+void IndependentSampler::nextSamples(size_t samples) {
+    index += samples;
+    dim = 0;
+    restart();
+}
+
+void IndependentSampler::setSample(uint64_t index, int dim) {
+    this->index = index;
+    this->dim = dim;
+    restart();
+    rng.advance(dim);
+}
+
+void IndependentSampler::restart() {
+    rng.setSequence(pixel, Math::mixBits(index));
 }
 
 SamplerPtr IndependentSampler::copy() {
     IndependentSampler *sampler = new IndependentSampler(*this);
     return SamplerPtr(sampler);
-}
\ No newline at end of file
+}
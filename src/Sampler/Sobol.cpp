@@ -1,5 +1,6 @@
 #include "Core/Sampler.h"
 #include "Utils/SobolMatrices1024x52.h"
+#include "Utils/TileScheduler.h"
 
 uint32_t sobolSample(uint64_t index, int dim, uint32_t scramble = 0) {
     uint32_t r = scramble;
@@ -11,18 +12,51 @@ uint32_t sobolSample(uint64_t index, int dim, uint32_t scramble = 0) {
     return r;
 }
 
-float SobolSampler::get1() {
-    float r = static_cast<float>(sobolSample(index, dim++, scramble)) * 0x1p-32f;
-    if (randomScrambling) {
-        scramble = rng();
+// Owen scrambling by Laine and Karras' hash, flipping each bit depending on all the bits above it
+// ("Practical Hash-based Owen Scrambling", Burley 2020)
+uint32_t owenScramble(uint32_t v, uint32_t seed) {
+    v = Math::inverseBits(v);
+    v ^= v * 0x3d20adeau;
+    v += seed;
+    v *= (seed >> 16) | 1;
+    v ^= v * 0x05526c56u;
+    v ^= v * 0x53a22864u;
+    return Math::inverseBits(v);
+}
+
+float toUnitFloat(uint32_t v) {
+    return std::min(static_cast<float>(v) * 0x1p-32f, Math::OneMinusEpsilon);
+}
+
+uint32_t SobolSampler::unscrambled(int dim) {
+    uint64_t grayCode = index ^ (index >> 1);
+    if (dim >= SobolCachedDims) {
+        return sobolSample(grayCode, dim);
+    }
+    if (cachedIndex[dim] == index) {
+        return cachedValue[dim];
     }
-    return std::min(r, Math::OneMinusEpsilon);
+    if (cachedIndex[dim] + 1 == index) {
+        // Gray codes of index - 1 and index differ in the lowest set bit of index
+        cachedValue[dim] ^= SobolMatrices[dim * SobolMatricesSize + Math::countTrailingZeros(index)];
+    }
+    else {
+        cachedValue[dim] = sobolSample(grayCode, dim);
+    }
+    cachedIndex[dim] = index;
+    return cachedValue[dim];
+}
+
+float SobolSampler::get1() {
+    uint32_t v = unscrambled(dim);
+    v = randomScrambling ? owenScramble(v, Math::hash(scramble, dim)) : v ^ scramble;
+    dim++;
+    return toUnitFloat(v);
 }
 
 void SobolSampler::setPixel(int x, int y) {
     dim = 0;
-    rng.seed(y << 16 | x);
-    scramble = rng();
+    scramble = Math::hash(x, y, seed);
 }
 
 void SobolSampler::nextSample() {
@@ -35,7 +69,99 @@ void SobolSampler::nextSamples(size_t samples) {
     dim = 0;
 }
 
+void SobolSampler::setSample(uint64_t index, int dim) {
+    this->index = index;
+    this->dim = dim;
+}
+
 SamplerPtr SobolSampler::copy() {
     SobolSampler *sampler = new SobolSampler(*this);
     return SamplerPtr(sampler);
-}
\ No newline at end of file
+}
+
+ZSobolSampler::ZSobolSampler(int spp, int width, int height, uint32_t seed) :
+    seed(seed), Sampler(SamplerType::ZSobol) {
+    log2Spp = 0;
+    while ((1 << log2Spp) < spp) {
+        log2Spp++;
+    }
+    int log2Res = 0;
+    while ((1 << log2Res) < std::max(width, height)) {
+        log2Res++;
+    }
+    numBase4Digits = log2Res + (log2Spp + 1) / 2;
+}
+
+uint64_t ZSobolSampler::sequenceIndex() const {
+    // Each of the 24 permutations of a base 4 digit
+    static const uint8_t Permutations[24][4] = {
+        { 0, 1, 2, 3 }, { 0, 1, 3, 2 }, { 0, 2, 1, 3 }, { 0, 2, 3, 1 }, { 0, 3, 2, 1 }, { 0, 3, 1, 2 },
+        { 1, 0, 2, 3 }, { 1, 0, 3, 2 }, { 1, 2, 0, 3 }, { 1, 2, 3, 0 }, { 1, 3, 2, 0 }, { 1, 3, 0, 2 },
+        { 2, 1, 0, 3 }, { 2, 1, 3, 0 }, { 2, 0, 1, 3 }, { 2, 0, 3, 1 }, { 2, 3, 0, 1 }, { 2, 3, 1, 0 },
+        { 3, 1, 2, 0 }, { 3, 1, 0, 2 }, { 3, 2, 1, 0 }, { 3, 2, 0, 1 }, { 3, 0, 2, 1 }, { 3, 0, 1, 2 }
+    };
+    // With an odd power of two samples the lowest digit of the index is binary
+    bool oddLog2Spp = log2Spp & 1;
+    uint64_t dimHash = 0x55555555ull * dim;
+    uint64_t result = 0;
+    for (int i = numBase4Digits - 1; i >= static_cast<int>(oddLog2Spp); i--) {
+        int shift = 2 * i - oddLog2Spp;
+        int digit = (mortonIndex >> shift) & 3;
+        // The permutation only depends on the digits above, so whole subtrees are shuffled
+        uint64_t higherDigits = mortonIndex >> (shift + 2);
+        int perm = (Math::mixBits(higherDigits ^ dimHash) >> 24) % 24;
+        result |= static_cast<uint64_t>(Permutations[perm][digit]) << shift;
+    }
+    if (oddLog2Spp) {
+        int bit = mortonIndex & 1;
+        result |= bit ^ (Math::mixBits((mortonIndex >> 1) ^ dimHash) & 1);
+    }
+    return result;
+}
+
+uint64_t ZSobolSampler::scrambleSeed() const {
+    // Every run of spp samples is scrambled anew
+    return Math::hash(dim, seed, index >> log2Spp);
+}
+
+float ZSobolSampler::get1() {
+    uint64_t i = sequenceIndex();
+    dim++;
+    return toUnitFloat(owenScramble(sobolSample(i, 0), scrambleSeed()));
+}
+
+Vec2f ZSobolSampler::get2() {
+    uint64_t i = sequenceIndex();
+    dim += 2;
+    uint64_t bits = scrambleSeed();
+    return {
+        toUnitFloat(owenScramble(sobolSample(i, 0), static_cast<uint32_t>(bits))),
+        toUnitFloat(owenScramble(sobolSample(i, 1), static_cast<uint32_t>(bits >> 32)))
+    };
+}
+
+void ZSobolSampler::setPixel(int x, int y) {
+    dim = 0;
+    uint64_t morton = TileScheduler::interleaveBits(x) | (TileScheduler::interleaveBits(y) << 1);
+    mortonIndex = (morton << log2Spp) | (index & ((1ull << log2Spp) - 1));
+}
+
+void ZSobolSampler::nextSample() {
+    index++;
+    dim = 0;
+}
+
+void ZSobolSampler::nextSamples(size_t samples) {
+    index += samples;
+    dim = 0;
+}
+
+void ZSobolSampler::setSample(uint64_t index, int dim) {
+    this->index = index;
+    this->dim = dim;
+}
+
+SamplerPtr ZSobolSampler::copy() {
+    ZSobolSampler *sampler = new ZSobolSampler(*this);
+    return SamplerPtr(sampler);
+}
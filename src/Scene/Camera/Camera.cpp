@@ -1,4 +1,9 @@
+#ifdef _WIN32
 #include <Windows.h>
+#else
+#define VK_SHIFT 0x10
+#define VK_SPACE 0x20
+#endif
 
 #include "Core/Camera.h"
 
@@ -94,5 +99,4 @@ void Camera::update() {
 
 void Camera::initFilm(int width, int height) {
     mFilm.init(width, height);
-    mFilmLocker.init(width, height);
 }
\ No newline at end of file
@@ -0,0 +1,88 @@
+#include "Core/Film.h"
+#include "Utils/TileScheduler.h"
+
+#include <new>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+void Film::AlignedDelete::operator () (FilmPixel *pixels) const {
+    ::operator delete[](pixels, std::align_val_t(64));
+}
+
+void Film::init(int width, int height) {
+    mWidth = width;
+    mHeight = height;
+    mTilesX = (width + FilmTileSize - 1) / FilmTileSize;
+    int tilesY = (height + FilmTileSize - 1) / FilmTileSize;
+
+    // Same order as the TileScheduler hands tiles out in
+    std::vector<std::pair<uint32_t, int>> codes;
+    for (int y = 0; y < tilesY; y++) {
+        for (int x = 0; x < mTilesX; x++) {
+            uint32_t code = TileScheduler::interleaveBits(x) | (TileScheduler::interleaveBits(y) << 1);
+            codes.push_back({ code, y * mTilesX + x });
+        }
+    }
+    std::sort(codes.begin(), codes.end());
+    mTileOfBlock.resize(codes.size());
+    mBlockOfTile.resize(codes.size());
+    for (size_t i = 0; i < codes.size(); i++) {
+        mTileOfBlock[codes[i].second] = i;
+        mBlockOfTile[i] = codes[i].second;
+    }
+
+    // FilmPixel is trivially destructible and every bit pattern of zeros is a cleared pixel,
+    // so the storage is left untouched until clear
+    size_t bytes = sizeof(FilmPixel) * numStoredPixels();
+    mPixels.reset(static_cast<FilmPixel*>(::operator new[](bytes, std::align_val_t(64))));
+}
+
+void Film::clear() {
+    std::memset(mPixels.get(), 0, sizeof(FilmPixel) * numStoredPixels());
+}
+
+void Film::clear(ThreadPool &pool) {
+    // One range of tiles per thread, the same split TileScheduler::reset starts its workers with.
+    // Which thread clears which range is up to the pool
+    int tiles = numTiles();
+    int ranges = pool.numThreads() + 1;
+    parallelFor(pool, ranges, 1, [&](int begin, int end) {
+        int first = static_cast<int64_t>(tiles) * begin / ranges;
+        int last = static_cast<int64_t>(tiles) * end / ranges;
+        std::memset(mPixels.get() + first * FilmTilePixels, 0, sizeof(FilmPixel) * (last - first) * FilmTilePixels);
+    });
+}
+
+void Film::merge(Film &other, ThreadPool &pool) {
+    parallelFor(pool, numTiles(), 4, [&](int begin, int end) {
+        for (int i = begin * FilmTilePixels; i < end * FilmTilePixels; i++) {
+            mPixels[i].add(other.mPixels[i]);
+        }
+        std::memset(other.mPixels.get() + begin * FilmTilePixels, 0, sizeof(FilmPixel) * (end - begin) * FilmTilePixels);
+    });
+}
+
+Tile Film::tileBounds(int tile) const {
+    int x = mBlockOfTile[tile] % mTilesX * FilmTileSize;
+    int y = mBlockOfTile[tile] / mTilesX * FilmTileSize;
+    return { x, y, std::min(x + FilmTileSize, mWidth), std::min(y + FilmTileSize, mHeight) };
+}
+
+float Film::tileError(int tile) const {
+    // Dark pixels are held to an absolute error instead, else they would never converge
+    const float MinLuminance = 1e-2f;
+    auto [x0, y0, x1, y1] = tileBounds(tile);
+    float error = 0.0f;
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            const auto &pixel = (*this)(x, y);
+            if (pixel.weight < 2.0f) {
+                return std::numeric_limits<float>::infinity();
+            }
+            float stdError = glm::sqrt(Math::luminance(pixel.variance()));
+            error += stdError / std::max(Math::luminance(pixel.mean()), MinLuminance);
+        }
+    }
+    return error / ((x1 - x0) * (y1 - y0));
+}
@@ -5,7 +5,7 @@ Vec2f ThinLensCamera::rasterPos(Ray ray) {
     float dFocus = mFocalDist / cosTheta;
     Vec3f pFocus = mTBNInv * (ray.get(dFocus) - mPos);
 
-    Vec2f filmSize(mFilm.width, mFilm.height);
+    Vec2f filmSize(mFilm.width(), mFilm.height());
     float aspect = filmSize.x / filmSize.y;
     float tanFOV = glm::tan(glm::radians(mFOV * 0.5f));
 
@@ -20,7 +20,7 @@ Ray ThinLensCamera::generateRay(SamplerPtr sampler) {
 }
 
 Ray ThinLensCamera::generateRay(Vec2f uv, SamplerPtr sampler) {
-    Vec2f filmSize(mFilm.width, mFilm.height);
+    Vec2f filmSize(mFilm.width(), mFilm.height());
     auto texelSize = Vec2f(1.0f) / filmSize;
     auto biased = uv + texelSize * sampler->get2();
     auto ndc = biased;
@@ -99,6 +99,6 @@ Spectrum ThinLensCamera::Ie(Ray ray) {
 
     float tanFOVInv = 1.0f / glm::tan(glm::radians(mFOV * 0.5f));
     float cos2Theta = cosTheta * cosTheta;
-    float aspect = static_cast<float>(mFilm.width) / mFilm.height;
+    float aspect = static_cast<float>(mFilm.width()) / mFilm.height();
     return Spectrum(tanFOVInv * tanFOVInv * 0.25f) / ((mIsDelta ? 1.0f : mLensArea) * cos2Theta * cos2Theta * aspect);
 }
\ No newline at end of file
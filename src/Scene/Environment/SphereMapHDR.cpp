@@ -1,45 +1,100 @@
 #include "Core/Environment.h"
 #include "Utils/ImageSave.h"
 
-EnvSphereMapHDR::EnvSphereMapHDR(const char *filePath) {
+EnvSphereMapHDR::EnvSphereMapHDR(const char *filePath, int samplingWidth) {
     mSphereMap = TextureLoader::fromF32x3(filePath);
     mWidth = mSphereMap->texWidth();
     mHeight = mSphereMap->texHeight();
+    buildDistrib(samplingWidth);
+}
+
+// Cells of the sampling map are weighted by the mean luminance of the pixels with their center in
+// the cell, times the sine of the cell center which is the relative solid angle of the cell.
+// Radiance is interpolated between neighboring pixels, so each pixel counts with the greatest
+// luminance around it, else a cell could have zero probability next to a bright pixel
+void EnvSphereMapHDR::buildDistrib(int samplingWidth) {
+    int width = (samplingWidth > 0) ? glm::min(samplingWidth, mWidth) : mWidth;
+    int height = glm::max(1, static_cast<int>(static_cast<int64_t>(mHeight) * width / mWidth));
 
-    float *pdf = new float[mWidth * mHeight];
-    float sum = 0.0f;
-    for (int j = 0; j < mHeight; j++) {
-        for (int i = 0; i < mWidth; i++) {
-            pdf[j * mWidth + i] = Math::luminance((*mSphereMap)(i, j)) * glm::sin((float)(j + 0.5f) / mHeight * Math::Pi);
-            sum += pdf[j * mWidth + i];
+    // Luminance of a row, maximized over horizontal neighbors. Rows wrap around like the lookups
+    double power = 0.0;
+    std::vector<float> row(mWidth);
+    auto dilatedRow = [&](int y, std::vector<float> &dilated) {
+        y = (y + mHeight) % mHeight;
+        const Vec3f *pixels = &(*mSphereMap)(0, y);
+        for (int x = 0; x < mWidth; x++) {
+            row[x] = Math::luminance(pixels[x]);
+        }
+        for (int x = 1; x < mWidth - 1; x++) {
+            dilated[x] = glm::max(row[x], glm::max(row[x - 1], row[x + 1]));
+        }
+        for (int x : { 0, mWidth - 1 }) {
+            dilated[x] = glm::max(row[x], glm::max(row[(x + mWidth - 1) % mWidth], row[(x + 1) % mWidth]));
+        }
+    };
+    auto addPower = [&](int y) {
+        double sum = 0.0;
+        for (int x = 0; x < mWidth; x++) {
+            sum += row[x];
         }
+        power += sum * glm::sin((y + 0.5f) / mHeight * Math::Pi);
+    };
+
+    std::vector<int> cellOfColumn(mWidth), columnsOfCell(width, 0), rowsOfCell(height, 0);
+    for (int x = 0; x < mWidth; x++) {
+        cellOfColumn[x] = static_cast<int64_t>(x) * width / mWidth;
+        columnsOfCell[cellOfColumn[x]]++;
     }
-    mDistrib = PiecewiseIndependent2D(pdf, mWidth, mHeight);
-    delete[] pdf;
-}
 
-EnvLiSample EnvSphereMapHDR::sampleLi(const Vec2f &u1, const Vec2f &u2) {
-    auto [col, row] = mDistrib.sample(u1, u2);
+    // Three dilated rows are kept at a time for the vertical maximum
+    std::vector<float> above(mWidth), center(mWidth), below(mWidth);
+    dilatedRow(-1, above);
+    dilatedRow(0, center);
+    addPower(0);
+    std::vector<float> weights(size_t(width) * height, 0.0f);
+    for (int y = 0; y < mHeight; y++) {
+        dilatedRow(y + 1, below);
+        if (y + 1 < mHeight) {
+            addPower(y + 1);
+        }
+        int cellY = static_cast<int64_t>(y) * height / mHeight;
+        rowsOfCell[cellY]++;
+        float *cells = &weights[size_t(cellY) * width];
+        for (int x = 0; x < mWidth; x++) {
+            cells[cellOfColumn[x]] += glm::max(center[x], glm::max(above[x], below[x]));
+        }
+        std::swap(above, center);
+        std::swap(center, below);
+    }
+    mPower = static_cast<float>(power);
 
-    float sinTheta = glm::sin(Math::Pi * (row + 0.5f) / mHeight);
-    auto wi = Transform::planeToSphere(Vec2f((col + 0.5f) / mWidth, (row + 0.5f) / mHeight));
-    //float pdf = getPortion(wi) * float(w * h) * 0.5f * Math::square(Math::PiInv) / sinTheta;
-    float pdf = pdfLi(wi);
+    for (int y = 0; y < height; y++) {
+        float sinTheta = glm::sin((y + 0.5f) / height * Math::Pi);
+        for (int x = 0; x < width; x++) {
+            int count = rowsOfCell[y] * columnsOfCell[x];
+            float &weight = weights[size_t(y) * width + x];
+            weight = (count > 0) ? weight / count * sinTheta : 0.0f;
+        }
+    }
+    mDistrib = Piecewise2D(std::move(weights), width, height);
+}
 
+EnvLiSample EnvSphereMapHDR::sampleLi(const Vec2f &u1, const Vec2f &u2) {
+    Vec2f uv = mDistrib.sample(u1, u2);
+    auto wi = Transform::planeToSphere(uv);
+    float sinTheta = glm::sin(uv.y * Math::Pi);
+    if (sinTheta <= 0.0f) {
+        return { wi, Spectrum(0.0f), 0.0f };
+    }
+    float pdf = mDistrib.pdf(uv) * 0.5f * Math::square(Math::PiInv) / sinTheta;
     return { wi, radiance(wi), pdf };
 }
 
+// The map covers the sphere with 2 pi^2 sin(theta) of solid angle per unit area
 float EnvSphereMapHDR::pdfLi(const Vec3f &wi) {
-    float sinTheta = glm::asin(glm::abs(wi.z));
-
-    if (sinTheta < 1e-6f) {
+    float sinTheta = glm::length(Vec2f(wi));
+    if (sinTheta <= 0.0f) {
         return 0.0f;
     }
-    float pdf = getPortion(wi) * float(mWidth * mHeight) * 0.5f * Math::square(Math::PiInv) /* sinTheta*/;
-
-    return (pdf == 0.0f) ? 0.0f : pdf;
+    return mDistrib.pdf(Transform::sphereToPlane(wi)) * 0.5f * Math::square(Math::PiInv) / sinTheta;
 }
-
-float EnvSphereMapHDR::getPortion(const Vec3f &wi) {
-    return Math::luminance(Spectrum(mSphereMap->getSpherical(wi))) / mDistrib.sum();
-}
\ No newline at end of file
@@ -25,6 +25,15 @@ float Light::pdfLi(const Vec3f &ref, const Vec3f &y) {
     return Math::distSquare(ref, y) / (surfaceArea() * cosTheta);
 }
 
+std::pair<Vec3f, float> Light::normalBounds() {
+    if (std::dynamic_pointer_cast<Sphere>(shape)) {
+        return { Vec3f(0.0f, 0.0f, 1.0f), -1.0f };
+    }
+    // Every other shape is flat
+    AABB box = bound();
+    return { normalGeom(box.centroid()), 1.0f };
+}
+
 Spectrum Light::Le(Ray ray) {
     if (glm::dot(normalGeom(ray.ori), ray.dir) <= 0.0f) {
         return Spectrum(0.0f);
@@ -44,6 +53,7 @@ LightLeSample Light::sampleLe(const std::array<float, 4> &u) {
 
 LightPdf Light::pdfLe(const Ray &ray) {
     float pdfPos = 1.0f / surfaceArea();
-    float pdfDir = (glm::dot(normalGeom(ray.ori), ray.dir) <= 0) ? 0 : 0.5f * Math::PiInv;
+    // Matches the cosine weighted directions of sampleLe
+    float pdfDir = Math::satDot(normalGeom(ray.ori), ray.dir) * Math::PiInv;
     return { pdfPos, pdfDir };
 }
\ No newline at end of file
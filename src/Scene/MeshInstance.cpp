@@ -0,0 +1,74 @@
+#include "Core/Object.h"
+#include "Utils/Error.h"
+
+MeshInstance::MeshInstance(TriangleMeshPtr mesh, BSDFPtr material, const Transform &transform) :
+    mMesh(mesh), Object(nullptr, material) {
+    mTransform = transform;
+    for (int i = 0; i < mesh->numTriangles(); i++) {
+        auto [va, vb, vc] = mesh->positions(i);
+        mMeshBound.expand(AABB(va, vb, vc));
+    }
+}
+
+SurfaceInfo MeshInstance::surfaceInfo(const Vec3f &x, int prim, const Vec2f &bary) {
+    Vec3f weights(1.0f - bary.x - bary.y, bary.x, bary.y);
+    Vec2f uv = mMesh->surfaceUV(prim, weights);
+    Vec3f ns = mTransform.getInversedNormal(mMesh->normalShading(prim, weights));
+    Vec3f ng = mTransform.getInversedNormal(mMesh->normalGeom(prim));
+    return SurfaceInfo({ uv.x, 1.0f - uv.y }, ns, ng, material);
+}
+
+std::optional<float> MeshInstance::closestHit(const Ray &ray) {
+    auto hit = primitiveHit(ray, 0);
+    return hit.has_value() ? hit->dist : std::optional<float>();
+}
+
+// Like MeshObject, points on an instance are only evaluated through surfaceInfo
+Vec3f MeshInstance::uniformSample(const Vec2f &u) {
+    Error::impossiblePath();
+    return Vec3f(0.0f);
+}
+
+Vec3f MeshInstance::normalGeom(const Vec3f &p) {
+    Error::impossiblePath();
+    return Vec3f(0.0f);
+}
+
+Vec3f MeshInstance::normalShading(const Vec3f &p) {
+    Error::impossiblePath();
+    return Vec3f(0.0f);
+}
+
+Vec2f MeshInstance::surfaceUV(const Vec3f &p) {
+    Error::impossiblePath();
+    return Vec2f(0.0f);
+}
+
+float MeshInstance::surfaceArea() {
+    Mat3f mat(mTransform.matrix);
+    float area = 0.0f;
+    for (int i = 0; i < mMesh->numTriangles(); i++) {
+        auto [va, vb, vc] = mMesh->positions(i);
+        area += 0.5f * glm::length(glm::cross(mat * (vb - va), mat * (vc - va)));
+    }
+    return area;
+}
+
+AABB MeshInstance::bound() {
+    return mTransform.getTransformedBox(mMeshBound);
+}
+
+std::optional<PrimitiveHit> MeshInstance::primitiveHit(const Ray &ray, int prim) {
+    return mMeshBvh->closestPrimitiveHit(toObjectSpace(ray));
+}
+
+bool MeshInstance::primitiveOccluded(const Ray &ray, int prim, float dist) {
+    return mMeshBvh->testIntersec(toObjectSpace(ray), dist);
+}
+
+Ray MeshInstance::toObjectSpace(const Ray &ray) const {
+    Ray objRay;
+    objRay.ori = mTransform.getInversed(ray.ori);
+    objRay.dir = Mat3f(mTransform.matInv) * ray.dir;
+    return objRay;
+}
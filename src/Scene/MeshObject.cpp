@@ -0,0 +1,81 @@
+#include "Core/Object.h"
+#include "Utils/Error.h"
+
+SurfaceInfo MeshObject::surfaceInfo(const Vec3f &x, int prim, const Vec2f &bary) {
+    Vec3f weights(1.0f - bary.x - bary.y, bary.x, bary.y);
+    Vec2f uv = mMesh->surfaceUV(prim, weights);
+    return SurfaceInfo({ uv.x, 1.0f - uv.y }, mMesh->normalShading(prim, weights), mMesh->normalGeom(prim), material);
+}
+
+std::optional<float> MeshObject::closestHit(const Ray &ray) {
+    std::optional<float> nearest;
+    for (int i = 0; i < mMesh->numTriangles(); i++) {
+        auto hit = primitiveHit(ray, i);
+        if (hit.has_value() && (!nearest.has_value() || hit->dist < nearest.value())) {
+            nearest = hit->dist;
+        }
+    }
+    return nearest;
+}
+
+// Points on a mesh are only evaluated through surfaceInfo with the primitive that was hit
+Vec3f MeshObject::uniformSample(const Vec2f &u) {
+    Error::impossiblePath();
+    return Vec3f(0.0f);
+}
+
+Vec3f MeshObject::normalGeom(const Vec3f &p) {
+    Error::impossiblePath();
+    return Vec3f(0.0f);
+}
+
+Vec3f MeshObject::normalShading(const Vec3f &p) {
+    Error::impossiblePath();
+    return Vec3f(0.0f);
+}
+
+Vec2f MeshObject::surfaceUV(const Vec3f &p) {
+    Error::impossiblePath();
+    return Vec2f(0.0f);
+}
+
+float MeshObject::surfaceArea() {
+    float area = 0.0f;
+    for (int i = 0; i < mMesh->numTriangles(); i++) {
+        area += mMesh->surfaceArea(i);
+    }
+    return area;
+}
+
+AABB MeshObject::bound() {
+    AABB box;
+    for (int i = 0; i < mMesh->numTriangles(); i++) {
+        box.expand(primitiveBound(i));
+    }
+    return box;
+}
+
+AABB MeshObject::primitiveBound(int prim) {
+    auto [va, vb, vc] = mMesh->positions(prim);
+    return AABB(va, vb, vc);
+}
+
+std::optional<PrimitiveHit> MeshObject::primitiveHit(const Ray &ray, int prim) {
+    auto [va, vb, vc] = mMesh->positions(prim);
+    auto hit = intersectTriangle(ray, va, vb, vc);
+    if (hit.has_value()) {
+        hit->prim = prim;
+    }
+    return hit;
+}
+
+AABB MeshObject::clippedBound(int prim, const AABB &box) {
+    auto [va, vb, vc] = mMesh->positions(prim);
+    Vec3f verts[] = { va, vb, vc };
+    return box.clipPolygon(verts, 3);
+}
+
+bool MeshObject::worldTriangle(int prim, Vec3f *verts) {
+    std::tie(verts[0], verts[1], verts[2]) = mMesh->positions(prim);
+    return true;
+}
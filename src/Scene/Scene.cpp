@@ -1,5 +1,12 @@
 #include "Core/Scene.h"
 #include "Utils/Error.h"
+#include "Utils/Timer.h"
+
+#include <atomic>
+
+// Rays a thread counts before adding them to the shared total
+const uint64_t RayCountBatch = 4096;
+static std::atomic<uint64_t> TotalRays = 0;
 
 Scene::Scene(const std::vector<HittablePtr> &hittables, EnvPtr environment, CameraPtr camera) :
     mHittables(hittables), mEnv(environment), mCamera(camera) {
@@ -17,13 +24,16 @@ void Scene::setupLightSampleTable() {
         lightPdf.push_back(pdf);
     }
     mLightDistrib = Piecewise1D(lightPdf);
+    if (mLightSampleStrategy == LightSampleStrategy::BVH) {
+        mLightBvh = LightBVH(mLights);
+    }
 }
 
 std::optional<LightSample> Scene::sampleOneLight(Vec2f u) {
     if (mLights.size() == 0) {
         return std::nullopt;
     }
-    bool sampleByPower = mLightSampleStrategy == LightSampleStrategy::ByPower;
+    bool sampleByPower = mLightSampleStrategy != LightSampleStrategy::Uniform;
     int index = sampleByPower ? mLightDistrib.sample(u) : static_cast<int>(mLights.size() * u.x);
 
     auto lt = mLights[index];
@@ -31,15 +41,25 @@ std::optional<LightSample> Scene::sampleOneLight(Vec2f u) {
     return LightSample{ lt, pdf };
 }
 
+std::optional<LightSample> Scene::sampleOneLight(const Vec3f &x, const Vec3f &n, Vec2f u) {
+    if (mLightSampleStrategy != LightSampleStrategy::BVH) {
+        return sampleOneLight(u);
+    }
+    auto sample = mLightBvh.sample(x, n, u.x);
+    if (!sample) {
+        return std::nullopt;
+    }
+    auto [index, pdf] = sample.value();
+    return LightSample{ mLights[index], pdf };
+}
+
 LightEnvSample Scene::sampleLightAndEnv(Vec2f u1, float u2) {
     auto lightSample = sampleOneLight(u1);
     if (!lightSample) {
         return { mEnv, 1.0f };
     }
 
-    float pdfSampleLight = mLightAndEnvStrategy == LightSampleStrategy::ByPower ?
-        mLightDistrib.sum() / powerlightAndEnv() :
-        0.5f;
+    float pdfSampleLight = pdfSelectLight();
     auto [lt, pdfLight] = lightSample.value();
 
     if (u2 > pdfSampleLight) {
@@ -50,12 +70,12 @@ LightEnvSample Scene::sampleLightAndEnv(Vec2f u1, float u2) {
     }
 }
 
-LiSample Scene::sampleLiOneLight(const Vec3f &x, const Vec2f &u1, const Vec2f &u2) {
-    if (mLights.size() == 0) {
+LiSample Scene::sampleLiOneLight(const Vec3f &x, const Vec3f &n, const Vec2f &u1, const Vec2f &u2,
+    ShadowRay *shadow) {
+    auto lightSample = sampleOneLight(x, n, u1);
+    if (!lightSample) {
         return InvalidLiSample;
     }
-    
-    auto lightSample = sampleOneLight(u1);
     auto [lt, pdfSample] = lightSample.value();
 
     auto liSample = lt->sampleLi(x, u2);
@@ -65,32 +85,39 @@ LiSample Scene::sampleLiOneLight(const Vec3f &x, const Vec2f &u1, const Vec2f &u
     auto [wi, weight, dist, pdf] = liSample.value();
 
     auto lightRay = Ray(x, wi).offset();
-    float testDist = dist - 1e-4f - 1e-6f;
+    float testDist = (dist - RayOffset) * (1.0f - ShadowRayEpsilon);
 
-    if (mBvh->testIntersec(lightRay, testDist) || pdf < 1e-8f) {
+    if (pdf < 1e-8f) {
+        return InvalidLiSample;
+    }
+    if (shadow != nullptr) {
+        *shadow = { lightRay, testDist };
+    }
+    else if (quickIntersect(lightRay, testDist)) {
         return InvalidLiSample;
     }
     pdf *= pdfSample;
     return { wi, weight / pdf, pdf };
 }
 
-LiSample Scene::sampleLiEnv(const Vec3f &x, const Vec2f &u1, const Vec2f &u2) {
+LiSample Scene::sampleLiEnv(const Vec3f &x, const Vec2f &u1, const Vec2f &u2, ShadowRay *shadow) {
     auto [wi, weight, pdf] = mEnv->sampleLi(u1, u2);
+    if (pdf == 0.0f) {
+        return InvalidLiSample;
+    }
     auto ray = Ray(x, wi).offset();
-    if (quickIntersect(ray, 1e30f)) {
+    if (shadow != nullptr) {
+        *shadow = { ray, 1e30f };
+    }
+    else if (quickIntersect(ray, 1e30f)) {
         return InvalidLiSample;
     }
     return { wi, weight / pdf, pdf };
 }
 
-LiSample Scene::sampleLiLightAndEnv(const Vec3f &x, const std::array<float, 5> &sample) {
-    float pdfSampleLight = 0.0f;
-
-    if (mLights.size() > 0) {
-        pdfSampleLight = mLightAndEnvStrategy == LightSampleStrategy::ByPower ?
-            mLightDistrib.sum() / powerlightAndEnv() :
-            0.5f;
-    }
+LiSample Scene::sampleLiLightAndEnv(const Vec3f &x, const Vec3f &n, const std::array<float, 5> &sample,
+    ShadowRay *shadow) {
+    float pdfSampleLight = pdfSelectLight();
 
     bool sampleLight = sample[0] < pdfSampleLight;
     float pdfSelect = sampleLight ? pdfSampleLight : 1.0f - pdfSampleLight;
@@ -98,7 +125,7 @@ LiSample Scene::sampleLiLightAndEnv(const Vec3f &x, const std::array<float, 5> &
     Vec2f u1(sample[1], sample[2]);
     Vec2f u2(sample[3], sample[4]);
 
-    auto [wi, coef, pdf] = sampleLight ? sampleLiOneLight(x, u1, u2) : sampleLiEnv(x, u1, u2);
+    auto [wi, coef, pdf] = sampleLight ? sampleLiOneLight(x, n, u1, u2, shadow) : sampleLiEnv(x, u1, u2, shadow);
     return { wi, coef / pdfSelect, pdf * pdfSelect };
 }
 
@@ -112,26 +139,28 @@ LeSample Scene::sampleLeOneLight(const std::array<float, 6> &sample) {
 
 LeSample Scene::sampleLeEnv(const std::array<float, 6> &sample) {
     auto [wi, Le, pdfDir] = mEnv->sampleLi({ sample[0], sample[1] }, { sample[2], sample[3] });
-    Vec3f ori(Transform::toConcentricDisk({ sample[4], sample[5] }), 0.0f);
-    
-    ori = mBound.centroid() + Transform::localToWorld(wi, ori * mBoundRadius);
+    if (pdfDir == 0.0f) {
+        return { Ray(), Spectrum(0.0f), 0.0f };
+    }
+    Vec3f ori(Transform::toConcentricDisk({ sample[4], sample[5] }) * mBoundRadius, 0.0f);
+    ori = mBound.centroid() + wi * mBoundRadius + Transform::localToWorld(wi, ori);
     float pdfPos = Math::PiInv / (mBoundRadius * mBoundRadius);
-    return { { ori, wi }, Le, pdfPos * pdfDir };
+    return { { ori, -wi }, Le, pdfPos * pdfDir };
 }
 
 LeSample Scene::sampleLeLightAndEnv(const std::array<float, 7> &sample) {
-    float pdfSelectLight = 0.0f;
-    if (mLights.size() > 0) {
-        pdfSelectLight = mLightAndEnvStrategy == LightSampleStrategy::ByPower ?
-            mLightDistrib.sum() / powerlightAndEnv() :
-            0.5f;
-    }
-    bool selectLight = sample[0] < pdfSelectLight;
-    float pdfSelect = selectLight ? pdfSelectLight : 1.0f - pdfSelectLight;
+    float pdfLight = pdfSelectLight();
+    bool selectLight = sample[0] < pdfLight;
+    float pdfSelect = selectLight ? pdfLight : 1.0f - pdfLight;
 
-    return selectLight ?
+    auto [ray, Le, pdf] = selectLight ?
         sampleLeOneLight(*reinterpret_cast<const std::array<float, 6>*>(&sample[1])) :
         sampleLeEnv(*reinterpret_cast<const std::array<float, 6>*>(&sample[1]));
+    return { ray, Le, pdf * pdfSelect };
+}
+
+LightPdf Scene::pdfLeEnv(const Vec3f &dir) {
+    return { Math::PiInv / (mBoundRadius * mBoundRadius), mEnv->pdfLi(-dir) };
 }
 
 float Scene::pdfSampleLight(Light *lt) {
@@ -139,21 +168,31 @@ float Scene::pdfSampleLight(Light *lt) {
         return 0.0f;
     }
 
-    float fstPdf = mLightSampleStrategy == LightSampleStrategy::ByPower ?
+    float fstPdf = mLightSampleStrategy != LightSampleStrategy::Uniform ?
         lt->luminance() / mLightDistrib.sum() :
         1.0f / mLights.size();
+    return fstPdf * pdfSelectLight();
+}
+
+float Scene::pdfSampleLight(Light *lt, const Vec3f &x, const Vec3f &n) {
+    if (mLightSampleStrategy != LightSampleStrategy::BVH) {
+        return pdfSampleLight(lt);
+    }
+    return mLightBvh.pdf(x, n, lt) * pdfSelectLight();
+}
 
-    float sndPdf = mLightAndEnvStrategy == LightSampleStrategy::ByPower ?
+float Scene::pdfSelectLight() {
+    if (mLights.size() == 0) {
+        return 0.0f;
+    }
+    return mLightAndEnvStrategy == LightSampleStrategy::ByPower ?
         mLightDistrib.sum() / powerlightAndEnv() :
         0.5f;
-
-    return fstPdf * sndPdf;
 }
 
 float Scene::pdfSampleEnv() {
-    return mLightAndEnvStrategy == LightSampleStrategy::ByPower ?
-        mEnv->power() / (mLightDistrib.sum() + mEnv->power()) :
-        0.5f;
+    // The environment is always taken when there are no lights
+    return 1.0f - pdfSelectLight();
 }
 
 IiSample Scene::sampleIiCamera(Vec3f x, Vec2f u) {
@@ -164,9 +203,9 @@ IiSample Scene::sampleIiCamera(Vec3f x, Vec2f u) {
     auto [wi, imp, dist, uv, pdf] = sample.value();
 
     auto camRay = Ray(x, wi).offset();
-    float testDist = dist - 1e-4f - 1e-6f;
+    float testDist = (dist - RayOffset) * (1.0f - ShadowRayEpsilon);
 
-    if (mBvh->testIntersec(camRay, testDist) || pdf < 1e-8f) {
+    if (quickIntersect(camRay, testDist) || pdf < 1e-8f) {
         return InvalidIiSample;
     }
     return { wi, imp / pdf, pdf };
@@ -176,14 +215,14 @@ bool Scene::isLightOrEnv(HittablePtr obj) {
     return (!obj) || (obj->type() == HittableType::Light);
 }
 
-float Scene::pdfL(HittablePtr obj, Vec3f refPos, Vec3f hitPos, Vec3f refToLight) {
+float Scene::pdfL(HittablePtr obj, Vec3f refPos, Vec3f refNormal, Vec3f hitPos, Vec3f refToLight) {
     if (!obj) {
         return mEnv->pdfLi(refToLight) * pdfSampleEnv();
     }
     else if (obj->type() == HittableType::Light) {
         float weight = 1.0f;
         auto light = dynamic_cast<Light*>(obj.get());
-        return light->pdfLi(refPos, hitPos) * pdfSampleLight(light);
+        return light->pdfLi(refPos, hitPos) * pdfSampleLight(light, refPos, refNormal);
     }
     else {
         return 0.f;
@@ -203,10 +242,32 @@ Spectrum Scene::L(HittablePtr obj, Vec3f refPos, Vec3f hitPos, Vec3f refToLight)
     }
 }
 
-void Scene::buildScene() {
+void Scene::buildScene(ThreadPool &pool) {
     Error::bracketLine<0>("Scene building");
-    mBvh = std::make_shared<BVH>(mHittables);
-    Error::bracketLine<1>("BVH size = " + std::to_string(mBvh->size()) + ", depth = " + std::to_string(mBvh->depth()));
+    Timer timer;
+    int numInstances = 0;
+    for (const auto &hittable : mHittables) {
+        auto instance = dynamic_cast<MeshInstance*>(hittable.get());
+        if (instance == nullptr) {
+            continue;
+        }
+        numInstances++;
+        auto &meshBvh = mMeshBvhs[instance->mesh().get()];
+        if (meshBvh == nullptr) {
+            std::vector<HittablePtr> meshObject = { std::make_shared<MeshObject>(instance->mesh(), nullptr) };
+            meshBvh = std::make_shared<BVH>(meshObject, mBVHSplitMethod, mSpatialSplitBudget, &pool);
+        }
+        instance->setMeshBvh(meshBvh);
+    }
+    if (numInstances > 0) {
+        Error::bracketLine<1>("Mesh BVHs = " + std::to_string(mMeshBvhs.size()) + ", instances = " +
+            std::to_string(numInstances) + ", built in " + std::to_string(timer.get()) + "s");
+    }
+    timer.reset();
+    mBvh = std::make_shared<BVH>(mHittables, mBVHSplitMethod, mSpatialSplitBudget, &pool);
+    Error::bracketLine<1>("BVH built in " + std::to_string(timer.get()) + "s");
+    Error::bracketLine<1>("BVH size = " + std::to_string(mBvh->size()) + ", depth = " + std::to_string(mBvh->depth()) +
+        ", SAH cost = " + std::to_string(mBvh->sahCost()) + ", references = " + std::to_string(mBvh->numReferences()));
     setupLightSampleTable();
     Error::bracketLine<1>("Lights num = " + std::to_string(mLights.size()));
     mBound = mBvh->box();
@@ -218,60 +279,42 @@ void Scene::addLight(LightPtr light) {
     mHittables.push_back(light);
 }
 
-void Scene::addObjectMesh(const char *path, const Transform& transform, BSDFPtr material) {
-    auto [vertices, texcoords, normals] = ObjReader::readFile(path);
-    int faceCount = vertices.size() / 3;
-    bool hasTexcoord = texcoords.size() > 0;
-
-    for (int i = 0; i < faceCount; i++) {
-        Vec3f v[] = { vertices[i * 3 + 0], vertices[i * 3 + 1], vertices[i * 3 + 2] };
-        Vec3f n[] = { normals[i * 3 + 0], normals[i * 3 + 1], normals[i * 3 + 2] };
-        Vec2f t[3] = { { 0.0f, 0.0f }, { 1.0f, 0.0f }, { 0.0f, 1.0f } };
-        if (hasTexcoord) {
-            memcpy(t, &texcoords[i * 3], 3 * sizeof(Vec2f));
-        }
-
-        auto tr = std::make_shared<MeshTriangle>(v, t, n);
-        tr->setTransform(transform);
-        mHittables.push_back(std::make_shared<Object>(tr, material));
+MeshInstancePtr Scene::addObjectMesh(const char *path, const Transform& transform, BSDFPtr material) {
+    auto &mesh = mMeshes[path];
+    if (mesh == nullptr) {
+        auto [vertices, texcoords, normals, indices] = ObjReader::readFile(path);
+        mesh = std::make_shared<TriangleMesh>(vertices, texcoords, normals, indices, Transform());
     }
+    auto instance = std::make_shared<MeshInstance>(mesh, material, transform);
+    mHittables.push_back(instance);
+    return instance;
 }
 
-void Scene::addLightMesh(const char *path, const Transform& transform, const Spectrum &power) {
-    auto [vertices, texcoords, normals] = ObjReader::readFile(path);
-    int faceCount = vertices.size() / 3;
+void Scene::addLightMesh(const char *path, const Transform& transform, const Spectrum &power, bool castsShadows) {
+    auto [vertices, texcoords, normals, indices] = ObjReader::readFile(path);
+    auto mesh = std::make_shared<TriangleMesh>(vertices, texcoords, normals, indices, transform);
 
+    std::vector<std::shared_ptr<MeshTriangle>> triangles;
     float sumArea = 0.0f;
-    for (int i = 0; i < faceCount; i++) {
-        Vec3f a = transform.get(vertices[i * 3 + 0]);
-        Vec3f b = transform.get(vertices[i * 3 + 1]);
-        Vec3f c = transform.get(vertices[i * 3 + 2]);
-        sumArea += glm::length(glm::cross(c - a, b - a));
+    for (int i = 0; i < mesh->numTriangles(); i++) {
+        triangles.push_back(std::make_shared<MeshTriangle>(mesh, i));
+        sumArea += triangles.back()->surfaceArea();
     }
 
-    for (int i = 0; i < faceCount; i++) {
-        Vec3f v[] = { vertices[i * 3 + 0], vertices[i * 3 + 1], vertices[i * 3 + 2] };
-        Vec3f n[] = { normals[i * 3 + 0], normals[i * 3 + 1], normals[i * 3 + 2] };
-        Vec2f t[3];
-
-        Vec3f a = transform.get(v[0]);
-        Vec3f b = transform.get(v[1]);
-        Vec3f c = transform.get(v[2]);
-        Vec3f triPower = power * glm::length(glm::cross(c - a, b - a)) / sumArea;
-
-        auto tr = std::make_shared<Light>(std::make_shared<MeshTriangle>(v, t, n), triPower, false);
-
-        tr->setTransform(transform);
+    for (const auto &triangle : triangles) {
+        Vec3f triPower = power * triangle->surfaceArea() / sumArea;
+        auto tr = std::make_shared<Light>(triangle, triPower, false);
+        tr->setCastsShadows(castsShadows);
         mHittables.push_back(tr);
         mLights.push_back(tr);
     }
 }
 
 bool Scene::visible(Vec3f x, Vec3f y) {
-    float dist = glm::distance(x, y) - 2e-5f;
+    float dist = (glm::distance(x, y) - 2e-5f) * (1.0f - ShadowRayEpsilon);
     Vec3f wi = glm::normalize(y - x);
     Ray ray(x + wi * 1e-5f, wi);
-    return !mBvh->testIntersec(ray, dist);
+    return !quickIntersect(ray, dist);
 }
 
 float Scene::v(Vec3f x, Vec3f y) {
@@ -286,4 +329,16 @@ float Scene::g(Vec3f x, Vec3f y, Vec3f Nx, Vec3f Ny) {
     float r = glm::length(w);
     w /= r;
     return Math::satDot(Nx, w) * Math::satDot(Ny, -w) / (r * r);
-}
\ No newline at end of file
+}
+uint64_t Scene::numRays() {
+    return TotalRays;
+}
+
+void Scene::countRays(int count) {
+    thread_local uint64_t batch = 0;
+    batch += count;
+    if (batch >= RayCountBatch) {
+        TotalRays += batch;
+        batch = 0;
+    }
+}
@@ -1,30 +1,52 @@
 #include "Core/Shape.h"
+#include "Utils/Error.h"
 
-Vec3f MeshTriangle::normalShading(const Vec3f &p) {
-    auto [va, vb, vc] = triangle.vertices();
-    Vec3f oriP = triangle.getTransform().getInversed(p);
+std::optional<float> MeshTriangle::closestHit(const Ray &ray) {
+    auto [va, vb, vc] = mMesh->positions(mIndex);
+    auto hit = intersectTriangle(ray, va, vb, vc);
+    return hit ? hit->dist : std::optional<float>();
+}
 
-    float areaInv = 1.0f / glm::length(glm::cross(vb - va, vc - va));
-    float la = glm::length(glm::cross(vb - oriP, vc - oriP)) * areaInv;
-    float lb = glm::length(glm::cross(vc - oriP, va - oriP)) * areaInv;
-    float lc = glm::length(glm::cross(va - oriP, vb - oriP)) * areaInv;
+Vec3f MeshTriangle::uniformSample(const Vec2f &u) {
+    auto [va, vb, vc] = mMesh->positions(mIndex);
+    float r = glm::sqrt(u.y);
+    float a = 1.0f - r;
+    float b = u.x * r;
+    return va * (1.0f - a - b) + vb * a + vc * b;
+}
 
-    return glm::normalize(triangle.getTransform().getInversedNormal(na * la + nb * lb + nc * lc));
+Vec3f MeshTriangle::normalGeom(const Vec3f &p) {
+    return mMesh->normalGeom(mIndex);
+}
+
+Vec3f MeshTriangle::normalShading(const Vec3f &p) {
+    return mMesh->normalShading(mIndex, mMesh->barycentric(mIndex, p));
+}
+
+float MeshTriangle::surfaceArea() {
+    return mMesh->surfaceArea(mIndex);
 }
 
 Vec2f MeshTriangle::surfaceUV(const Vec3f &p) {
-    auto [va, vb, vc] = triangle.vertices();
-    Vec3f oriP = triangle.getTransform().getInversed(p);
+    return mMesh->surfaceUV(mIndex, mMesh->barycentric(mIndex, p));
+}
+
+AABB MeshTriangle::bound() {
+    auto [va, vb, vc] = mMesh->positions(mIndex);
+    return AABB(va, vb, vc);
+}
 
-    float areaInv = 1.0f / glm::length(glm::cross(vb - va, vc - va));
-    float la = glm::length(glm::cross(vb - oriP, vc - oriP)) * areaInv;
-    float lb = glm::length(glm::cross(vc - oriP, va - oriP)) * areaInv;
-    float lc = glm::length(glm::cross(va - oriP, vb - oriP)) * areaInv;
+AABB MeshTriangle::clippedBound(int prim, const AABB &box) {
+    auto [va, vb, vc] = mMesh->positions(mIndex);
+    Vec3f verts[] = { va, vb, vc };
+    return box.clipPolygon(verts, 3);
+}
 
-    return ta * la + tb * lb + tc * lc;
+bool MeshTriangle::worldTriangle(int prim, Vec3f *verts) {
+    std::tie(verts[0], verts[1], verts[2]) = mMesh->positions(mIndex);
+    return true;
 }
 
-void MeshTriangle::setTransform(const Transform& trans) {
-    mTransform = trans;
-    triangle.setTransform(trans);
-}
\ No newline at end of file
+void MeshTriangle::setTransform(const Transform &trans) {
+    Error::exit("MeshTriangle can't be transformed, transform its TriangleMesh instead");
+}
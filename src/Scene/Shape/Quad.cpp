@@ -1,23 +1,17 @@
 #include "Core/Shape.h"
 
 std::optional<float> Quad::closestHit(const Ray &ray) {
-    Vec3f o = mTransform.getInversed(ray.ori);
-    Vec3f d = mTransform.getInversed(ray.ori + ray.dir) - o;
-
-    Ray inversedRay = {o, d};
+    // Not normalized, so that the distance stays in the parameter space of the world ray
+    Ray inversedRay;
+    inversedRay.ori = mTransform.getInversed(ray.ori);
+    inversedRay.dir = mTransform.getInversed(ray.ori + ray.dir) - inversedRay.ori;
     Vec3f vd = vb + vc - va;
 
-    auto ha = Triangle(va, vb, vc).closestHit(inversedRay);
-    auto hb = Triangle(vc, vb, vd).closestHit(inversedRay);
-
-    if (ha.has_value()) {
-        return ha;
-    }
-    if (hb.has_value()) {
-        return hb;
+    auto hit = intersectTriangle(inversedRay, va, vb, vc);
+    if (!hit) {
+        hit = intersectTriangle(inversedRay, vc, vb, vd);
     }
-
-    return std::nullopt;
+    return hit ? hit->dist : std::optional<float>();
 }
 
 Vec3f Quad::uniformSample(const Vec2f &u) {
@@ -39,4 +33,12 @@ AABB Quad::bound() {
     Vec3f pc = mTransform.get(vc);
     Vec3f pd = pb + pc - pa;
     return AABB(AABB(pa, pb, pc), AABB(pb, pc, pd));
+}
+
+AABB Quad::clippedBound(int prim, const AABB &box) {
+    Vec3f pa = mTransform.get(va);
+    Vec3f pb = mTransform.get(vb);
+    Vec3f pc = mTransform.get(vc);
+    Vec3f verts[] = { pa, pb, pb + pc - pa, pc };
+    return box.clipPolygon(verts, 4);
 }
\ No newline at end of file
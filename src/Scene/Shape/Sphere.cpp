@@ -13,7 +13,7 @@ std::optional<float> Sphere::closestHit(const Ray &ray) {
         return std::nullopt;
     }
 
-    float q = sqrt(glm::max(r * r - e * e, 0.0f));
+    float q = sqrt(glm::max(r * r - e * e, 0.0f)) / glm::length(d);
     // 想不到吧，r * r - e * e还是可能小于0
     if (glm::length(o - c) < r) {
         if (!intersectFromInside)
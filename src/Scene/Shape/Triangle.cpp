@@ -1,42 +1,51 @@
 #include "Core/Shape.h"
 
-std::optional<float> Triangle::closestHit(const Ray &ray){
-    const float eps = 1e-6;
-
-    Vec3f ab = vb - va;
-    Vec3f ac = vc - va;
-
-    Vec3f o = mTransform.getInversed(ray.ori);
-    Vec3f d = mTransform.getInversed(ray.ori + ray.dir) - o;
-
-    Vec3f p = glm::cross(d, ac);
-
-    float det = glm::dot(ab, p);
-
-    if (glm::abs(det) < eps) {
-        return std::nullopt;
+std::optional<PrimitiveHit> intersectTriangle(const Ray &ray, const Vec3f &va, const Vec3f &vb, const Vec3f &vc) {
+    // Permute the axes so that the ray travels along +z, then shear the triangle
+    // so that the ray becomes the z axis and the test reduces to 2D edge functions
+    int kz = Math::maxExtent(glm::abs(ray.dir));
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if (ray.dir[kz] < 0.0f) {
+        std::swap(kx, ky);
     }
-    Vec3f ao = o - va;
-
-    if (det < 0.0f) {
-        ao = -ao;
-        det = -det;
+    float sx = ray.dir[kx] / ray.dir[kz];
+    float sy = ray.dir[ky] / ray.dir[kz];
+    float sz = 1.0f / ray.dir[kz];
+
+    Vec3f a = va - ray.ori;
+    Vec3f b = vb - ray.ori;
+    Vec3f c = vc - ray.ori;
+    float ax = a[kx] - sx * a[kz];
+    float ay = a[ky] - sy * a[kz];
+    float bx = b[kx] - sx * b[kz];
+    float by = b[ky] - sy * b[kz];
+    float cx = c[kx] - sx * c[kz];
+    float cy = c[ky] - sy * c[kz];
+
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+    if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f)) {
+        return std::nullopt;
     }
-    float u = glm::dot(ao, p);
-
-    if (u < 0.0f || u > det) {
+    float det = u + v + w;
+    if (det == 0.0f) {
         return std::nullopt;
     }
-
-    Vec3f q = glm::cross(ao, ab);
-
-    float v = glm::dot(d, q);
-    if (v < 0.0f || u + v > det) {
+    float t = (u * a[kz] + v * b[kz] + w * c[kz]) * sz / det;
+    if (t <= 0.0f) {
         return std::nullopt;
     }
+    return PrimitiveHit{ t, Vec2f(v / det, w / det) };
+}
 
-    float t = glm::dot(ac, q) / det;
-    return t > 0.0f ? t : std::optional<float>();
+std::optional<float> Triangle::closestHit(const Ray &ray) {
+    Ray inversedRay;
+    inversedRay.ori = mTransform.getInversed(ray.ori);
+    inversedRay.dir = mTransform.getInversed(ray.ori + ray.dir) - inversedRay.ori;
+    auto hit = intersectTriangle(inversedRay, va, vb, vc);
+    return hit ? hit->dist : std::optional<float>();
 }
 
 Vec3f Triangle::uniformSample(const Vec2f &u) {
@@ -68,4 +77,16 @@ Vec2f Triangle::surfaceUV(const Vec3f &p) {
 
 AABB Triangle::bound() {
     return AABB(mTransform.get(va), mTransform.get(vb), mTransform.get(vc));
-}
\ No newline at end of file
+}
+
+AABB Triangle::clippedBound(int prim, const AABB &box) {
+    Vec3f verts[] = { mTransform.get(va), mTransform.get(vb), mTransform.get(vc) };
+    return box.clipPolygon(verts, 3);
+}
+
+bool Triangle::worldTriangle(int prim, Vec3f *verts) {
+    verts[0] = mTransform.get(va);
+    verts[1] = mTransform.get(vb);
+    verts[2] = mTransform.get(vc);
+    return true;
+}
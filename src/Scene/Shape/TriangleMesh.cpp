@@ -0,0 +1,51 @@
+#include "Core/TriangleMesh.h"
+
+TriangleMesh::TriangleMesh(const std::vector<Vec3f> &vertices, const std::vector<Vec2f> &texcoords,
+    const std::vector<Vec3f> &normals, const std::vector<uint32_t> &indices, const Transform &transform) :
+    mIndices(indices) {
+    mPositions.resize(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+        mPositions[i] = transform.get(vertices[i]);
+    }
+    if (normals.size() == vertices.size()) {
+        mNormals.resize(normals.size());
+        for (size_t i = 0; i < normals.size(); i++) {
+            mNormals[i] = transform.matInvT * normals[i];
+        }
+    }
+    if (texcoords.size() == vertices.size()) {
+        mTexcoords = texcoords;
+    }
+}
+
+Vec3f TriangleMesh::normalGeom(int index) const {
+    auto [va, vb, vc] = positions(index);
+    return glm::normalize(glm::cross(vb - va, vc - va));
+}
+
+Vec3f TriangleMesh::normalShading(int index, const Vec3f &bary) const {
+    if (!hasNormals()) {
+        return normalGeom(index);
+    }
+    auto [na, nb, nc] = normals(index);
+    return glm::normalize(na * bary.x + nb * bary.y + nc * bary.z);
+}
+
+Vec2f TriangleMesh::surfaceUV(int index, const Vec3f &bary) const {
+    auto [ta, tb, tc] = texcoords(index);
+    return ta * bary.x + tb * bary.y + tc * bary.z;
+}
+
+float TriangleMesh::surfaceArea(int index) const {
+    auto [va, vb, vc] = positions(index);
+    return 0.5f * glm::length(glm::cross(vc - va, vb - va));
+}
+
+Vec3f TriangleMesh::barycentric(int index, const Vec3f &p) const {
+    auto [va, vb, vc] = positions(index);
+    float areaInv = 1.0f / glm::length(glm::cross(vb - va, vc - va));
+    float la = glm::length(glm::cross(vb - p, vc - p)) * areaInv;
+    float lb = glm::length(glm::cross(vc - p, va - p)) * areaInv;
+    float lc = glm::length(glm::cross(va - p, vb - p)) * areaInv;
+    return Vec3f(la, lb, lc);
+}
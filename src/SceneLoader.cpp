@@ -602,4 +602,27 @@ ScenePtr setupScene(int windowWidth, int windowHeight)
     auto scene = materialTest();
     scene->mCamera->initFilm(windowWidth, windowHeight);
     return scene;
-}
\ No newline at end of file
+}
+
+ScenePtr setupScene(const std::string &name, int width, int height)
+{
+    ScenePtr scene;
+    if (name == "bidir")
+        scene = bidirScene();
+    else if (name == "box")
+        scene = boxScene();
+    else if (name == "material")
+        scene = materialTest();
+    else if (name == "cornell")
+        scene = cornellBox();
+    else if (name == "original")
+        scene = originalBox();
+    else if (name == "fireplace")
+        scene = fireplace(false, true);
+    else if (name == "staircase2")
+        scene = staircase2();
+    else
+        return nullptr;
+    scene->mCamera->initFilm(width, height);
+    return scene;
+}
@@ -1,14 +1,24 @@
 #include "Core/BSDF.h"
 
+// One sided, reflects only when both directions are above the surface
 Spectrum LambertBSDF::bsdf(Vec3f wo, Vec3f wi, Vec2f uv, TransportMode mode, Params params) const {
+    if (wo.z <= 0.0f || wi.z <= 0.0f) {
+        return Spectrum(0.0f);
+    }
     return albedo.get(uv) * Math::PiInv;
 }
 
 float LambertBSDF::pdf(Vec3f wo, Vec3f wi, Vec2f uv, TransportMode mode, Params params) const {
+    if (wo.z <= 0.0f || wi.z <= 0.0f) {
+        return 0.0f;
+    }
     return wi.z * Math::PiInv;
 }
 
 std::optional<BSDFSample> LambertBSDF::sample(Vec3f wo, Vec2f uv, TransportMode mode, Sampler* sampler, BSDFType component) const {
+    if (wo.z <= 0.0f) {
+        return std::nullopt;
+    }
     Vec3f wi = Math::sampleHemisphereCosine(sampler->get2());
     return BSDFSample(wi, albedo.get(uv) * Math::PiInv, wi.z * Math::PiInv, BSDFType::Diffuse | BSDFType::Reflection);
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 #include "Zillum.h"
 #include "Core/ToneMapping.h"
 
+// Threads of the render, the GUI has no option for it
+const int ZillumThreads = 20;
+
 void Zillum::init(const std::string &name, HINSTANCE instance, const char *cmdParam) {
     Error::bracketLine<0>(cmdParam);
     //MessageBox(nullptr, name.c_str(), "AA", MB_ICONASTERISK);
@@ -86,8 +89,6 @@ void Zillum::init(const std::string &name, HINSTANCE instance, const char *cmdPa
         integ->mParam.rrLightPath = true;
         integ->mParam.maxLightDepth = maxDepth;
         integ->mParam.maxConnectDepth = maxDepth;
-        //integ->mLightSampler = std::make_shared<SimpleSobolSampler>(UniformUint(), false);
-        integ->mLightSampler = std::make_shared<IndependentSampler>();
         mIntegrator = integ;
         scramble = true;
     }
@@ -139,9 +140,17 @@ void Zillum::init(const std::string &name, HINSTANCE instance, const char *cmdPa
     else {
         mIntegrator->mSampler = std::make_shared<SobolSampler>(0, scramble);
     }
-    mIntegrator->mThreads = 20;
-
-    mTimer.reset();
+    mIntegrator->mThreads = ZillumThreads;
+    mIntegrator->mPool = mPool;
+    // The film is only allocated by the scene, a reset clears it
+    mIntegrator->reset();
+
+    mSession = std::make_unique<RenderSession>(mIntegrator, mBudget, [](const RenderProgress &progress) {
+        std::cout << "  " << progress.elapsed << "s, " << progress.raysPerSecond * 1e-6 << " Mrays/s";
+        if (progress.remaining >= 0.0) {
+            std::cout << ", " << progress.remaining << "s left";
+        }
+    });
 }
 
 LRESULT Zillum::process(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
@@ -251,14 +260,13 @@ LRESULT Zillum::process(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
 bool Zillum::render() {
     processKey();
 
-    if (!mIntegrator->isFinished()) {
-        mIntegrator->renderOnePass();
-        std::cout << "  " << mTimer.get() << "s"; 
+    bool rendered = mSession->renderPass();
+    if (rendered) {
         writeBuffer();
     }
     flushScreen();
 
-    if (mIntegrator->isFinished() /*|| mTimer.get() >= 100*/) {
+    if (!rendered) {
         saveImage();
         return false;
     }
@@ -270,15 +278,18 @@ bool Zillum::render() {
 void Zillum::initScene() {
     srand(time(nullptr));
     auto scene = setupScene(mWindowWidth, mWindowHeight);
-    scene->buildScene();
+    // The scene is built on the pool the integrator renders with later
+    if (mPool == nullptr) {
+        mPool = std::make_shared<ThreadPool>(ZillumThreads - 1);
+    }
+    scene->buildScene(*mPool);
     mScene = scene;
 }
 
 void Zillum::writeBuffer() {
-    auto resultBuffer = mIntegrator->result();
     for (int i = 0; i < mWindowWidth; i++) {
         for (int j = 0; j < mWindowHeight; j++) {
-            auto result = resultBuffer(i, j) * mIntegrator->mResultScale;
+            auto result = mIntegrator->estimate(i, j);
             result = glm::clamp(result, Vec3f(0.0f), Vec3f(1e8f));
             if (mToneMapping == 1) {
                 result = ToneMapping::filmic(result);
@@ -0,0 +1,337 @@
+#include "ZillumCLI.h"
+#include "Core/ToneMapping.h"
+#include "Utils/ArgParser.h"
+#include "stbIncluder.h"
+
+bool ZillumCLI::init(int argc, char *argv[]) {
+    ArgParser parser("zillum-cli", "Headless batch renderer");
+    auto &opt = mOptions;
+    parser.addOption("--scene", "", &opt.scene, "Scene: bidir, box, material, cornell, original, fireplace, staircase2");
+    parser.addOption("--integrator", "-i", &opt.integrator, "Integrator: path, path2, wpath, lpath, bdpt, bdpt2, tpath, ao, ao2");
+    parser.addOption("--sampler", "-s", &opt.sampler, "Sampler: sobol, zsobol, rng");
+    parser.addOption("--bvh", "", &opt.bvh, "BVH build: sah, binned, middle, equal, hlbvh, sbvh");
+    parser.addOption("--sbvh-budget", "", &opt.sbvhBudget, "Extra references sbvh may create, as a fraction of primitives");
+    parser.addOption("--light-sampler", "", &opt.lightSampler, "Light selection for direct lighting: bvh, power, uniform, the scene's own when not given");
+    parser.addOption("--width", "", &opt.width, "Image width");
+    parser.addOption("--height", "", &opt.height, "Image height");
+    parser.addOption("--spp", "", &opt.spp, "Samples per pixel, 0 for unlimited");
+    parser.addOption("--depth", "-d", &opt.maxDepth, "Max tracing depth, 0 for russian roulette");
+    parser.addOption("--paths", "", &opt.pathsOnePass, "Paths per thread per pass, 0 for one pass per spp");
+    parser.addOption("--threads", "-t", &opt.threads, "Worker threads");
+    parser.addFlag("--pin-threads", "", &opt.pinThreads, "Keep every worker thread on its own core");
+    parser.addOption("--splat", "", &opt.splat, "Film splatting from several threads: locked, atomic, thread, fixed");
+    parser.addFlag("--deterministic", "", &opt.deterministic,
+        "Same image for any thread count, splats to the film in fixed point");
+    parser.addOption("--seed", "", &opt.seed, "Seed of the samplers");
+    parser.addOption("--time", "", &opt.timeBudget, "Time budget in seconds, 0 for unlimited");
+    parser.addOption("--error", "", &opt.targetError, "Stop once the mean relative error of the image is below this, 0 for none");
+    parser.addOption("--adaptive", "", &opt.adaptiveError,
+        "Sample noisy tiles until their relative error is below this, 0 for uniform sampling (path, path2, ao)");
+    parser.addOption("--adaptive-min-spp", "", &opt.adaptiveMinSpp, "Samples per pixel before adaptive sampling starts");
+    parser.addOption("--ao-radius", "", &opt.aoRadius, "Occlusion radius for ao and ao2");
+    parser.addOption("--ao-samples", "", &opt.aoSamples, "Occlusion rays per hit for ao and ao2");
+    parser.addOption("--tonemap", "", &opt.toneMapping, "Tone mapping for LDR output: none, filmic, reinhard, aces");
+    parser.addFlag("--no-gamma", "", &opt.noGamma, "Don't apply gamma correction to LDR output");
+    parser.addOption("--output", "-o", &opt.output, "Output image, .png or .hdr");
+
+    if (!parser.parse(argc, argv)) {
+        return false;
+    }
+    if (opt.width <= 0 || opt.height <= 0 || opt.threads <= 0 || opt.spp < 0 || opt.maxDepth < 0) {
+        Error::bracketLine<0>("Invalid resolution, spp, depth or thread count");
+        return false;
+    }
+    if (opt.toneMapping != "none" && opt.toneMapping != "filmic" && opt.toneMapping != "reinhard" &&
+        opt.toneMapping != "aces") {
+        Error::bracketLine<0>("Unknown tone mapping " + opt.toneMapping);
+        return false;
+    }
+    if (opt.aoSamples <= 0) {
+        Error::bracketLine<0>("Invalid AO sample count");
+        return false;
+    }
+    if (opt.sbvhBudget < 0.0f) {
+        Error::bracketLine<0>("Invalid SBVH budget");
+        return false;
+    }
+    if (opt.adaptiveError < 0.0f || opt.adaptiveMinSpp < 2) {
+        Error::bracketLine<0>("Invalid adaptive error or minimum spp");
+        return false;
+    }
+    if (opt.timeBudget < 0.0f || opt.targetError < 0.0f) {
+        Error::bracketLine<0>("Invalid time or error budget");
+        return false;
+    }
+    // Passes cut to fit a time budget, and --paths, change with the speed and number of threads
+    if (opt.deterministic && (opt.timeBudget > 0.0f || opt.pathsOnePass != 0)) {
+        Error::bracketLine<0>("A deterministic render can't have a time budget or paths per thread");
+        return false;
+    }
+    if (opt.spp == 0 && opt.timeBudget == 0.0f && opt.targetError == 0.0f && opt.adaptiveError == 0.0f) {
+        Error::bracketLine<0>("Unlimited spp requires a time or error budget");
+        return false;
+    }
+    // The scene is built on the same pool the integrator renders with. The main thread works
+    // along with the pool while it waits
+    mPool = std::make_shared<ThreadPool>(opt.threads - 1, opt.pinThreads);
+    return initScene() && initIntegrator();
+}
+
+int ZillumCLI::run() {
+    mIntegrator->reset();
+
+    RenderBudget budget = { mOptions.timeBudget, mOptions.targetError };
+    RenderSession session(mIntegrator, budget, [](const RenderProgress &progress) {
+        std::cout << "  " << std::fixed << std::setprecision(2) << progress.raysPerSecond * 1e-6 << " Mrays/s";
+        if (std::isfinite(progress.error)) {
+            std::cout << ", error " << std::setprecision(4) << progress.error;
+        }
+        if (progress.remaining >= 0.0) {
+            std::cout << ", " << std::setprecision(1) << progress.remaining << "s left";
+        }
+        std::cout << "    " << std::flush;
+    });
+    session.run();
+
+    std::cout << "\n";
+    Error::bracketLine<0>("Rendered " + std::to_string(session.passes()) + " passes in " +
+        std::to_string(session.elapsed()) + "s");
+
+    if (!saveImage(mOptions.output)) {
+        Error::bracketLine<0>("Failed to write " + mOptions.output);
+        return 1;
+    }
+    Error::bracketLine<0>("Image saved to " + mOptions.output);
+    return 0;
+}
+
+bool ZillumCLI::initScene() {
+    const std::pair<const char*, BVHSplitMethod> bvhMethods[] = {
+        { "sah", BVHSplitMethod::SAH },
+        { "binned", BVHSplitMethod::BinnedSAH },
+        { "middle", BVHSplitMethod::Middle },
+        { "equal", BVHSplitMethod::EqualCounts },
+        { "hlbvh", BVHSplitMethod::HLBVH },
+        { "sbvh", BVHSplitMethod::SBVH }
+    };
+    auto method = std::find_if(std::begin(bvhMethods), std::end(bvhMethods),
+        [this](const auto &entry) { return mOptions.bvh == entry.first; });
+    if (method == std::end(bvhMethods)) {
+        Error::bracketLine<0>("Unknown BVH build " + mOptions.bvh);
+        return false;
+    }
+
+    const std::pair<const char*, LightSampleStrategy> lightSamplers[] = {
+        { "bvh", LightSampleStrategy::BVH },
+        { "power", LightSampleStrategy::ByPower },
+        { "uniform", LightSampleStrategy::Uniform }
+    };
+    auto lightSampler = std::find_if(std::begin(lightSamplers), std::end(lightSamplers),
+        [this](const auto &entry) { return mOptions.lightSampler == entry.first; });
+    if (!mOptions.lightSampler.empty() && lightSampler == std::end(lightSamplers)) {
+        Error::bracketLine<0>("Unknown light sampler " + mOptions.lightSampler);
+        return false;
+    }
+
+    auto scene = setupScene(mOptions.scene, mOptions.width, mOptions.height);
+    if (!scene) {
+        Error::bracketLine<0>("Unknown scene " + mOptions.scene);
+        return false;
+    }
+    scene->mBVHSplitMethod = method->second;
+    scene->mSpatialSplitBudget = mOptions.sbvhBudget;
+    if (lightSampler != std::end(lightSamplers)) {
+        scene->mLightSampleStrategy = lightSampler->second;
+    }
+    scene->buildScene(*mPool);
+    mScene = scene;
+    return true;
+}
+
+bool ZillumCLI::initIntegrator() {
+    const auto &opt = mOptions;
+    int spp = opt.spp;
+    int maxDepth = opt.maxDepth;
+    // Bidirectional paths are stored in vertex arrays of TracingDepthLimit, which also bounds them
+    // when only russian roulette ends them
+    int bdptDepth = (maxDepth == 0) ? TracingDepthLimit : std::min(maxDepth, TracingDepthLimit);
+    bool scramble;
+    AdaptiveParam adaptive = { opt.adaptiveError, opt.adaptiveMinSpp };
+
+    if (opt.integrator == "path2") {
+        auto integ = std::make_shared<PathIntegrator2>(mScene, spp, opt.pathsOnePass);
+        integ->mParam.russianRoulette = maxDepth == 0;
+        integ->mParam.maxDepth = maxDepth;
+        integ->mParam.MIS = true;
+        integ->mParam.sampleDirect = true;
+        integ->mAdaptive = adaptive;
+        mIntegrator = integ;
+        scramble = false;
+    }
+    else if (opt.integrator == "wpath") {
+        auto integ = std::make_shared<WavefrontPathIntegrator>(mScene, spp, opt.pathsOnePass);
+        integ->mParam.russianRoulette = maxDepth == 0;
+        integ->mParam.maxDepth = maxDepth;
+        integ->mParam.MIS = true;
+        integ->mParam.sampleDirect = true;
+        mIntegrator = integ;
+        scramble = false;
+    }
+    else if (opt.integrator == "path") {
+        auto integ = std::make_shared<PathIntegrator>(mScene, spp);
+        integ->mParam.russianRoulette = maxDepth == 0;
+        integ->mParam.maxDepth = maxDepth;
+        integ->mParam.MIS = true;
+        integ->mAdaptive = adaptive;
+        mIntegrator = integ;
+        scramble = true;
+    }
+    else if (opt.integrator == "lpath") {
+        auto integ = std::make_shared<LightPathIntegrator>(mScene, opt.pathsOnePass);
+        integ->mParam.russianRoulette = maxDepth == 0;
+        integ->mParam.maxDepth = maxDepth;
+        integ->mParam.maxSpp = spp;
+        mIntegrator = integ;
+        scramble = false;
+    }
+    else if (opt.integrator == "bdpt") {
+        auto integ = std::make_shared<BDPTIntegrator>(mScene, spp);
+        integ->mParam.rrCameraPath = true;
+        integ->mParam.maxCameraDepth = bdptDepth;
+        integ->mParam.rrLightPath = true;
+        integ->mParam.maxLightDepth = bdptDepth;
+        integ->mParam.maxConnectDepth = bdptDepth;
+        mIntegrator = integ;
+        scramble = true;
+    }
+    else if (opt.integrator == "bdpt2") {
+        auto integ = std::make_shared<BDPTIntegrator2>(mScene, spp, opt.pathsOnePass);
+        integ->mParam.rrCameraPath = true;
+        integ->mParam.maxCameraDepth = bdptDepth;
+        integ->mParam.rrLightPath = true;
+        integ->mParam.maxLightDepth = bdptDepth;
+        integ->mParam.maxConnectDepth = bdptDepth;
+        integ->mParam.stochasticConnect = false;
+        integ->mLightSampler = std::make_shared<SobolSampler>(0x12345678 ^ opt.seed, true);
+        mIntegrator = integ;
+        scramble = false;
+    }
+    else if (opt.integrator == "tpath") {
+        auto integ = std::make_shared<TriplePathIntegrator>(mScene, spp, opt.pathsOnePass);
+        integ->mParam.rrCameraPath = maxDepth == 0;
+        integ->mParam.maxCameraDepth = maxDepth;
+        integ->mParam.rrLightPath = maxDepth == 0;
+        integ->mParam.maxLightDepth = maxDepth;
+        mIntegrator = integ;
+        scramble = false;
+    }
+    else if (opt.integrator == "ao") {
+        auto integ = std::make_shared<AOIntegrator>(mScene, spp);
+        integ->mParam.radius = opt.aoRadius;
+        integ->mParam.samplesOneTime = opt.aoSamples;
+        integ->mAdaptive = adaptive;
+        mIntegrator = integ;
+        scramble = true;
+    }
+    else if (opt.integrator == "ao2") {
+        auto integ = std::make_shared<AOIntegrator2>(mScene, spp, opt.pathsOnePass);
+        integ->mParam.radius = opt.aoRadius;
+        integ->mParam.samplesOneTime = opt.aoSamples;
+        mIntegrator = integ;
+        scramble = false;
+    }
+    else {
+        Error::bracketLine<0>("Unknown integrator " + opt.integrator);
+        return false;
+    }
+    // Splats from light paths carry no sample count, their pixels can't be estimated by the mean
+    if (opt.targetError > 0.0f && mIntegrator->splatsLightPaths()) {
+        Error::bracketLine<0>(opt.integrator + " splats light paths and keeps no per pixel error, use a time budget instead");
+        return false;
+    }
+    if (opt.adaptiveError > 0.0f && opt.integrator != "path" && opt.integrator != "path2" && opt.integrator != "ao") {
+        Error::bracketLine<0>("Adaptive sampling is only supported by path, path2 and ao");
+        return false;
+    }
+
+    if (opt.sampler == "rng") {
+        mIntegrator->mSampler = std::make_shared<IndependentSampler>(opt.seed);
+    }
+    else if (opt.sampler == "sobol") {
+        mIntegrator->mSampler = std::make_shared<SobolSampler>(opt.seed, scramble);
+    }
+    else if (opt.sampler == "zsobol") {
+        // Samples are laid out per pixel, integrators tracing paths from anywhere on the film can't use them
+        if (opt.integrator != "path" && opt.integrator != "bdpt" && opt.integrator != "ao") {
+            Error::bracketLine<0>("zsobol is only supported by path, bdpt and ao");
+            return false;
+        }
+        mIntegrator->mSampler = std::make_shared<ZSobolSampler>(spp, opt.width, opt.height, opt.seed);
+    }
+    else {
+        Error::bracketLine<0>("Unknown sampler " + opt.sampler);
+        return false;
+    }
+    if (opt.splat == "locked") {
+        mIntegrator->mSplatMode = FilmSplatMode::Locked;
+    }
+    else if (opt.splat == "atomic") {
+        mIntegrator->mSplatMode = FilmSplatMode::Atomic;
+    }
+    else if (opt.splat == "thread") {
+        mIntegrator->mSplatMode = FilmSplatMode::PerThread;
+    }
+    else if (opt.splat == "fixed") {
+        mIntegrator->mSplatMode = FilmSplatMode::FixedPoint;
+    }
+    else {
+        Error::bracketLine<0>("Unknown splatting mode " + opt.splat);
+        return false;
+    }
+    if (opt.deterministic) {
+        mIntegrator->mSplatMode = FilmSplatMode::FixedPoint;
+    }
+    mIntegrator->mThreads = opt.threads;
+    mIntegrator->mPool = mPool;
+    return true;
+}
+
+bool ZillumCLI::saveImage(const std::string &path) {
+    auto &film = mIntegrator->result();
+    int w = film.width(), h = film.height();
+    bool hdr = path.size() >= 4 && path.compare(path.size() - 4, 4, ".hdr") == 0;
+
+    if (hdr) {
+        std::vector<Spectrum> data(w * h);
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                data[y * w + x] = mIntegrator->estimate(x, y);
+            }
+        }
+        return stbi_write_hdr(path.c_str(), w, h, 3, reinterpret_cast<float*>(data.data()));
+    }
+    std::vector<RGB24> data(w * h);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            data[y * w + x] = RGB24(toDisplay(mIntegrator->estimate(x, y)));
+        }
+    }
+    return stbi_write_png(path.c_str(), w, h, 3, data.data(), w * 3);
+}
+
+Spectrum ZillumCLI::toDisplay(Spectrum color) const {
+    color = glm::clamp(color, Spectrum(0.0f), Spectrum(1e8f));
+    if (mOptions.toneMapping == "filmic") {
+        color = ToneMapping::filmic(color);
+    }
+    else if (mOptions.toneMapping == "reinhard") {
+        color = ToneMapping::reinhard(color);
+    }
+    else if (mOptions.toneMapping == "aces") {
+        color = ToneMapping::ACES(color);
+    }
+    if (!mOptions.noGamma) {
+        color = glm::pow(color, Vec3f(1.0f / 2.2f));
+    }
+    return color;
+}
@@ -0,0 +1,9 @@
+#include "ZillumCLI.h"
+
+int main(int argc, char* argv[]) {
+	ZillumCLI app;
+	if (!app.init(argc, argv)) {
+		return 1;
+	}
+	return app.run();
+}